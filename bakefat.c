@@ -15,12 +15,12 @@
  * !! Write directly to block device on DOS (specified as e.g. a:, c:).
  * !! Exclude FAT header and partition table from boot_bin, making it shorter.
  * !! Add implementation using <windows.h>, which compiles with MSVC, Borland C compiler and Digital Mars C compiler in addition to OpenWatcom C compiler.
- * !! Add support for VHD_SPARSE (SPARSEVHD). !! Experiment with block sizes smaller than 2 MiB. (NTFS sparse files have block size 64 KiB.)
+ * !! Experiment with dynamic VHD (DYNVHD) block sizes smaller than 2 MiB. (NTFS sparse files have block size 64 KiB.)
  * !! Add command-line flag for fewer reserved sectors (minimum: 2 or 3) for FAT32.
  * !! Add command-line flag RNDUUID, to base the VHD UUID on the result of gettimeofday(2) and getpid(2).
  * !! Move all relevant comments from fat16m.nasm to bakefat.c, and remove fat16m.nasm.
  *
- * !! Add feature to copy files to the root directory (like mcopy(1)).
+ * !! Add feature to copy non-system files and directories (like mcopy(1)).
  * !! Create io.sys patch for MS-DOS 3.30.
  * !! Release the MS-DOS io.sys patches.
  * !! Add multisector boot code to detect and boot everything.
@@ -34,6 +34,9 @@
 #define _LARGEFILE64_SOURCE  /* __GLIBC__ lseek64(...). */
 #define _XOPEN_SOURCE  /* __GLIBC__ ftruncate64(...) with `gcc -ansi -pedantic. */
 #define _XOPEN_SOURCE_EXTENDED  /* __GLIBC__ ftruncate64(...). */
+#if defined(__linux__) && !defined(__MMLIBC386__)
+#  define _GNU_SOURCE  /* __GLIBC__ posix_fadvise(...) with `gcc -ansi -pedantic'. */
+#endif
 #ifdef __MMLIBC386__
 #  include <mmlibc386.h>
 #else
@@ -52,6 +55,31 @@
 #  endif
 #endif
 
+#if !defined(__MMLIBC386__) && !defined(BAKEFAT_DOS_OR_WIN32)
+#  define BAKEFAT_POSIX 1  /* opendir(3), stat(2) etc. are available. */
+#  include <dirent.h>
+#  include <errno.h>
+#  include <sys/stat.h>
+#  include <sys/wait.h>  /* waitpid(...) for --batch and --manifest. */
+#  include <signal.h>  /* For --serve. */
+#  include <sys/socket.h>  /* For --serve. */
+#  include <sys/time.h>  /* gettimeofday(...) for --serve. */
+#  include <sys/un.h>  /* For --serve. */
+#  ifdef __linux__
+#    include <sys/ioctl.h>
+#    include <sys/uio.h>
+#    include <sys/syscall.h>  /* __NR_copy_file_range, also for libcs without a copy_file_range(...) wrapper. */
+#    ifdef __GLIBC__  /* Other libcs such as minilibc686 may not have it. */
+#      define BAKEFAT_PWRITEV 1  /* pwritev(...) is available. */
+#    endif
+#    include <linux/fs.h>  /* FICLONERANGE. */
+#    ifdef FIDEDUPERANGE
+#      define BAKEFAT_DEDUPE 1  /* --dedupe is available. */
+#    endif
+#    include <linux/fiemap.h>  /* For THICK. */
+#  endif
+#endif
+
 #ifndef BAKEFAT_VERSION
 #  define BAKEFAT_VERSION 1
 #endif
@@ -80,6 +108,11 @@
 #  define O_BINARY 0
 #endif
 
+#ifdef BAKEFAT_LIBRARY  /* Build libbakefat.a, see bakefat.h. */
+#  include <setjmp.h>
+#  include "bakefat.h"
+#endif
+
 #ifdef __MMLIBC386__
 #  define msg_printf printf_void
 #else
@@ -298,55 +331,576 @@ typedef int32_t sd;
 #  endif
 #endif
 
-static char sbuf[0x200];  /* A single sector. */
-static char *s;  /* Output pointer within sbuf. */
+#define PFILE_ROOT ((ud)-1)  /* Parent index of entries in the root directory. */
+
+struct pfile {  /* A host file or directory to be copied to the image. */
+  const char *host_fn;
+  ud size;  /* File size in bytes. 0 for directories. */
+  ud start_cluster;  /* 0 for an empty file. */
+  ud cluster_count;
+  ud parent;  /* Index of the parent directory in pfiles, or PFILE_ROOT. */
+  ud first_child;  /* Directories only. Index of the first entry in pfiles. The entries of a directory are consecutive in pfiles. */
+  ud child_count;  /* Directories only. */
+  char dos_name[11];  /* Name in directory entry format: 8.3 without the dot, padded with spaces, uppercase. */
+  ub attr;  /* fat_attr_t bitset. */
+  ub is_prealloc;  /* From PREALLOC=. host_fn is the specified name, there is no host file. The data clusters remain holes. */
+#ifdef BAKEFAT_POSIX
+  dev_t host_dev;  /* Directories only. For detecting loops (via symlinks or bind mounts) in TREE=. */
+  ino_t host_ino;  /* Directories only. */
+#endif
+};
+
+#define PFILE_STATIC_CAPACITY 16
+
+#if defined(_M_I86) || defined(__I86__) || defined(_M_I8086) || defined(_M_I286)
+#  define SECTOR_QUEUE_CAPACITY 8U  /* Keep it small for the 64 KiB data segment on DOS 8086. */
+#else
+#  define SECTOR_QUEUE_CAPACITY 128U
+#endif
+
+struct fat_params;
+
+#ifdef BAKEFAT_LIBRARY
+  union memory_block_header {  /* Precedes each memory block allocated by alloc_zero(...). */
+    struct { union memory_block_header *prev, *next; } link;
+    double align_double;  /* For the alignment of the block following the header. */
+    uint64_t align_uint64;
+    void *align_ptr;
+  };
+#  define OPEN_FD_CAPACITY 4U  /* Output, template, host and parent image files at the same time. */
+#endif
+
+/* The state of creating (or editing) an image. All functions use it via
+ * ctx rather than global variables, so that the library (bakefat.h) is
+ * reentrant: each struct bakefat_context has its own.
+ */
+struct bakefat_state {
+  char sbuf[0x200];  /* A single sector. */
+  char *s;  /* Output pointer within sbuf. */
+  int sfd;
+  const char *sfn;
+  /* Dynamic VHD output, see map_output_ofs(...). */
+  ud *vhd_bat;  /* Block Allocation Table: the first sector (bitmap) of each block in the output file, or (ud)-1 if not allocated. */
+  ud vhd_bat_sector_count;  /* Each BAT sector has 0x80 entries. */
+  ud vhd_next_block_sec;  /* The sector offset in the output file where the next block will be allocated. */
+  const char *vhd_parent_fn;  /* If not NULL, the output is a differencing VHD, and this is the filename of the parent (PARENT=). */
+  char vhd_parent_id[0x14];  /* Unique ID (0x10 bytes) and modification time (4 bytes) in the footer of the parent. */
+  /* qcow2 output. If qcow2_l2s is not NULL, the output file is a qcow2 image,
+   * and map_output_ofs(...) allocates its clusters (and the L2 tables
+   * pointing to them) at the end of the output file as they are first
+   * written. The L1 table and the L2 tables are kept in memory (as host
+   * cluster indexes) until finish_qcow2(...).
+   */
+  ud **qcow2_l2s;  /* For each L1 entry: NULL or the L2 table: the host cluster index of each guest cluster, or 0 if not allocated. */
+  ud *qcow2_l1;  /* For each L1 entry: the host cluster index of the L2 table, or 0 if not allocated. */
+  ud qcow2_l1_size;
+  ud qcow2_next_cluster;  /* The host cluster index where the next cluster will be allocated. */
+  ud qcow2_file_cluster_count;  /* The output file has been extended to this many clusters. */
+  ub qcow2_cluster_bits;
+  /* Nonzero iff the output file is not a raw image. Then flush_sectors(...)
+   * and write_pfile_data_range(...) don't write across the boundaries of
+   * blocks of (output_block_sector_mask + 1) sectors, because consecutive
+   * blocks are not contiguous in the output file.
+   */
+  ud output_block_sector_mask;
+  /* Android sparse image (simg) output, see write_simg(...). */
+  ub simg_pass;  /* 0: not simg output; 1: planning pass; 2: output pass. */
+  ub simg_log2_block_size;  /* 12 (4 KiB), or 9 if the image size is not a multiple of 4 KiB. */
+  ud simg_block_count;
+  ud *simg_runs;  /* Start block and end block of each run of blocks written, in ascending order. */
+  ud simg_run_count, simg_run_capacity;
+  ud simg_run_idx;  /* Output pass: the run containing simg_next_block, or the next run. */
+  ud simg_next_block;  /* Output pass: all blocks before it have been written to the output. */
+  char simg_buf[0x1000];  /* Output pass: data of block simg_next_block. */
+  /* Output sector queue, see flush_sectors(...). */
+  char sector_queue_data[SECTOR_QUEUE_CAPACITY][0x200];
+  ud sector_queue_secs[SECTOR_QUEUE_CAPACITY];
+  unsigned sector_queue_count;
+  ud output_syscall_count;  /* Number of seek and write syscalls by flush_sectors(...). Printed for STATS. */
+  ud output_sector_count;  /* Number of sectors written by flush_sectors(...). */
+  struct pfile pfiles_static[PFILE_STATIC_CAPACITY];
+  /* In breadth-first order: entries of the root directory (SYS= files
+   * first, then PREALLOC= files), then the entries of each subdirectory, in the order of the
+   * subdirectories. Clusters are allocated contiguously in this order,
+   * starting at cluster 2 (or after the FAT32 root directory), so the
+   * directories and files can be written in ascending sector order.
+   */
+  struct pfile *pfiles;
+  ud pfile_count, pfile_capacity;
+  ud sys_file_count;  /* The first sys_file_count pfiles are from SYS=. */
+  ud root_child_count;  /* The first root_child_count pfiles are in the root directory. */
+  ud rootdir_cluster_count;  /* Number of clusters in the FAT32 root directory. 0 for FAT12 and FAT16. */
+  ud used_cluster_count;  /* Number of clusters used by the FAT32 root directory and pfiles. */
+  ud copy_buf[0x1000 / sizeof(ud)];  /* For copying file data. Made of ud for is_copy_buf_zero(...). */
+  /* The FAT writer. It builds the FAT sectors in sbuf, in ascending order. */
+  const struct fat_params *fatw_fpp;
+  ud fatw_fat_sec_ofs;  /* Sector offset of the first FAT. */
+  ud fatw_sec;  /* Index of the FAT sector in sbuf, relative to fatw_fat_sec_ofs. */
+  ub fatw_fat_count;  /* Number of FATs to write sbuf to. */
+  /* resize_fat_image(...) and defrag_fat_image(...). Old cluster c
+   * becomes new cluster rsz_map[c - 2] (0 if free). In resize_fat_image(...),
+   * the data of most old clusters stays in place, so rsz_map[c - 2] is
+   * c - rsz_shift for them, but the chains using old clusters 2 ...
+   * rsz_shift + 1 (which are in the way of the grown FATs) are relocated.
+   */
+  char *rsz_fat;  /* The old FAT. */
+  ub rsz_fat_fstype;
+  ub rsz_log2_spc;
+  ud rsz_old_cluster_count;
+  ud rsz_shift;
+  ud rsz_clusters_sec_ofs;  /* New sector offset of cluster 2. */
+  ud *rsz_map;
+  /* defrag_fat_image(...), in addition to the rsz_... fields. */
+  ud dfg_bad_value;  /* FAT entry value of a bad cluster. */
+  ud dfg_next_cluster;  /* The next new cluster to allocate. */
+  ud *dfg_dirs;  /* Old start clusters of the directories, in breadth-first order. 0 is the FAT12 or FAT16 root directory. */
+  ud dfg_dir_count, dfg_dir_capacity;
+#ifdef BAKEFAT_POSIX
+  DIR *open_dir;  /* Directory being read by add_host_dir_entries(...). Not NULL only during the call, so it can be closed on error. */
+#endif
+#ifdef BAKEFAT_LIBRARY
+  jmp_buf *exit_jmp;  /* Where exit(...) jumps to. */
+  union memory_block_header *memory_blocks;  /* Doubly linked list of the blocks allocated by alloc_zero(...), for freeing them in bakefat_free_context(...). */
+  int open_fds[OPEN_FD_CAPACITY];  /* File descriptors opened by open_file(...), for closing them on error. -1 if not used. */
+#endif
+};
+
+#ifdef BAKEFAT_LIBRARY
+#  ifdef BAKEFAT_THREAD_LOCAL  /* Specified with -DBAKEFAT_THREAD_LOCAL=... . Empty for a single-threaded library. */
+#  elif defined(__GNUC__) || defined(__clang__)
+#    define BAKEFAT_THREAD_LOCAL __thread
+#  elif defined(_MSC_VER)
+#    define BAKEFAT_THREAD_LOCAL __declspec(thread)
+#  elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_THREADS__)
+#    define BAKEFAT_THREAD_LOCAL _Thread_local
+#  else
+#    error No thread-local storage class known for this compiler. Compile with -DBAKEFAT_THREAD_LOCAL= for a library not usable from multiple threads.
+#  endif
+  static BAKEFAT_THREAD_LOCAL struct bakefat_state *ctx;  /* Set by each library function (see bakefat.h) for the duration of the call. */
+  /* Makes the library function return exit_code instead of exiting the process. */
+  static noreturn void bakefat_exit(int exit_code) { longjmp(*ctx->exit_jmp, exit_code + 1); }
+#  undef  exit
+#  define exit(exit_code) bakefat_exit(exit_code)
+#else
+  static struct bakefat_state bakefat_static_state;
+#  define ctx (&bakefat_static_state)
+#endif
 
-static int sfd;
-static const char *sfn;
+/* Initializes *sp to an empty state. */
+static void init_state(struct bakefat_state *sp) {
+  memset(sp, '\0', sizeof(*sp));
+  sp->pfiles = sp->pfiles_static;
+  sp->pfile_capacity = PFILE_STATIC_CAPACITY;
+#ifdef BAKEFAT_LIBRARY
+  memset(sp->open_fds, -1, sizeof(sp->open_fds));
+#endif
+}
 
-static inline void db(ub x) { *s++ = x; }
+static inline void db(ub x) { *ctx->s++ = x; }
 /* Serializing integers in little endian. */
 #ifdef IS_LE
-  static inline void dw(uw x) { *(uw*)s = x; s += 2; }
-  static inline void dd(ud x) { *(ud*)s = x; s += 4; }
+  static inline void dw(uw x) { *(uw*)ctx->s = x; ctx->s += 2; }
+  static inline void dd(ud x) { *(ud*)ctx->s = x; ctx->s += 4; }
   static inline uw gw(const char *p) { return *(const uw*)p; }
+  static inline ud gd(const char *p) { return *(const ud*)p; }
 #else
   static uw gw(const char *p) { return ((const unsigned char*)p)[0] | ((const unsigned char*)p)[1] << 8; }
-  static void dw(uw x) { *s++ = x & 0xff; *s++ = x >> 8; }
+  static ud gd(const char *p) { return gw(p) | (ud)gw(p + 2) << 16; }
+  static void dw(uw x) { *ctx->s++ = x & 0xff; *ctx->s++ = x >> 8; }
   /* !! Is this shorter: static void dd(ud x) { dw(x); dw(x >> 16); } */
-  static void dd(ud x) { *s++ = x & 0xff; *s++ = (x >> 8) & 0xff; *s++ = (x >> 16) & 0xff; *s++ = x >> 24; }
+  static void dd(ud x) { *ctx->s++ = x & 0xff; *ctx->s++ = (x >> 8) & 0xff; *ctx->s++ = (x >> 16) & 0xff; *ctx->s++ = x >> 24; }
 #endif
 
 /* Serializing integers in big endian. */
-static void dwb(uw x) { *s++ = x >> 8; *s++ = x & 0xff; }
+static void dwb(uw x) { *ctx->s++ = x >> 8; *ctx->s++ = x & 0xff; }
 /* !! Is this shorter: static void ddb(ud x) { dwb(x >> 16); dwb(x); } */
-static void ddb(ud x) { *s++ = x >> 24; *s++ = (x >> 16) & 0xff; *s++ = (x >> 8) & 0xff; *s++ = x & 0xff; }
+static void ddb(ud x) { *ctx->s++ = x >> 24; *ctx->s++ = (x >> 16) & 0xff; *ctx->s++ = (x >> 8) & 0xff; *ctx->s++ = x & 0xff; }
 /* Emits (uint64_t)x << 9 in big endian, in 8 bytes. Avoids overflow. */
 static void dsb(ud x) {
-  *s++ = 0; *s++ = 0; *s++ = x >> 31;
+  *ctx->s++ = 0; *ctx->s++ = 0; *ctx->s++ = x >> 31;
   x <<= 1;
-  *s++ = x >> 24; *s++ = (x >> 16) & 0xff; *s++ = (x >> 8) & 0xff; *s++ = x & 0xff; *s++ = 0;
+  *ctx->s++ = x >> 24; *ctx->s++ = (x >> 16) & 0xff; *ctx->s++ = (x >> 8) & 0xff; *ctx->s++ = x & 0xff; *ctx->s++ = 0;
 }
 
-static void write_sector(ud sofs) {
-  const uint64_t ofs = (uint64_t)sofs << 9;
-  if ((uint64_t)bakefat_lseek64(sfd, ofs, SEEK_SET) != ofs) {
-    msg_printf("fatal: error seeking to sector 0x%x in output file: %s\n", (unsigned)sofs, sfn);
+/* It doesn't seek (i.e. it doesn't modify the file pointer). If it grows the file, it fills with NULs. */
+static void set_file_size_scount(ud scount) {
+  const uint64_t ofs = (uint64_t)scount << 9;
+  if (bakefat_ftruncate64(ctx->sfd, ofs) != 0) {  /* It doesn't seek (i.e. it doesn't modify the file pointer). If it grows the file, it fills with NULs. */
+    msg_printf("fatal: error setting the size of output file to 0x%x sectors: %s\n", (unsigned)scount, ctx->sfn);
     exit(2);
   }
-  if ((size_t)write(sfd, sbuf, sizeof(sbuf)) != sizeof(sbuf)) {
-    msg_printf("fatal: error writing to output file: %s\n", sfn);
+}
+
+/* Dynamic VHD output. If vhd_bat is not NULL, the output file is a dynamic
+ * VHD, and map_output_ofs(...) translates the byte offsets of the disk image
+ * to byte offsets in the output file, allocating 2 MiB blocks (each
+ * preceded by its sector bitmap) at the end of the output file as they are
+ * first written.
+ */
+#define VHD_LOG2_BLOCK_SECTORS 12  /* 2 MiB, the default of Virtual PC, Hyper-V and QEMU. */
+#define VHD_BITMAP_SECTOR_COUNT 1U  /* 1 bit per sector of the block, rounded up to a multiple of 0x200 bytes. */
+#define VHD_BAT_SEC_OFS 3U  /* The VHD footer copy and the 0x400-byte dynamic disk header precede the BAT. */
+
+/* Writes size bytes from buf to byte offset ofs of the output file, without
+ * offset translation.
+ */
+static void write_output_raw(uint64_t ofs, const void *buf, unsigned size) {
+  if ((uint64_t)bakefat_lseek64(ctx->sfd, ofs, SEEK_SET) != ofs || (size_t)write(ctx->sfd, buf, size) != size) {
+    msg_printf("fatal: error writing to output file: %s\n", ctx->sfn);
     exit(2);
   }
 }
 
-/* It doesn't seek (i.e. it doesn't modify the file pointer). If it grows the file, it fills with NULs. */
-static void set_file_size_scount(ud scount) {
-  const uint64_t ofs = (uint64_t)scount << 9;
-  if (bakefat_ftruncate64(sfd, ofs) != 0) {  /* It doesn't seek (i.e. it doesn't modify the file pointer). If it grows the file, it fills with NULs. */
-    msg_printf("fatal: error setting the size of output file to 0x%x sectors: %s\n", (unsigned)scount, sfn);
+/* Allocates a zero-initialized memory block. Exits on out of memory. */
+static void *alloc_zero(size_t size) {
+  void *p;
+#ifdef __MMLIBC386__
+  if ((p = malloc_simple_unaligned(size)) != NULL) memset(p, 0, size);
+#else
+#  ifdef BAKEFAT_LIBRARY  /* Also link the block to ctx->memory_blocks, so that bakefat_free_context(...) can free it. */
+  union memory_block_header *hp = NULL;
+  if (size <= (size_t)-1 - sizeof(*hp) && (hp = (union memory_block_header*)calloc(1, sizeof(*hp) + size)) != NULL) {
+    if ((hp->link.next = ctx->memory_blocks) != NULL) hp->link.next->link.prev = hp;
+    ctx->memory_blocks = hp++;
+  }
+  p = hp;
+#  else
+  p = calloc(1, size);
+#  endif
+#endif
+  if (!p) {
+    msg_printf("fatal: out of memory\n");
+    exit(2);
+  }
+  return p;
+}
+
+/* Frees a memory block allocated by alloc_zero(...). p may be NULL. */
+static void free_memory(void *p) {
+#ifdef __MMLIBC386__
+  (void)p;  /* There is no free(...), the block is leaked. */
+#else
+#  ifdef BAKEFAT_LIBRARY
+  union memory_block_header *hp;
+  if (!p) return;
+  hp = (union memory_block_header*)p - 1;
+  if (hp->link.prev) { hp->link.prev->link.next = hp->link.next; } else { ctx->memory_blocks = hp->link.next; }
+  if (hp->link.next) hp->link.next->link.prev = hp->link.prev;
+  p = hp;
+#  endif
+  free(p);
+#endif
+}
+
+/* Opens a file like open(2). In the library, it also records the file
+ * descriptor in ctx->open_fds, so that it gets closed on error.
+ */
+static int open_file(const char *pathname, int flags, int mode) {
+  const int fd = open(pathname, flags, mode);
+#ifdef BAKEFAT_LIBRARY
+  unsigned i;
+  if (fd >= 0) {
+    for (i = 0; i < OPEN_FD_CAPACITY && ctx->open_fds[i] >= 0; ++i) {}
+    if (i == OPEN_FD_CAPACITY) {
+      close(fd);
+      msg_printf("fatal: ASSERT_OPEN_FD_CAPACITY\n");
+      exit(2);
+    }
+    ctx->open_fds[i] = fd;
+  }
+#endif
+  return fd;
+}
+
+/* Closes a file opened by open_file(...). */
+static void close_file(int fd) {
+#ifdef BAKEFAT_LIBRARY
+  unsigned i;
+  for (i = 0; i < OPEN_FD_CAPACITY; ++i) {
+    if (ctx->open_fds[i] == fd) ctx->open_fds[i] = -1;
+  }
+#endif
+  close(fd);
+}
+
+/* Returns 1 iff the first size bytes at a and at b are the same. mmlibc386 doesn't have memcmp(...). */
+static ub is_same_bytes(const void *a, const void *b, size_t size) {
+  const char *p = (const char*)a, *q = (const char*)b;
+  for (; size && *p == *q; --size, ++p, ++q) {}
+  return size == 0;
+}
+
+/* Returns a new host cluster index in the qcow2 output file. */
+static ud alloc_qcow2_cluster(void) {
+  if (ctx->qcow2_next_cluster == ctx->qcow2_file_cluster_count) {  /* Extend the output file in 1 MiB steps, filling it with NUL bytes (holes). */
+    ctx->qcow2_file_cluster_count += (ud)1 << (20 - ctx->qcow2_cluster_bits);
+    set_file_size_scount(ctx->qcow2_file_cluster_count << (ctx->qcow2_cluster_bits - 9));
+  }
+  return ctx->qcow2_next_cluster++;
+}
+
+static uint64_t map_output_ofs(uint64_t ofs) {
+  const ud block = (ud)(ofs >> (VHD_LOG2_BLOCK_SECTORS + 9));
+  ud sec;
+  char bitmap[0x200];
+  if (ctx->qcow2_l2s) {
+    const ud guest_cluster = (ud)(ofs >> ctx->qcow2_cluster_bits);
+    const ud l1_idx = guest_cluster >> (ctx->qcow2_cluster_bits - 3), l2_idx = guest_cluster & (((ud)1 << (ctx->qcow2_cluster_bits - 3)) - 1U);
+    ud *l2;
+    if ((l2 = ctx->qcow2_l2s[l1_idx]) == NULL) {
+      ctx->qcow2_l1[l1_idx] = alloc_qcow2_cluster();
+      l2 = ctx->qcow2_l2s[l1_idx] = (ud*)alloc_zero((size_t)sizeof(ud) << (ctx->qcow2_cluster_bits - 3));
+    }
+    if (l2[l2_idx] == 0) l2[l2_idx] = alloc_qcow2_cluster();
+    return ((uint64_t)l2[l2_idx] << ctx->qcow2_cluster_bits) + (ofs & (((ud)1 << ctx->qcow2_cluster_bits) - 1U));
+  }
+  if (!ctx->vhd_bat) return ofs;
+#  ifdef DEBUG
+    if (block >= ctx->vhd_bat_sector_count << 7) {
+      msg_printf("fatal: ASSERT_VHD_BLOCK_OUT_OF_RANGE\n");
+      exit(2);
+    }
+#  endif
+  if ((sec = ctx->vhd_bat[block]) == (ud)-1) {
+    sec = ctx->vhd_bat[block] = ctx->vhd_next_block_sec;
+    ctx->vhd_next_block_sec += VHD_BITMAP_SECTOR_COUNT + ((ud)1 << VHD_LOG2_BLOCK_SECTORS);
+    set_file_size_scount(ctx->vhd_next_block_sec);  /* The block data is NUL bytes (a hole in a sparse file) until written. */
+    memset(bitmap, ctx->vhd_parent_fn ? 0 : 0xff, sizeof(bitmap));  /* Dynamic: all sectors of the block are present. Differencing: none of them, mark_vhd_sectors(...) will mark the written ones, the others are read from the parent. */
+    write_output_raw((uint64_t)sec << 9, bitmap, sizeof(bitmap));
+  }
+  return ((uint64_t)(sec + VHD_BITMAP_SECTOR_COUNT) << 9) + (ofs & (((ud)1 << (VHD_LOG2_BLOCK_SECTORS + 9)) - 1U));
+}
+
+/* Marks count sectors starting at sector sec (all in the same block) as
+ * present in the sector bitmap of the block in a differencing VHD.
+ */
+static void mark_vhd_sectors(ud sec, ud count) {
+  const uint64_t bitmap_ofs = (uint64_t)ctx->vhd_bat[sec >> VHD_LOG2_BLOCK_SECTORS] << 9;
+  char bitmap[0x200];
+  if ((uint64_t)bakefat_lseek64(ctx->sfd, bitmap_ofs, SEEK_SET) != bitmap_ofs || (size_t)read(ctx->sfd, bitmap, 0x200) != 0x200) {
+    msg_printf("fatal: error reading VHD block bitmap from output file: %s\n", ctx->sfn);
     exit(2);
   }
+  for (sec &= ((ud)1 << VHD_LOG2_BLOCK_SECTORS) - 1U; count; --count, ++sec) {
+    bitmap[sec >> 3] |= 0x80U >> (sec & 7U);  /* Most significant bit first. */
+  }
+  write_output_raw(bitmap_ofs, bitmap, 0x200);
+}
+
+/* Android sparse image (simg) output to a pipe (output filename -), for
+ * streaming. Since the simg header contains the number of chunks, and each
+ * chunk header contains its size, create_fat(...) is run twice: the
+ * planning pass (simg_pass == 1) only collects the runs of blocks written
+ * (without reading host file data), and the output pass (simg_pass == 2)
+ * writes a DONT_CARE chunk for each hole and a RAW chunk for each run. The
+ * output must be written in ascending offset order, and only one block is
+ * buffered.
+ */
+#define SIMG_MAGIC 0xed26ff3aUL
+#define SIMG_CHUNK_TYPE_RAW 0xcac1U
+#define SIMG_CHUNK_TYPE_DONT_CARE 0xcac3U
+
+static void write_simg_raw(const void *buf, unsigned size) {
+  if ((size_t)write(ctx->sfd, buf, size) != size) {
+    msg_printf("fatal: error writing to output file: %s\n", ctx->sfn);
+    exit(2);
+  }
+}
+
+static void write_simg_chunk_header(uw chunk_type, ud block_count) {
+  char *const old_s = ctx->s;
+  char header[0xc];
+  ctx->s = header;
+  dw(chunk_type);
+  dw(0);  /* .reserved. */
+  dd(block_count);
+  dd(0xcU + (chunk_type == SIMG_CHUNK_TYPE_RAW ? block_count << ctx->simg_log2_block_size : 0U));  /* .total_size, including this header. */
+  ctx->s = old_s;
+  write_simg_raw(header, sizeof(header));
+}
+
+/* Starts the planning pass for an image of sector_count sectors. */
+static void start_simg(ud sector_count) {
+  ctx->simg_pass = 1;
+  ctx->simg_log2_block_size = (sector_count & 7U) ? 9 : 12;
+  ctx->simg_block_count = sector_count >> (ctx->simg_log2_block_size - 9);
+  ctx->simg_run_count = 0;
+}
+
+/* Output pass: writes the RAW chunk header of the run starting at simg_next_block (if any). */
+static void start_simg_run(void) {
+  if (ctx->simg_run_idx < ctx->simg_run_count && ctx->simg_next_block == ctx->simg_runs[2 * ctx->simg_run_idx]) write_simg_chunk_header(SIMG_CHUNK_TYPE_RAW, ctx->simg_runs[2 * ctx->simg_run_idx + 1] - ctx->simg_next_block);
+}
+
+/* Writes the simg header, and starts the output pass. */
+static void start_simg_output(void) {
+  char *const old_s = ctx->s;
+  char header[0x1c];
+  ud chunk_count = ctx->simg_run_count, end = 0, i;
+  for (i = 0; i < ctx->simg_run_count; end = ctx->simg_runs[2 * i++ + 1]) {
+    if (ctx->simg_runs[2 * i] != end) ++chunk_count;  /* DONT_CARE chunk before the run. */
+  }
+  if (end != ctx->simg_block_count) ++chunk_count;
+  ctx->s = header;
+  dd(SIMG_MAGIC);
+  dw(1);  /* .major_version. */
+  dw(0);  /* .minor_version. */
+  dw(0x1c);  /* .file_header_size. */
+  dw(0xc);  /* .chunk_header_size. */
+  dd((ud)1 << ctx->simg_log2_block_size);
+  dd(ctx->simg_block_count);
+  dd(chunk_count);
+  dd(0);  /* .image_checksum: not used. */
+  ctx->s = old_s;
+  write_simg_raw(header, sizeof(header));
+  ctx->simg_pass = 2;
+  ctx->simg_run_idx = ctx->simg_next_block = 0;
+  memset(ctx->simg_buf, 0, sizeof(ctx->simg_buf));
+  start_simg_run();
+}
+
+/* Output pass: writes the chunk headers and the blocks before block. */
+static void write_simg_until(ud block) {
+  ud end;
+  while (ctx->simg_next_block < block) {
+    if (ctx->simg_run_idx < ctx->simg_run_count && ctx->simg_next_block >= ctx->simg_runs[2 * ctx->simg_run_idx]) {  /* Within a run. */
+      write_simg_raw(ctx->simg_buf, 1U << ctx->simg_log2_block_size);
+      memset(ctx->simg_buf, 0, sizeof(ctx->simg_buf));
+      if (++ctx->simg_next_block == ctx->simg_runs[2 * ctx->simg_run_idx + 1]) ++ctx->simg_run_idx;
+    } else {  /* Within a hole. */
+      end = ctx->simg_run_idx < ctx->simg_run_count ? ctx->simg_runs[2 * ctx->simg_run_idx] : ctx->simg_block_count;
+      write_simg_chunk_header(SIMG_CHUNK_TYPE_DONT_CARE, end - ctx->simg_next_block);
+      ctx->simg_next_block = end;
+      start_simg_run();
+    }
+  }
+}
+
+/* Adds size bytes at byte offset ofs of the disk image to the simg output.
+ * In the planning pass, buf is not used, and it can be NULL.
+ */
+static void write_simg(uint64_t ofs, const char *buf, ud size) {
+  ud block, end, *runs;
+  unsigned n;
+  if (!size) return;
+  block = (ud)(ofs >> ctx->simg_log2_block_size);
+  if (ctx->simg_pass == 1) {
+    end = (ud)((ofs + size - 1U) >> ctx->simg_log2_block_size) + 1U;
+    if (ctx->simg_run_count && block <= ctx->simg_runs[2 * ctx->simg_run_count - 1]) {
+      if (block < ctx->simg_runs[2 * ctx->simg_run_count - 2]) goto error_order;
+      if (end > ctx->simg_runs[2 * ctx->simg_run_count - 1]) ctx->simg_runs[2 * ctx->simg_run_count - 1] = end;
+    } else {
+      if (ctx->simg_run_count == ctx->simg_run_capacity) {
+        ctx->simg_run_capacity = ctx->simg_run_capacity ? ctx->simg_run_capacity << 1 : 64U;
+        runs = (ud*)alloc_zero((size_t)ctx->simg_run_capacity * 2U * sizeof(ud));
+        if (ctx->simg_run_count) memcpy(runs, ctx->simg_runs, (size_t)ctx->simg_run_count * 2U * sizeof(ud));
+        free_memory(ctx->simg_runs);
+        ctx->simg_runs = runs;
+      }
+      ctx->simg_runs[2 * ctx->simg_run_count] = block;
+      ctx->simg_runs[2 * ctx->simg_run_count++ + 1] = end;
+    }
+    return;
+  }
+  for (; size; ofs += n, buf += n, size -= n, block = (ud)(ofs >> ctx->simg_log2_block_size)) {
+    if (block < ctx->simg_next_block) { error_order:
+      msg_printf("fatal: ASSERT_SIMG_OUTPUT_NOT_ASCENDING\n");
+      exit(2);
+    }
+    write_simg_until(block);
+    n = (1U << ctx->simg_log2_block_size) - ((unsigned)ofs & ((1U << ctx->simg_log2_block_size) - 1U));
+    if (n > size) n = (unsigned)size;
+    memcpy(ctx->simg_buf + ((unsigned)ofs & ((1U << ctx->simg_log2_block_size) - 1U)), buf, n);
+  }
+}
+
+/* Returns true iff the output sector sec is the first sector of a VHD
+ * block or qcow2 cluster, so output written to the previous sector can't continue to it.
+ */
+#define is_output_block_start(sec) (ctx->output_block_sector_mask && !((sec) & ctx->output_block_sector_mask))
+
+/* Output sector queue. write_sector(...) adds sbuf to it, and
+ * flush_sectors(...) writes the queued sectors in ascending order, with a
+ * single seek and write (pwritev(2) on Linux) per contiguous run. This
+ * makes e.g. the FAT sectors written to both FATs alternately take much
+ * fewer syscalls.
+ */
+static void flush_sectors(void) {
+  unsigned order[SECTOR_QUEUE_CAPACITY], i, j, k;
+  ud sec;
+  uint64_t ofs;
+#ifdef BAKEFAT_PWRITEV
+  struct iovec iov[SECTOR_QUEUE_CAPACITY];
+#endif
+  for (i = 0; i < ctx->sector_queue_count; ++i) {  /* Insertion sort of the sector indexes. There are only a few of them. */
+    sec = ctx->sector_queue_secs[i];
+    for (j = i; j && ctx->sector_queue_secs[order[j - 1]] > sec; --j) {
+      order[j] = order[j - 1];
+    }
+    order[j] = i;
+  }
+  for (i = 0; i < ctx->sector_queue_count; i = j) {
+    sec = ctx->sector_queue_secs[order[i]];
+    for (j = i + 1; j < ctx->sector_queue_count && ctx->sector_queue_secs[order[j]] == sec + (j - i) && !is_output_block_start(sec + (j - i)); ++j) {}  /* Find the end of the contiguous run. */
+    if (ctx->simg_pass) {
+      for (k = i; k != j; ++k) {
+        write_simg((uint64_t)(sec + (k - i)) << 9, ctx->sector_queue_data[order[k]], 0x200);
+      }
+      continue;
+    }
+    ofs = map_output_ofs((uint64_t)sec << 9);
+#ifdef BAKEFAT_PWRITEV
+    for (k = i; k != j; ++k) {
+      iov[k - i].iov_base = ctx->sector_queue_data[order[k]];
+      iov[k - i].iov_len = 0x200;
+    }
+    if (pwritev(ctx->sfd, iov, j - i, ofs) != (ssize_t)((j - i) << 9)) goto error_writing;
+    ++ctx->output_syscall_count;
+#else
+    if ((uint64_t)bakefat_lseek64(ctx->sfd, ofs, SEEK_SET) != ofs) {
+      msg_printf("fatal: error seeking to sector 0x%x in output file: %s\n", (unsigned)sec, ctx->sfn);
+      exit(2);
+    }
+    for (k = i; k != j; ++k) {
+      if ((size_t)write(ctx->sfd, ctx->sector_queue_data[order[k]], 0x200) != 0x200) goto error_writing;
+    }
+    ctx->output_syscall_count += 1U + (j - i);
+#endif
+    ctx->output_sector_count += j - i;
+    if (ctx->vhd_parent_fn) mark_vhd_sectors(sec, j - i);
+  }
+  ctx->sector_queue_count = 0;
+  return;
+ error_writing:
+  msg_printf("fatal: error writing to output file: %s\n", ctx->sfn);
+  exit(2);
+}
+
+/* Prints the number of sectors and bytes written and syscalls used by
+ * flush_sectors(...) if is_stats (STATS) or in DEBUG builds.
+ */
+static void print_output_stats(ub is_stats) {
+#ifdef DEBUG
+  is_stats = 1;
+#endif
+  if (is_stats) {
+    msg_printf("info: output: wrote 0x%lx sectors (%lu KiB) in %lu syscalls\n", (unsigned long)ctx->output_sector_count, (unsigned long)(ctx->output_sector_count >> 1), (unsigned long)ctx->output_syscall_count);
+  }
+  ctx->output_sector_count = ctx->output_syscall_count = 0;
+}
+
+/* Queues sbuf to be written to sector sofs of the output file. Call
+ * flush_sectors(...) before accessing the output file in other ways.
+ */
+static void write_sector(ud sofs) {
+  unsigned i;
+  for (i = 0; i < ctx->sector_queue_count && ctx->sector_queue_secs[i] != sofs; ++i) {}  /* Overwrite if already queued. */
+  if (i == SECTOR_QUEUE_CAPACITY) {
+    flush_sectors();
+    i = 0;
+  }
+  if (i == ctx->sector_queue_count) ctx->sector_queue_secs[ctx->sector_queue_count++] = sofs;
+  memcpy(ctx->sector_queue_data[i], ctx->sbuf, 0x200);
 }
 
 struct fat_common_params {
@@ -373,8 +927,9 @@ struct fat_params {
   ub default_fat_count;
   ub fat_count;  /* 0 (unspecified), 1 or 2. */
   ub fat_fstype;  /* 0 (unspecified), 12, 16 or 32. */
-  ub vhd_mode;  /* vhd_mode_t. 0 (unspecified), VHD_NOVHD == 1 (no VHD footer), VHD_FIXED == 2 (add fixed-size VHD footer). */
+  ub vhd_mode;  /* vhd_mode_t. 0 (unspecified), VHD_NOVHD == 1 (no VHD footer), VHD_FIXED == 2 (add fixed-size VHD footer), VHD_DYNAMIC == 3 (dynamic VHD), VHD_DIFFERENCING == 4 (differencing VHD), VHD_QCOW2 == 5 (qcow2 instead of VHD). */
   ub os_compat;  /* os_compat_t. Operating system compatibility bitset. Default is 0 (no compatibility enforced). */
+  signed char log2_size;  /* 0 (unspecified), -1 (FAT12 floppy preset), or log2 of the HDD image size in bytes. */
 };
 
 struct fat12_preset {
@@ -403,6 +958,16 @@ static noreturn void fatal0(const char *msg) {
   exit(2);
 }
 
+static noreturn void bad_usage0(const char *msg) {
+  msg_printf("fatal: %s\n", msg);
+  exit(1);
+}
+
+static noreturn void bad_usage1(const char *msg, const char *arg) {
+  msg_printf("fatal: %s: %s\n", msg, arg);
+  exit(1);
+}
+
 static const char *hdd_size_presets_m_21[] = {
     "2M", "4M", "8M", "16M", "32M", "64M", "128M", "256M", "512M", "1024M",
     "2048M", "4096M", "8192M", "16384M", "32768M", "65536M", "131072M",
@@ -459,8 +1024,11 @@ enum vhd_mode_t {  /* VHD mode. */
   VHD_UNKNOWN = 0,
   VHD_NOVHD = 1,  /* No VHD footer, create raw disk image. */
   VHD_FIXED = 2,  /* Fixed-size VHD. Same value as in the footer and in qemu-2.11.1/block/vpc.c. */
-  VHD_DYNAMIC = 3  /* Dynamic (sparse) VHD. Currently not supported. Same value as in the footer and in qemu-2.11.1/block/vpc.c. */
+  VHD_DYNAMIC = 3,  /* Dynamic (sparse) VHD. Same value as in the footer and in qemu-2.11.1/block/vpc.c. */
+  VHD_DIFFERENCING = 4,  /* Differencing VHD (child of a parent VHD). Same value as in the footer. */
+  VHD_QCOW2 = 5  /* No VHD, create qcow2 disk image (for QEMU) instead of raw. */
 };
+#define IS_VHD(vhd_mode) ((vhd_mode) >= VHD_FIXED && (vhd_mode) <= VHD_DIFFERENCING)
 
 enum os_compat_t {  /* Operating system compatibility bitset. */
   OSC_DOS3      = 1 << 3,  /* DOS 3.30--.    No FAT32 or 1FAT support. Limited HDD size support (16M and 32M only in bakefat). Must use 2K cluster size on HDD. Must use RDEC=512 for booting from HDD. Must use RSC=1. No 2880K support. No cluster size 32K on floppy support. No >=1K cluster size on 160K, 180K and 1440K floppy support. */
@@ -480,510 +1048,3172 @@ enum os_compat_t {  /* Operating system compatibility bitset. */
  */
 #define VHD_MAX_SECTORS 0xff000000U
 
-static void create_fat(const struct fat_params *fpp) {
-  const ud fat_sector_size = 0x200;
-  const ud fat_rootdir_sector_count = (ud)fpp->fcp.rootdir_entry_count >> 4;
-  const ud fat_fat_sec_ofs = fpp->hidden_sector_count + fpp->reserved_sector_count;
-  const ud fat_rootdir_sec_ofs = fat_fat_sec_ofs + ((ud)fpp->fcp.sectors_per_fat << (fpp->fat_count - 1U));
-  const ud fat_clusters_sec_ofs = fat_rootdir_sec_ofs + fat_rootdir_sector_count;
-  const uw first_boot_sector_copy_sec_ofs = (fpp->fat_fstype != 32 || fpp->reserved_sector_count <= 2U) ? 0U : fpp->reserved_sector_count < 6U ? 2U : 6U;  /* 6 was created by Linux mkfs.vfat(1), also for Windows XP. */
-  ud checksum, vhd_sector_count = 0;
-#  ifdef DEBUG
-    /* We have the +2 here because clusters 0 and 1 have a next-pointer in the FATs, but they are not stored on disk. */
-    const ud min_sectors_per_fat =
-        fpp->fat_fstype == 32 ? (fpp->fcp.cluster_count + (2U + 0x7fU)) >> 7 :
-        fpp->fat_fstype == 16 ? (fpp->fcp.cluster_count + (2U + 0xffU)) >> 8 :
-        /* FAT12: */ ((((fpp->fcp.cluster_count + 2) * 3 + 1) >> 1) + 0x1ff) >> 9;
-    const ud min_sector_count = fat_clusters_sec_ofs - fpp->hidden_sector_count + ((ud)fpp->fcp.cluster_count << fpp->fcp.log2_sectors_per_cluster);
-    const ud max_sector_count = min_sector_count + (ud)(1 << fpp->fcp.log2_sectors_per_cluster) - 1;
-    /* Rootdir entry count must be a multiple of 0x10.  ; Some DOS msload boot code relies on this (i.e. rounding down == rounding up). */
-    if (fpp->fat_fstype != 12 && fpp->fat_fstype != 16 && fpp->fat_fstype != 32) fatal0("ASSERT_BAD_FAT_FSTYPE");
-    if ((fpp->fat_count - 1U) > 2U - 1U) fatal0("ASSERT_BAD_FAT_COUNT");
-    if ((sd)fpp->fcp.cluster_count <= (fpp->fat_fstype == 32 ? 1 : 0)) fatal0("ASSERT_BAD_CLUSTER_COUNT");  /* We count the root directory cluster in FAT32. */
-    if (fpp->fat_fstype == 12 && fpp->fcp.cluster_count > 0xff4) fatal0("TOO_MANY_CLUSTERS_FOR_FAT12");
-    if (fpp->fat_fstype == 16 && fpp->fcp.cluster_count > 0xfff4) fatal0("TOO_MANY_CLUSTERS_FOR_FAT16");
-    if (fpp->fat_fstype == 32 && fpp->fcp.cluster_count > 0xffffff5) fatal0("TOO_MANY_CLUSTERS_FOR_FAT32");
-    if ((sd)fat_fat_sec_ofs < 0 || fat_rootdir_sec_ofs <= fat_fat_sec_ofs || fat_clusters_sec_ofs < fat_rootdir_sec_ofs) fatal0("FAT_TOO_LARGE_BEFORE_CLUSTERS");
-    if (fpp->fcp.log2_sectors_per_cluster > 6) fatal0("ASSERT_BAD_SECTORS_PER_CLUSTER");
-    if (fpp->fcp.cluster_count > (0xffffffffU >> fpp->fcp.log2_sectors_per_cluster)) fatal0("ASSERT_TOO_MANY_SECTORS_IN_CLUSTERS");  /* !! Use ...UL suffix for >16-bit integer literals. */
-    if ((fpp->fcp.cluster_count << fpp->fcp.log2_sectors_per_cluster) > fpp->fcp.sector_count - fat_clusters_sec_ofs) fatal0("ASSERT_TOO_FEW_SECTORS");  /* This can signify an overflow in sector_count calculations. */
-    if (fpp->fcp.sectors_per_fat < min_sectors_per_fat) fatal0("ASSERT_BAD_SECTORS_PER_FAT");
-    if (fpp->fcp.rootdir_entry_count & 0xf) fatal0("ASSERT_BAD_ROOTDIR_ENTRY_COUNT");
-    if (fpp->fat_fstype == 16 && fpp->fcp.cluster_count < 0xff7) fatal0("TOO_FEW_CLUSTERS_FOR_FAT16");
-    if (fpp->fat_fstype == 32 && fpp->fcp.cluster_count < 0xfff5) fatal0("TOO_FEW_CLUSTERS_FOR_FAT32");
-    if (fpp->fcp.sector_count < min_sector_count) fatal0("TOO_FEW_SECTORS");
-    if (fpp->fat_fstype == 12 && fpp->fcp.sector_count > max_sector_count) fatal0("TOO_MANY_SECTORS");  /* Compared to fat12_preset. */
-    if (fpp->hidden_sector_count > 0xffffU - fpp->reserved_sector_count) fatal0("TOO_MANY_HIDDEN_SECTORS");  /* It has to fit to a 16-bit word in the FAT header in the MBR. */
-    if (fpp->fcp.sectors_per_track == 0 || fpp->hidden_sector_count % fpp->fcp.sectors_per_track) fatal0("BAD_HIDDEN_SECTOR_COUNT_MODULO");  /* MS-DOS <=6.x requires that hidden_sector_count is a multiple of sectors_per_track. */
-#  else
-    (void)fatal0;  /* !! Remove definition if not used for DEBUG. */
-#  endif
-  if (fpp->vhd_mode == VHD_FIXED) {
-    vhd_sector_count = (fpp->geometry_sector_count + 0x7ffU) & ~0x7ffU;  /* Round up to the nearest MiB, as required by Microsoft Azure. */
-#    ifdef DEBUG
-      msg_printf("info: vhd_sector_count=%lu=0x%lx\n", (unsigned long)vhd_sector_count, (unsigned long)vhd_sector_count);
-#    endif
-    set_file_size_scount(vhd_sector_count + 1U);  /* +1U for the VHD footer sector. */
-  } else {
-    set_file_size_scount(fpp->geometry_sector_count);
-  }
+enum fat_attr_t {  /* Attribute bits in a FAT directory entry. */
+  FATTR_READONLY = 1,
+  FATTR_HIDDEN = 2,
+  FATTR_SYSTEM = 4,
+  FATTR_VOLUME_LABEL = 8,
+  FATTR_DIRECTORY = 0x10,
+  FATTR_ARCHIVE = 0x20
+};
 
-  /* Write boot sector containing the FAT header (superblock). */
-  memcpy(sbuf, boot_bin + (fpp->fat_fstype == 12 ? BOOT_OFS_FAT12 : fpp->fat_fstype == 16 ? BOOT_OFS_FAT16 : BOOT_OFS_FAT32), 0x200);
-  /* .header: jmp strict short .boot_code */
-  /* nop  ; 0x90 for CHS. Another possible value is 0x0e for LBA. Who uses it? It is ignored by .boot_code. */
-  s = sbuf + 3;  /* More info about FAT12, FAT16 and FAT32: https://en.wikipedia.org/wiki/Design_of_the_FAT_file_system */
-  memcpy(s, oem_name, 8); s += 8;
-  dw(fat_sector_size);  /* The value 0x200 is hardcoded in boot_sector.boot_code, both explicitly and implicitly. */
-  db((ub)1 << fpp->fcp.log2_sectors_per_cluster);
-  dw(fpp->reserved_sector_count);
-  db(fpp->fat_count);  /* Must be 1 or 2. MS-DOS 6.22 supports only 2. Windows 95 DOS mode supports 1 or 2. */
-  dw(fpp->fcp.rootdir_entry_count);  /* Each FAT directory entry is 0x20 bytes. Each sector is 0x200 bytes. */
-  dw(fpp->fcp.sector_count - fpp->hidden_sector_count > 0xffffU ? 0 : fpp->fcp.sector_count - fpp->hidden_sector_count);  /* 0 doesn't happen for our FAT12. */
-  db(fpp->fcp.media_descriptor);   /* 0xf8 for HDD. 0xf8 is also used for some floppy disk formats as well. */
-  dw(fpp->fat_fstype == 32 ? 0 : fpp->fcp.sectors_per_fat);
-  /* FreeDOS 1.2 `dir c:' needs a correct value for .sectors_per_track and .head_count. MS-DOS 6.22 and FreeDOS 1.3 ignore these values (after boot). */
-  dw(fpp->fcp.sectors_per_track);  /* Track == cylinder. Dummy nonzero value to pacify mtools(1). Here it is not overwritten with value from BIOS int 13h AH == 8. */
-  dw(fpp->fcp.head_count);  /* Dummy nonzero value to pacify mtools(1). Here it is not overwritten with value from BIOS int 13h AH == 8. */
-  dd(fpp->hidden_sector_count); /* Occupied by MBR and previous partitions. */
-  dd(fpp->fcp.sector_count - fpp->hidden_sector_count);
-  if (fpp->fat_fstype == 32) {  /* FAT32. */
-    dd(fpp->fcp.sectors_per_fat);
-    dw(0);  /* mirroring_flags, as created by Linux mkfs.vfat(1). */
-    dw(0);  /* .version. */
-    dd(2);  /* .rootdir_start_cluster. */
-    dw(fpp->reserved_sector_count > 1U ? 1U : 0U);  /* .fsinfo_sec_ofs. */
-    dw(first_boot_sector_copy_sec_ofs);
-    s += 12;  /* .reserved. The values are 0. */
+/* Last-modification date and time of the directory entries we create:
+ * 1980-01-01 00:00:00, the earliest DOS timestamp. It's a constant for
+ * reproducible output.
+ */
+#define FAT_DOS_DATE ((0U << 9) | (1U << 5) | 1U)
+#define FAT_DOS_TIME 0U
+
+static ub is_same_dos_name(const char *a, const char *b) {
+  ub i;
+  for (i = 0; i < 11U && a[i] == b[i]; ++i) {}
+  return i == 11U;
+}
+
+/* Sets dos_name (11 bytes) based on the last pathname component of fn.
+ * Returns 1 on success, 0 if it's not a valid DOS 8.3 filename.
+ */
+static ub set_dos_name(char *dos_name, const char *fn) {
+  const char *p, *q;
+  ub i, limit, c;
+  for (p = fn; *fn != '\0'; ++fn) {
+    if (*fn == '/' || *fn == '\\' || *fn == ':') p = fn + 1;
   }
-#ifdef DEBUG
-  if (0) {  /* These are already correct in boot_bin. */
-    db(0);  /* fat_drive_number. */
-    db(0);  /* fat_var_unused. Can be used as a temporary variable in .boot_code. */
-    db(EXTENDED_BOOT_SIGNATURE);
-  } else {
-    s += 3;
+  memset(dos_name, ' ', 11);
+  for (i = 0, limit = 8; (c = *p) != '\0'; ++p) {
+    if (c == '.') {
+      if (limit != 8 || i == 0) return 0;  /* Multiple dots, or leading dot. */
+      i = 8; limit = 11;
+      continue;
+    }
+    if (i == limit || c <= ' ' || c == 0x7f) return 0;
+    for (q = "\"*+,/:;<=>?[\\]|"; *q != '\0' && *q != (char)c; ++q) {}
+    if (*q != '\0') return 0;
+    if (c - 'a' + 0U <= 'z' - 'a' + 0U) c -= 'a' - 'A';
+    dos_name[i++] = c;
   }
+  if (dos_name[0] == ' ' || (limit == 11 && i == 8)) return 0;  /* Empty name, or trailing dot. */
+  if ((ub)dos_name[0] == 0xe5) dos_name[0] = 5;  /* 0xe5 would mean deleted entry. */
+  return 1;
+}
+
+/* Returns a new, zero-initialized entry at the end of pfiles. */
+static struct pfile *new_pfile(void) {
+  struct pfile *pfp;
+  if (ctx->pfile_count == ctx->pfile_capacity) {
+#ifdef BAKEFAT_POSIX
+    if (ctx->pfile_capacity >= 0x7fffffffU / sizeof(struct pfile)) fatal0("too many files");  /* Prevent overflow below. */
+    ctx->pfile_capacity <<= 1;
+    pfp = (struct pfile*)alloc_zero(ctx->pfile_capacity * sizeof(struct pfile));
+    memcpy(pfp, ctx->pfiles, ctx->pfile_count * sizeof(struct pfile));
+    if (ctx->pfiles != ctx->pfiles_static) free_memory(ctx->pfiles);
+    ctx->pfiles = pfp;
 #else
-  s += 3;
+    bad_usage0("too many SYS= and PREALLOC= files specified");
 #endif
-  dd(fpp->volume_id);
-#ifdef DEBUG
-  if (0) {  /* These are already correct in boot_bin. */
-    memcpy(s, "NO NAME    ", 11); s += 11;  /* volume_label. */
-    memcpy(s, fpp->fat_count == 12 ? "FAT12   " : fpp->fat_count == 16 ? "FAT16   " : "FAT132   ", 8);  /* fstype. */
-  }
-#endif
-  if (fpp->fat_fstype == 12) {
-    s = sbuf + gw(boot_bin + BOOT_OFS_FAT12_OFSS + 0); dw(fat_clusters_sec_ofs);
-    s = sbuf + gw(boot_bin + BOOT_OFS_FAT12_OFSS + 2); dw(fpp->fcp.rootdir_entry_count);
-    s = sbuf + gw(boot_bin + BOOT_OFS_FAT12_OFSS + 4); dw(fat_rootdir_sec_ofs);
-    s = sbuf + gw(boot_bin + BOOT_OFS_FAT12_OFSS + 6); dw(fat_fat_sec_ofs);
   }
-  write_sector(fpp->hidden_sector_count);
-  if (first_boot_sector_copy_sec_ofs) write_sector(fpp->hidden_sector_count + first_boot_sector_copy_sec_ofs);
+  pfp = ctx->pfiles + ctx->pfile_count++;
+  memset(pfp, 0, sizeof(*pfp));
+  pfp->parent = PFILE_ROOT;
+  return pfp;
+}
 
-  if (fpp->hidden_sector_count) {  /* Write the MBR. */
-    s = sbuf;
-    memcpy(s, boot_bin + BOOT_OFS_MBR, 3);  /* The jump instruction to the MBR boot code. */
-    if (fpp->fat_fstype != 32) memset(s + 0x3e, '-', 0x5a - 0x3e);
-    memcpy(s + 0x5a, boot_bin + BOOT_OFS_MBR + 0x5a, 0x200 - 0x5a);
-    s += 0xe; dw(fpp->hidden_sector_count + fpp->reserved_sector_count);  /* reserved_sector_count. */
-    s += 3; dw(fpp->fcp.sector_count > 0xffffU ? 0 : fpp->fcp.sector_count);
-    s += 0x18 - 0x15; dw(1);  /* sectors_per_track. Dummy value for Mtools to prevent the ``Total number of sectors (...) not a multiple of sectors per track (63)!'' error. This is unnecessary with the current adjust_geometry(...). */
-    s += 0x1c - 0x1a; dd(0);  /* hidden_sector_count. */
-    dd(fpp->fcp.sector_count);
-    if (fpp->fat_fstype == 32) {
-      s += 0x30 - 0x24;
-      dw(fpp->hidden_sector_count + (fpp->reserved_sector_count ? 1U : 0U));  /* .fsinfo_sec_ofs. */
-      dw(fpp->hidden_sector_count + first_boot_sector_copy_sec_ofs);
+/* Adds the comma-separated list of host filenames in p to pfiles. Modifies p. */
+static void add_sys_files(char *p) {
+  struct pfile *pfp;
+  const struct pfile *pfq;
+  char *q;
+  for (;;) {
+    for (q = p; *q != '\0' && *q != ','; ++q) {}
+    pfp = new_pfile();
+    pfp->host_fn = p;
+    p = q;
+    if (*p != '\0') *p++ = '\0';
+    if (!set_dos_name(pfp->dos_name, pfp->host_fn)) bad_usage1("system file name is not a valid DOS 8.3 filename", pfp->host_fn);
+    for (pfq = ctx->pfiles; pfq != pfp; ++pfq) {
+      if (is_same_dos_name(pfq->dos_name, pfp->dos_name)) bad_usage1("duplicate system file name", pfp->host_fn);
     }
-    s = sbuf + 0x1be;  /* Partition 1. */
-    db(PSTATUS_ACTIVE);  /* Status (PSTATUS.*: 0: inactive, 0x80: active (bootable)). */
-    db(0);  /* CHS head of first sector. */
-    dw(0);  /* CHS cylinder and sector of first sector. */
-    db(fpp->fat_fstype == 32 ? PTYPE_FAT32_LBA : fpp->fcp.sector_count >> 16 ? PTYPE_FAT16 : PTYPE_FAT16_LESS_THAN_32MIB);  /* Partition type (PTYPE.*). */
-    db(0);  /* CHS head of last sector. */
-    dw(0);  /* CHS cylinder and sector of last sector. */
-    dd(fpp->hidden_sector_count);  /* Sector offset (LBA) of the first sector. */
-    dd(fpp->fcp.sector_count - fpp->hidden_sector_count);  /* Number of sectors. */
-    write_sector(0);
+    /* Like SYS.COM: kernel files are system and hidden, the command interpreter is a regular file. */
+    pfp->attr = is_same_dos_name(pfp->dos_name, "COMMAND COM") ? FATTR_ARCHIVE : FATTR_SYSTEM | FATTR_HIDDEN;
+    ++ctx->sys_file_count;
+    if (*p == '\0') break;
   }
+}
 
-  if (fpp->fat_fstype == 32 && fpp->reserved_sector_count > 1U) {  /* Write fsinfo sector for FAT32. https://en.wikipedia.org/wiki/Design_of_the_FAT_file_system#FS_Information_Sector */
-    memset(s = sbuf, 0, sizeof(sbuf));
-    dd('R' | 'R' << 8 | (ud)'a' << 16 | (ud)'A' << 24);  /* .header. */
-    s += 0x1e0;  /* .reserved. The values are 0. */
-    dd('r' | 'r' << 8 | (ud)'A' << 16 | (ud)'a' << 24);  /* .signature2. */
-    dd(fpp->fcp.cluster_count - 1);  /* .free_cluster_count. -1 because the root directory occupies 1 cluster. */
-    dd(2);  /* .most_recently_allocated_cluster_ofs. The root directory cluster. */
-    s += 0xc + 2;  /* .reserved2 and first 2 bytes of .signature3. The values are 0. */
-    dw(BOOT_SIGNATURE);
-    write_sector(fpp->hidden_sector_count + 1U);
-  }
+#ifdef BAKEFAT_POSIX
+static int cmp_pfile_dos_name(const void *a, const void *b) {
+  return memcmp(((const struct pfile*)a)->dos_name, ((const struct pfile*)b)->dos_name, 11);
+}
 
-  /* Write the first sector of each FAT. */
-  memset(s = sbuf, 0, sizeof(sbuf));
-  db(fpp->fcp.media_descriptor);
-  dw(-1);
-  if (fpp->fat_fstype == 16) {
-    db(-1);
-  } else if (fpp->fat_fstype == 32) {
-    db(0xf);  /* First special cluster pointer: 0xffffff8, the low byte being the media_descriptor. */
-    dd(0xfffffff);  /* Second special cluster pointer. */
-    dd(0xffffff8);  /* Indicates empty root directory. */
-  }
-  write_sector(fat_fat_sec_ofs);
-  if (fpp->fat_count > 1) write_sector(fat_fat_sec_ofs + fpp->fcp.sectors_per_fat);
-
-  /* Write the VHD footer. */
-  if (fpp->vhd_mode == VHD_FIXED) {
-    /* VHD (.vhd) is the virtual hard disk (virtual HDD) file format
-     * introduced by Connectix Virtual PC (now Microsoft Vitual PC). It has
-     * many subformats, We use the fixed-size subformat. (Using the dynamic
-     * subformat instead would make it possible to create sparse disk images
-     * on FAT filesystems, with the default block size of 2 MiB.)
-     *
-     * File format docs: https://github.com/libyal/libvhdi/blob/main/documentation/Virtual%20Hard%20Disk%20(VHD)%20image%20format.asciidoc
-     *
-     * Docs about QEMU disk image file format support: https://qemu-project.gitlab.io/qemu/system/images.html
-     *
-     * VirtualBox 5.2.42 and QEMU 2.11.1 don't have the 127 GiB limit on
-     * their virtual IDE controller: using EBIOS LBA (int 13h, AH == 42h),
-     * all VHD sectors up to 2040 GiB can be accessed. The maximum sector
-     * count with CHS access (int 13h, AH == 2h) is 1024 * 255 * 63 (==
-     * 8032.5 MiB), sectors beyond that can't be accessed. QEMU 2.11.1 has a
-     * bug in its BIOS disk geometry reporting (int 13h, AH == 8): it
-     * reports 1 less than the actual number of cylinders -- but it can
-     * still access the last cylinder.
-     *
-     * https://kb.msp360.com/standalone-backup/restore/vhd-disk-size-exceeded
-     * says about MSP360 (Formerly CloudBerry) Backup for Windows: The
-     * maximum size for a virtual hard disk is 2,040 gigabytes (GB).
-     * However, any virtual hard disk attached to the IDE controller cannot
-     * exceed 127 gigabytes (GB). [...] VHDX can handle up to 64 TiB.
-     *
-     * https://serverfault.com/a/770425 says: When QEMU creates a VHD image,
-     * it goes by the original spec, calculating the current_size based on
-     * the nearest CHS geometry (with an exception for disks > 127GB).
-     * Apparently, Azure will only allow images that are sized to the
-     * nearest MB, and the current_size as calculated from CHS cannot
-     * guarantee that. Allow QEMU to create images similar to how Hyper-V
-     * creates images, by setting current_size to the specified virtual disk
-     * size. This introduces an option, force_size, to be passed to the vpc
-     * format during image creation.
-     *
-     * From the QEMU 2.11.1 source file qemu-2.11.1/block/vpc.c: Microsoft
-     * Virtual PC and Microsoft Hyper-V produce and read VHD image sizes
-     * differently. VPC will rely on CHS geometry, while Hyper-V and
-     * disk2vhd use the size specified in the footer.
-     *
-     * Example conversion command from raw (.img) to VHD (.vhd): `qemu-img convert -f raw -o subformat=fixed,force_size -O vpc hd.img hd.vhd`
-     *
-     * QEMU 2.11.1 int 13h AH == 8 has a bug: it reports 1 less cyls (for
-     * both raw .img and .vhd); VirtualBox does it correctly.
-     *
-     * QEMU 2.11.1 autodetects the disk geometry (incorrectly) even if
-     * specified in the .vhd file
-     *
-     * VirtualBox respects the disk geometry in the .vhd file up to the max
-     * of C*H*S == 1024*16*63 =~ 504 MiB; above 1024 cyls it starts doing
-     * transformations.
-     */
-    memset(s = sbuf, 0, sizeof(sbuf));
-    memcpy(s, "conectix", 8); s += 8;  /* signature. */
-    ddb(2);  /* features. Just the reserved bit is set. */
-    ddb(0x10000);  /* format_version. */
-    dd(-1);  /* next_offset high dword. */
-    dd(-1);  /* next_offset low dword. */
-    dd(0);  /* modification_time. */
-    dd(fpp->geometry_sector_count > (ud)65535U * 16U * 255U ? (ud)('w' | 'i' << 8 | (ud)'n' << 16 | (ud)' ' << 24) :
-       (ud)('v' | 'p' << 8 | (ud)'c' << 16 | (ud)' ' << 24));  /* creator_application: Typically "qemu" (CHS), "vpc " (CHS), "qem2" (force_size), "win " (force_size). */
-    ddb(0x50003);  /* creator_version. */
-    dd('W' | 'i' << 8 | (ud)'2' << 16 | (ud)'k' << 24);  /* host_os. */
-    dsb(vhd_sector_count);  /* disk_size. */
-    dsb(vhd_sector_count);  /* data_size. */
-    if (fpp->geometry_sector_count <= (ud)1024U * 16U * 63U) {  /* Compatible with bos BIOS and IDE, <= 504 MiB. */
-      dwb((fpp->geometry_sector_count + (16U * 63U - 1U)) / (16U * 63U));  /* disk_geometry.cyls. */  /* Round up. */
-      db(16U);  /* disk_geometry.heads. */
-      db(63U);  /* disk_geometry.secs. */
-    } else if (fpp->geometry_sector_count >= (ud)65535U * 16U * 255U) {
-      dwb(65535U);  /* disk_geometry.cyls. */
-      db(16U);  /* disk_geometry.heads. */
-      db(255U);  /* disk_geometry.secs. */
+/* Appends the entries of host directory host_dir to pfiles, sorted by
+ * name, with parent index parent. root_stp is the stat of the TREE=
+ * directory. Symlinks are followed, but a subdirectory which is the same
+ * as one of its ancestors is a fatal error (rather than infinite
+ * recursion).
+ */
+static void add_host_dir_entries(const char *host_dir, ud parent, const struct stat *root_stp) {
+  struct dirent *de;
+  struct stat st;
+  struct pfile *pfp;
+  const struct pfile *pfq;
+  const ud first_child = ctx->pfile_count;
+  ud i;
+  size_t dir_size = strlen(host_dir), name_size;
+  char *host_fn;
+  if ((ctx->open_dir = opendir(host_dir)) == NULL) {
+    msg_printf("fatal: error opening host directory: %s\n", host_dir);
+    exit(2);
+  }
+  while ((de = readdir(ctx->open_dir)) != NULL) {
+    if (de->d_name[0] == '.' && (de->d_name[1] == '\0' || (de->d_name[1] == '.' && de->d_name[2] == '\0'))) continue;
+    name_size = strlen(de->d_name) + 1;
+    host_fn = (char*)alloc_zero(dir_size + 1 + name_size);
+    memcpy(host_fn, host_dir, dir_size);
+    host_fn[dir_size] = '/';
+    memcpy(host_fn + dir_size + 1, de->d_name, name_size);
+    pfp = new_pfile();
+    pfp->host_fn = host_fn;
+    pfp->parent = parent;
+    if (!set_dos_name(pfp->dos_name, de->d_name)) bad_usage1("host filename is not a valid DOS 8.3 filename", host_fn);
+    if (stat(host_fn, &st) != 0) {
+      msg_printf("fatal: error getting info of host file: %s\n", host_fn);
+      exit(2);
+    }
+    if (S_ISDIR(st.st_mode)) {
+      for (i = parent; i != PFILE_ROOT && (ctx->pfiles[i].host_dev != st.st_dev || ctx->pfiles[i].host_ino != st.st_ino); i = ctx->pfiles[i].parent) {}
+      if (i != PFILE_ROOT || (root_stp->st_dev == st.st_dev && root_stp->st_ino == st.st_ino)) {
+        msg_printf("fatal: host directory loop, directory is the same as its ancestor: %s\n", host_fn);
+        exit(2);
+      }
+      pfp->attr = FATTR_DIRECTORY;
+      pfp->host_dev = st.st_dev;
+      pfp->host_ino = st.st_ino;
+    } else if (S_ISREG(st.st_mode)) {
+      if ((uint64_t)st.st_size > 0xffffffffU) {
+        msg_printf("fatal: host file too large for FAT: %s\n", host_fn);
+        exit(2);
+      }
+      pfp->size = (ud)st.st_size;
+      pfp->attr = FATTR_ARCHIVE;
     } else {
-      dwb((fpp->geometry_sector_count + (16U * 255U - 1U)) / (16U * 255U));  /* disk_geometry.cyls. */  /* Round up. */
-      db(16U);  /* disk_geometry.heads. */
-      db(255U);  /* disk_geometry.secs. */
-    }
-    ddb(2);  /* disk_type: VHD_FIXED --> 2, VHD_DYNAMIC --> 3. */
-    dd(0);  /* checksum. On mismatch, QEMU reports a warning. */
-    dd(fpp->volume_id);  /* First 4 bytes of identifier: 16-byte big-endian UUID. */
-    dd(fpp->geometry_sector_count);  /* Next 4 bytes of identifier. */
-    db(fpp->fat_fstype + (fpp->fat_count - 1U));  /* Next 1 byte of identifier. */
-    /* VirtualBox doesn't allow adding a disk with the same UUID, so adding
-     * two disk images created with bakefat (without the RNDUUID
-     * command-line flag) won't work. QEMU doesn't have such a limitation.
-     * */
-    memcpy(s, "\xb5\xd4\x99\xe3\xbc\x63\x46", 7); s += 7;  /* identifier: Big endian UUID. */
-    /*db(0);*/  /* saved_state. Trailing NUL bytes can be unspecified. */
-    for (checksum = (ud)-1; s != sbuf; checksum -= *(const ub*)--s) {}
-    s = sbuf + 0x40; ddb(checksum);
-    write_sector(vhd_sector_count);
+      bad_usage1("host file is neither a regular file nor a directory", host_fn);
+    }
   }
-}
-
-static ud align_fat(struct fat_params *fpp, ud fat_clusters_sec_ofs) {
-  ud sector_delta = 0;
-  if (fpp->fcp.log2_sectors_per_cluster >= 3U && (fat_clusters_sec_ofs & 7U)) {  /* Simple alignment: align clusters to a multiple of 4K. */  /* !! Do better alignment, even for the FAT table and the root directory. */
-    sector_delta = -fpp->fcp.log2_sectors_per_cluster & 7U;
-    fpp->reserved_sector_count += sector_delta;
+  closedir(ctx->open_dir);
+  ctx->open_dir = NULL;
+  qsort(ctx->pfiles + first_child, ctx->pfile_count - first_child, sizeof(struct pfile), cmp_pfile_dos_name);  /* For reproducible output. */
+  for (pfp = ctx->pfiles + first_child + 1; pfp < ctx->pfiles + ctx->pfile_count; ++pfp) {
+    if (is_same_dos_name(pfp[-1].dos_name, pfp->dos_name)) bad_usage1("duplicate DOS filename in host directory", pfp->host_fn);
+  }
+  if (parent == PFILE_ROOT) {
+    for (pfp = ctx->pfiles + first_child; pfp != ctx->pfiles + ctx->pfile_count; ++pfp) {
+      for (pfq = ctx->pfiles; pfq != ctx->pfiles + first_child; ++pfq) {
+        if (is_same_dos_name(pfq->dos_name, pfp->dos_name)) bad_usage1("host file has the same name as a SYS= or PREALLOC= file", pfp->host_fn);
+      }
+    }
+  } else {
+    ctx->pfiles[parent].first_child = first_child;
+    ctx->pfiles[parent].child_count = ctx->pfile_count - first_child;
   }
-  return sector_delta;
 }
 
-/* Adjust geometry for rounding in QEMU 2.11.1.
- *
- * Inputs: fpp->fcp.sector_count, fpp->fcp.cluster_count, fpp->fcp.log2_sectors_per_cluster, fpp->fat_fstype.
- * Outputs: fpp->geometry_sector_count, fpp->fcp.sector_count, fpp->fcp.cluster_count, fpp->cylinder_count (cyls), fpp->head_count (heads), fpp->sectors_per_track (secs).
+/* Adds the entries of host directory host_dir to the root directory, and
+ * the entries of its subdirectories recursively, in breadth-first order.
  */
-static void adjust_hdd_geometry(struct fat_params *fpp, ud fat_clusters_sec_ofs) {
-  ud cyls, heads, hs;
-  ub mod;
-  fpp->fcp.sectors_per_track = 63U;
-  fpp->fcp.head_count = heads =
-      (fpp->fcp.sector_count <= (ud)1024U * 16U * 63U) ? 16U :
-      (fpp->fcp.sector_count <= (ud)2048U * 32U * 63U) ? 32U :
-      (fpp->fcp.sector_count <= (ud)4096U * 64U * 63U) ? 64U :
-      (fpp->fcp.sector_count <= (ud)8192U * 128U * 63U) ? 128U : 255U;
-  hs = fpp->fcp.head_count * 63U;
-  cyls = fpp->fcp.sector_count == 0U ? (ud)0 : (fpp->fcp.sector_count - 1U) / hs + 1U;  /* This is round_up_div(fpp->fcp.sector_count, hs), but avoids overflow. */
-  fpp->cylinder_count = cyls =
-      (heads == 32U && cyls < 543U) ? 543U :
-      (heads == 64U && cyls < 527U) ? 527U :
-      (heads == 128U && cyls < 519U) ? 519U :
-      (heads == 255U && cyls < 517U) ? 517U : cyls;
-  fpp->geometry_sector_count = cyls * (fpp->fcp.head_count * 63U);
-#  ifdef DEBUG
-    msg_printf("info: geometry: sector_count=0x%lx geometry_sector_count=0x%lx CHS=%lu:%u:%u\n", (unsigned long)fpp->fcp.sector_count, (unsigned long)fpp->geometry_sector_count, (unsigned long)fpp->cylinder_count, (unsigned)fpp->fcp.head_count, (unsigned)fpp->fcp.sectors_per_track);
-    if (fpp->fcp.sector_count > fpp->geometry_sector_count) fatal0("ASSERT_GEOMETRY_BAD_SECTOR_COUNT");
-#  endif
- fix_sector_count:
-  mod = fpp->fcp.sector_count % 63U;
-  if (mod) {  /* Mtools requires sector_count-hidden_sector_count to be a multiple of sectors_per_track. */
-    /* Here we can choose to round fpp->fcp.sector_count up or down, thus
-     * keeping (up or down), increasing (up) or decreasing (down)
-     * fpp->fcp.cluster_count.
-     */
-    hs = fpp->fcp.sector_count - fat_clusters_sec_ofs;
-    if (((hs + (63U - mod)) >> fpp->fcp.log2_sectors_per_cluster) == (hs >> fpp->fcp.log2_sectors_per_cluster)) {
-#      ifdef DEBUG
-        msg_printf("info: geometry: rounding up without cluster count increase\n");
-#      endif
-     simple_round_up:  /* Rounding up doesn't increase fpp->fcp.cluster_count, so we round up. */
-      fpp->fcp.sector_count += 63U - mod;
-    } else if (((hs - mod) >> fpp->fcp.log2_sectors_per_cluster) < (fpp->fat_fstype == 16 ? 0xff7U : 0xfff5U)) {  /* Rounding down would make the filesystem too small, so we round up, possibly increasing fpp->fcp.sectors_per_fat. */
-      /* This affects FAT16 2M, FAT32 32M, FAT32 64M. */
-      hs = fpp->fcp.sector_count + 63U - mod;
-      mod = fpp->fcp.log2_sectors_per_cluster;
-      heads = (hs - fat_clusters_sec_ofs) >> mod;
-      if ((fpp->fcp.sectors_per_fat << (8 - (fpp->fat_fstype == 32))) - 2U < heads) {  /* The new fpp->fcp.cluster_count doesn't fit in the old FAT table. */
-        /* This affects FAT16 2M, FAT32 32M, FAT32 64M. */
-        ++fpp->fcp.sectors_per_fat;
-        fat_clusters_sec_ofs += fpp->fat_count;
-        fat_clusters_sec_ofs += align_fat(fpp, fat_clusters_sec_ofs);  /* Realign because fat_clusters_sec_ofs has changed. Also ets fpp->fcp.sector_count. */
-        fpp->fcp.sector_count = fat_clusters_sec_ofs + (fpp->fcp.cluster_count << mod);
-#        ifdef DEBUG
-          msg_printf("info: geometry: rounding up with sectors-per-fat increase: sector_count=0x%lx\n", (unsigned long)fpp->fcp.sector_count);
-#        endif
-        goto fix_sector_count;
-      }
-      /* TODO(pts): Add tests. This is never reached. */
-#      ifdef DEBUG
-        msg_printf("info: geometry: rounding up with cluster count increase: new cluster_count=0x%lx sector_count=0x%lx\n", (unsigned long)heads, (unsigned long)hs);
-#      endif
-      fpp->fcp.cluster_count = heads;
-      fpp->fcp.sector_count = hs;
-    } else {  /* Round down, decreasing fpp->fcp.cluster_count and maybe decreasing fpp->fcp.sector_count. */
-      /* This affects most size configurations. */
-      fpp->fcp.sector_count -= mod;
-      mod = fpp->fcp.log2_sectors_per_cluster;
-      fpp->fcp.cluster_count = (fpp->fcp.sector_count - fat_clusters_sec_ofs) >> mod;
-      fpp->fcp.sector_count = fat_clusters_sec_ofs + (fpp->fcp.cluster_count << mod);
-#      ifdef DEBUG
-        msg_printf("info: geometry: rounding down: new cluster_count=0x%lx sector_count=0x%lx\n", (unsigned long)fpp->fcp.cluster_count, (unsigned long)fpp->fcp.sector_count);
-#      endif
-      mod = fpp->fcp.sector_count % 63U;
-      if (mod) goto simple_round_up;
-    }
+static void add_host_tree(const char *host_dir) {
+  struct stat root_st;
+  ud i;
+  if (stat(host_dir, &root_st) != 0) {
+    msg_printf("fatal: error getting info of host directory: %s\n", host_dir);
+    exit(2);
+  }
+  add_host_dir_entries(host_dir, PFILE_ROOT, &root_st);
+  for (i = ctx->sys_file_count; i < ctx->pfile_count; ++i) {  /* pfile_count grows within the loop. */
+    if (ctx->pfiles[i].attr & FATTR_DIRECTORY) add_host_dir_entries(ctx->pfiles[i].host_fn, i, &root_st);
   }
-#  ifdef DEBUG
-    if (fpp->fcp.cluster_count > (fpp->fat_fstype == 16 ? 0xfff4U : 0xffffff5U)) fatal0("ASSERT_TOO_MANY_CLUSTERS_AFTER_ROUNDING");
-    if (fpp->fcp.sector_count > fpp->geometry_sector_count) fatal0("ASSERT_GEOMETRY_BAD_FINAL_SECTOR_COUNT");
-    if (fpp->fcp.sector_count % 63U) fatal0("ASSERT_GEOMETRY_SECTOR_COUNT_MODULO_SECS");
-#  endif
 }
+#endif
 
-static ub is_aligned_fat32_sector_count_at_most(const struct fat_params *fpp, ud fat_cluster_count) {
-  struct fat_params fp = *fpp;  /* This is a memcpy(). */
-  ud fat_clusters_sec_ofs, fat_sector_in_cluster_count;
-  fp.fcp.cluster_count = fat_cluster_count;
-  fp.fcp.sectors_per_fat = (fp.fcp.cluster_count + (2U + 0x7fU)) >> 7U;
-  fat_clusters_sec_ofs = fp.hidden_sector_count + fp.reserved_sector_count + ((ud)fp.fcp.sectors_per_fat << (fp.fat_count - 1U)) /* + (fp.fcp.rootdir_entry_count >> 4U) */;
-  fat_clusters_sec_ofs += align_fat(&fp, fat_clusters_sec_ofs);
-  fat_sector_in_cluster_count = fp.fcp.cluster_count << fp.fcp.log2_sectors_per_cluster;
-  return fat_sector_in_cluster_count <= fp.fcp.sector_count && fat_clusters_sec_ofs <= fp.fcp.sector_count - fat_sector_in_cluster_count;
+static ud size_to_cluster_count(ud size, ub log2_sectors_per_cluster) {
+  const ub shift = log2_sectors_per_cluster + 9U;
+  return (size >> shift) + ((size & (((ud)1 << shift) - 1U)) ? 1U : 0U);
 }
 
-typedef enum parseint_error_t {
-  PARSEINT_OK = 0,
-  PARSEINT_BAD_PREFIX = 1,
-  PARSEINT_BAD_CHAR = 2,
-  PARSEINT_OVERFLOW = 3,
-  PARSEINT_TOO_SHORT = 4  /* For parse_volume_id(...). */
-} parseint_error_t;
+/* A directory can have at most 0x10000 entries, including `.' and `..'. */
+#define DIR_ENTRY_COUNT_MAX 0x10000UL
 
-/* Parses a C unsigned decimal, hexadecimal, octal literal, sets *result_ptr
- * to a result. Returns PARSEINT_OK == 0 on success.
+/* Returns the number of clusters needed by a subdirectory with child_count entries. */
+static ud dir_cluster_count(ud child_count, ub log2_sectors_per_cluster) {
+  return size_to_cluster_count((child_count + 2U) << 5, log2_sectors_per_cluster);  /* +2 for `.' and `..'. */
+}
+
+/* Finds the size of each SYS= file, and allocates contiguous clusters to
+ * all pfiles, in order. Sets pfiles[...].size (for SYS= files),
+ * pfiles[...].start_cluster, pfiles[...].cluster_count and
+ * used_cluster_count. Doesn't write anything.
  */
-static parseint_error_t parse_ud(const char *s, ud *result_ptr) {
-  ud u, limit;
-  ub base, digit;
-  parseint_error_t result;
-#  if ('A' | 0x20) != 'a'
-#    error ASCII required.
-#  endif
-  if (s[0] == '0' && (s[1] | 0x20) == 'x') {
-    base = 16;
-    limit = (ud)-1 / 16U;
-    s += 2;
-  } else if (s[0] == '0') {
-    base = 8;
-    limit = (ud)-1 / 8U;
-    ++s;
-  } else if ((s[0] - ('1' + 0U)) <= 9U - 1U) {
-    base = 10;
-    limit = (ud)-1 / 10U;
+static void plan_pfiles(const struct fat_params *fpp) {
+  struct pfile *pfp;
+  int fd;
+  int64_t size;
+  const ub log2_spc = fpp->fcp.log2_sectors_per_cluster;
+  for (ctx->root_child_count = 0; ctx->root_child_count < ctx->pfile_count && ctx->pfiles[ctx->root_child_count].parent == PFILE_ROOT; ++ctx->root_child_count) {}
+  if (fpp->fat_fstype == 32) {  /* The FAT32 root directory starts at cluster 2, the files follow it. */
+    if (ctx->root_child_count >= DIR_ENTRY_COUNT_MAX) bad_usage0("too many files in the root directory");
+    ctx->rootdir_cluster_count = size_to_cluster_count(ctx->root_child_count << 5, log2_spc);
+    if (ctx->rootdir_cluster_count == 0) ctx->rootdir_cluster_count = 1;
   } else {
-    return PARSEINT_BAD_PREFIX;
+    ctx->rootdir_cluster_count = 0;
+    if (ctx->root_child_count > fpp->fcp.rootdir_entry_count) bad_usage0("too many files for the root directory, increase RDEC=");
   }
-  for (u = 0, result = PARSEINT_OK; *s != '\0'; ++s) {
-    digit = *s;
-    digit = (base == 16 && (digit | 32U) - ('a' + 0U) < 6U) ? (digit | 32U) - ('a' - 10U) : digit - ('0' + 0U);
-    if (digit >= base) return PARSEINT_BAD_CHAR;
-    if (u > limit) result = PARSEINT_OVERFLOW;
-    u *= base;
-    if (u + digit < u) result = PARSEINT_OVERFLOW;
-    u += digit;
+  ctx->used_cluster_count = ctx->rootdir_cluster_count;
+  for (pfp = ctx->pfiles; pfp != ctx->pfiles + ctx->pfile_count; ++pfp) {
+    if (pfp - ctx->pfiles < (long)ctx->sys_file_count) {
+      if ((fd = open_file(pfp->host_fn, O_RDONLY | O_BINARY, 0)) < 0) {
+        msg_printf("fatal: error opening system file: %s\n", pfp->host_fn);
+        exit(2);
+      }
+      if ((size = bakefat_lseek64(fd, 0, SEEK_END)) < 0) {
+        msg_printf("fatal: error getting size of system file: %s\n", pfp->host_fn);
+        exit(2);
+      }
+      close_file(fd);
+      if ((uint64_t)size > 0xffffffffU) {
+        msg_printf("fatal: system file too large for FAT: %s\n", pfp->host_fn);
+        exit(2);
+      }
+      pfp->size = (ud)size;
+    }
+    if (pfp->attr & FATTR_DIRECTORY) {
+      if (pfp->child_count >= DIR_ENTRY_COUNT_MAX - 2U) bad_usage1("too many files in host directory", pfp->host_fn);
+      pfp->cluster_count = dir_cluster_count(pfp->child_count, log2_spc);
+    } else {
+      pfp->cluster_count = size_to_cluster_count(pfp->size, log2_spc);
+    }
+    if (pfp->cluster_count > fpp->fcp.cluster_count - ctx->used_cluster_count) {
+      msg_printf("fatal: filesystem too small for file: %s\n", pfp->host_fn);
+      exit(2);
+    }
+    pfp->start_cluster = pfp->cluster_count ? ctx->used_cluster_count + 2U : 0;
+    ctx->used_cluster_count += pfp->cluster_count;
   }
-  *result_ptr = u;
-  return result;
 }
 
-/* Parses a FAT volume ID (8-digit hexadecimal, with a hyphen (dash, -) in
- * the middle), sets *result_ptr to a result. The parser is lenient on the
- * hyphens: it allows them anywhere. Returns PARSEINT_OK == 0 on success.
- */
-static parseint_error_t parse_volume_id(const char *s, ud *result_ptr) {
-  ud u;
-  ub count, digit;
-  for (u = 0, count = 8; *s != '\0'; ++s) {
-    if ((digit = *s) == '-') continue;
-    if (!count) return PARSEINT_OVERFLOW;
-    digit = (digit | 32U) - ('a' + 0U) < 6U ? (digit | 32U) - ('a' - 10U) : digit - ('0' + 0U);
-    if (digit > 0xfU) return PARSEINT_BAD_CHAR;
-    --count;
-    u <<= 4U;
-    u |= digit;
-  }
-  if (count != 0) return PARSEINT_TOO_SHORT;
-  *result_ptr = u;
-  return PARSEINT_OK;
+/* Writes the FAT sector in sbuf to each FAT, and clears sbuf. */
+static void fatw_flush(void) {
+  write_sector(ctx->fatw_fat_sec_ofs + ctx->fatw_sec);
+  if (ctx->fatw_fat_count > 1) write_sector(ctx->fatw_fat_sec_ofs + ctx->fatw_fpp->fcp.sectors_per_fat + ctx->fatw_sec);
+  memset(ctx->sbuf, 0, sizeof(ctx->sbuf));
 }
 
-static noreturn void usage(ub is_help, const char *argv0) {
-  char *p = sbuf;  /* TODO(pts): Check for overflow below. */
-  const char **csp;
-  const char *q, *cluster_size_flags, *hdd_image_size_flags;
-  const struct fat12_preset *prp;
-  /* TODO(pts): Precompute this help message, making the code shorter. */
-  for (prp = fat12_presets; prp != ARRAY_END(fat12_presets); ++prp) {
-    for (q = prp->name, *p++ = ' '; *q != '\0'; *p++ = *q++) {}
+static void fatw_byte(ud byte_ofs, ub value, ub mask) {
+  char *p;
+  if ((byte_ofs >> 9) != ctx->fatw_sec) {
+    fatw_flush();
+    ctx->fatw_sec = byte_ofs >> 9;
   }
-  *p++ = '\0';
-  hdd_image_size_flags = p;
-  for (csp = hdd_size_presets_m_21; csp != ARRAY_END(hdd_size_presets_m_21); ++csp) {
-    if (strcmp(*csp, "1024M") == 0) break;
-    for (q = *csp, *p++ = ' '; *q != '\0'; *p++ = *q++) {}
+  p = ctx->sbuf + (byte_ofs & 0x1ffU);
+  *p = (*p & ~mask) | (value & mask);
+}
+
+/* Sets the FAT entry of cluster to value. Must be called in ascending cluster order. */
+static void fatw_put(ud cluster, ud value) {
+  ud byte_ofs;
+  if (ctx->fatw_fpp->fat_fstype == 12) {
+    byte_ofs = cluster + (cluster >> 1);
+    if (cluster & 1) {
+      fatw_byte(byte_ofs, value << 4, 0xf0);
+      fatw_byte(byte_ofs + 1U, value >> 4, 0xff);
+    } else {
+      fatw_byte(byte_ofs, value, 0xff);
+      fatw_byte(byte_ofs + 1U, value >> 8, 0x0f);
+    }
+  } else {
+    byte_ofs = cluster << (ctx->fatw_fpp->fat_fstype == 32 ? 2 : 1);
+    fatw_byte(byte_ofs, value, 0xff);
+    fatw_byte(byte_ofs + 1U, value >> 8, 0xff);
+    if (ctx->fatw_fpp->fat_fstype == 32) {
+      fatw_byte(byte_ofs + 2U, value >> 16, 0xff);
+      fatw_byte(byte_ofs + 3U, value >> 24, 0x0f);
+    }
   }
-  for (csp = hdd_size_presets_g_30; csp != ARRAY_END(hdd_size_presets_g_30); ++csp) {
-    if (strcmp(*csp, "1024G") == 0) break;
-    for (q = *csp, *p++ = ' '; *q != '\0'; *p++ = *q++) {}
+}
+
+/* Writes a contiguous cluster chain of cluster_count clusters starting at cluster. Returns the cluster after the chain. */
+static ud fatw_put_chain(ud cluster, ud cluster_count) {
+  ud byte_ofs, count;
+  char *p;
+  if (ctx->fatw_fpp->fat_fstype != 12) {
+    /* Fast path for FAT16 and FAT32: fill the rest of the FAT sector at
+     * once, without the per-byte checks in fatw_byte(...). The compiler
+     * typically merges the byte stores to a single 16-bit or 32-bit store.
+     * Long chains (e.g. from PREALLOC=) span many FAT sectors.
+     */
+    while (cluster_count > 1U) {
+      byte_ofs = cluster << (ctx->fatw_fpp->fat_fstype == 32 ? 2 : 1);
+      if ((byte_ofs >> 9) != ctx->fatw_sec) {
+        fatw_flush();
+        ctx->fatw_sec = byte_ofs >> 9;
+      }
+      count = (0x200U - (byte_ofs & 0x1ffU)) >> (ctx->fatw_fpp->fat_fstype == 32 ? 2 : 1);
+      if (count > cluster_count - 1U) count = cluster_count - 1U;
+      cluster_count -= count;
+      p = ctx->sbuf + (byte_ofs & 0x1ffU);
+      if (ctx->fatw_fpp->fat_fstype == 32) {
+        for (; count; --count) {
+          ++cluster;
+          p[0] = cluster; p[1] = cluster >> 8; p[2] = cluster >> 16; p[3] = cluster >> 24;  /* The high 4 bits are 0, because cluster <= 0xffffff6. */
+          p += 4;
+        }
+      } else {
+        for (; count; --count) {
+          ++cluster;
+          p[0] = cluster; p[1] = cluster >> 8;
+          p += 2;
+        }
+      }
+    }
   }
-  for (csp = hdd_size_presets_t_40; csp != ARRAY_END(hdd_size_presets_t_40); ++csp) {
-    for (q = *csp, *p++ = ' '; *q != '\0'; *p++ = *q++) {}
+  for (; cluster_count > 1U; --cluster_count, ++cluster) {
+    fatw_put(cluster, cluster + 1U);
   }
-  *p++ = '\0';
-  cluster_size_flags = p;
-  for (csp = sectors_per_cluster_presets_k_10; csp != ARRAY_END(sectors_per_cluster_presets_k_10); ++csp) {
-    for (q = *csp, *p++ = ' '; *q != '\0'; *p++ = *q++) {}
+  if (cluster_count) fatw_put(cluster++, 0x0ffffff8);  /* End-of-chain marker, truncated to 12 or 16 bits by fatw_put(...). */
+  return cluster;
+}
+
+/* Writes all nonempty sectors of fat_count FATs: the special entries for
+ * clusters 0 and 1, the chain of the FAT32 root directory, and the chains
+ * of pfiles.
+ */
+static void write_fats(const struct fat_params *fpp, ud fat_fat_sec_ofs, ub fat_count) {
+  const struct pfile *pfp;
+  ctx->fatw_fpp = fpp;
+  ctx->fatw_fat_count = fat_count;
+  ctx->fatw_fat_sec_ofs = fat_fat_sec_ofs;
+  ctx->fatw_sec = 0;
+  memset(ctx->sbuf, 0, sizeof(ctx->sbuf));
+  fatw_put(0, 0x0fffff00U | fpp->fcp.media_descriptor);  /* Truncated to 12 or 16 bits by fatw_put(...). */
+  fatw_put(1, 0x0fffffffU);
+  fatw_put_chain(2, ctx->rootdir_cluster_count);
+  for (pfp = ctx->pfiles; pfp != ctx->pfiles + ctx->pfile_count; ++pfp) {
+    fatw_put_chain(pfp->start_cluster, pfp->cluster_count);
   }
-  *p = '\0';
-  /* This help message doesn't contain some alternate spellings of some flags. */
-  msg_printf("bakefat: bootable external FAT disk image creator v%d\n"
-             "Usage: %s <flag> [...] <outfile.img>\n"
-             "Floppy image size flags:%s\n"
-             "HDD image size flags:%s\n"
-             "Cluster size flags: 512B%s\n%s%s",
-             BAKEFAT_VERSION, argv0, sbuf, hdd_image_size_flags, cluster_size_flags,
-             "Filesystem type flags: FAT12 FAT16 FAT32\n"
-             "FAT count flags: 1FAT 2FATS FC=<number>\n"
-             "Root directory entry count: RDEC=<number>\n"
-             "Reserved sector count: RSC=<number>\n"
-             "Volume ID: VID=<hex-with-hyphen>\n",
-             "DOS compatibility flags: DOS3 DOS3.3 DOS4 DOS5 DOS6 DOS7 DOS7.0 DOS7.1 MSDOS7.0 MSDOS7.1 PCDOS7.0 PCDOS7.1 DOS8 WIN95A WIN95OSR2 WIN98 WINME\n"
-             "VHD footer flags: NOVHD VHD\n");
-  exit(is_help ? 0 : 1);
+  fatw_flush();
 }
 
-static noreturn void bad_usage0(const char *msg) {
-  msg_printf("fatal: %s\n", msg);
-  exit(1);
+/* Adds a directory entry to sbuf at s. */
+static void emit_dir_entry(const char *dos_name, ub attr, ud start_cluster, ud size) {
+  memcpy(ctx->s, dos_name, 11); ctx->s += 11;
+  db(attr);
+  ctx->s += 8;  /* Reserved, creation time and date, and last access date. The values are 0. */
+  dw(start_cluster >> 16);  /* FAT32 only, 0 for FAT12 and FAT16. */
+  dw(FAT_DOS_TIME);
+  dw(FAT_DOS_DATE);
+  dw(start_cluster);
+  dd(size);
 }
 
-static noreturn void bad_usage1(const char *msg, const char *arg) {
-  msg_printf("fatal: %s: %s\n", msg, arg);
-  exit(1);
+/* Writes the directory entries of a directory to consecutive sectors
+ * starting at sector sec. For a subdirectory (dpfp != NULL), it starts with
+ * the `.' and `..' entries.
+ */
+static void write_dir_entries(ud sec, const struct pfile *dpfp) {
+  const struct pfile *pfp = ctx->pfiles + (dpfp ? dpfp->first_child : 0);
+  const struct pfile *pfe = pfp + (dpfp ? dpfp->child_count : ctx->root_child_count);
+  memset(ctx->s = ctx->sbuf, 0, sizeof(ctx->sbuf));
+  if (dpfp) {
+    emit_dir_entry(".          ", FATTR_DIRECTORY, dpfp->start_cluster, 0);
+    emit_dir_entry("..         ", FATTR_DIRECTORY, dpfp->parent == PFILE_ROOT ? 0 : ctx->pfiles[dpfp->parent].start_cluster, 0);  /* 0 means the root directory, also on FAT32. */
+  }
+  for (; pfp != pfe; ++pfp) {
+    if (ctx->s == ctx->sbuf + sizeof(ctx->sbuf)) {
+      write_sector(sec++);
+      memset(ctx->s = ctx->sbuf, 0, sizeof(ctx->sbuf));
+    }
+    emit_dir_entry(pfp->dos_name, pfp->attr, pfp->start_cluster, pfp->size);
+  }
+  if (ctx->s != ctx->sbuf) write_sector(sec);
 }
 
-int main(int argc, char **argv) {
-  const char **arg, **arge, **argfn = NULL;
+#if defined(BAKEFAT_POSIX) && defined(POSIX_FADV_WILLNEED)
+  /* Maximum amount of file data to prefetch ahead of the file being copied. */
+#  define PREFETCH_BYTES_MAX ((ud)32 << 20)
+#  define PREFETCH_FILES_MAX 256U
+
+  /* Asks the host kernel to start reading host files after pfp (in the
+   * background), so that a cold page cache doesn't serialize reading many
+   * small files. *next_pfpp is the first file not prefetched yet.
+   */
+  static void prefetch_pfiles(const struct pfile *pfp, const struct pfile **next_pfpp) {
+    const struct pfile *pfe = ctx->pfiles + ctx->pfile_count, *pfq = *next_pfpp;
+    ud bytes = 0;
+    int fd;
+    if (pfq <= pfp) pfq = pfp + 1;
+    for (; pfq != pfe && pfq - pfp <= (long)PREFETCH_FILES_MAX && bytes < PREFETCH_BYTES_MAX; ++pfq) {
+      if (!pfq->size) continue;
+      if ((fd = open(pfq->host_fn, O_RDONLY | O_BINARY)) >= 0) {
+        (void)!posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);  /* The readahead continues after close(...). */
+        close(fd);
+      }
+      bytes += pfq->size > PREFETCH_BYTES_MAX ? PREFETCH_BYTES_MAX : pfq->size;
+    }
+    *next_pfpp = pfq;
+  }
+#else
+#  define prefetch_pfiles(pfp, next_pfpp) do { (void)(pfp); (void)(next_pfpp); } while (0)
+#endif
+
+#if defined(BAKEFAT_POSIX) && defined(__linux__) && (defined(FICLONERANGE) || defined(__NR_copy_file_range))
+#  define BAKEFAT_COPY_FILE_DATA_FAST 1
+  /* Copies a prefix of bytes [src_ofs, src_ofs + size) of fd to offset
+   * ofs of the output file, without copying the data through userspace.
+   * First it tries to share the 4 KiB-aligned part of the data extents with
+   * the host file (FICLONERANGE, works on Btrfs and XFS), then it lets the
+   * kernel copy the rest (copy_file_range(2), works on Linux >=4.5, and it
+   * may also share extents). Returns the size of the prefix copied, it can
+   * be anything between 0 and size, the caller has to copy the rest.
+   */
+  static ud copy_file_data_fast(int fd, uint64_t ofs, ud src_ofs, ud size) {
+    ud done = 0;
+#  ifdef __NR_copy_file_range
+    int64_t in_ofs, out_ofs;  /* loff_t. */
+    long got;
+#  endif
+#  ifdef FICLONERANGE
+    struct file_clone_range fcr;
+    if (!(ofs & 0xfffU) && !(src_ofs & 0xfffU) && size >= 0x1000U) {  /* Typically true, because align_fat(...) has aligned the clusters to 4 KiB. */
+      fcr.src_fd = fd;
+      fcr.src_offset = src_ofs;
+      fcr.src_length = size & ~(ud)0xfffU;
+      fcr.dest_offset = ofs;
+      if (ioctl(ctx->sfd, FICLONERANGE, &fcr) == 0) done = size & ~(ud)0xfffU;
+    }
+#  endif
+#  ifdef __NR_copy_file_range
+    while (done < size) {
+      in_ofs = src_ofs + done;
+      out_ofs = ofs + done;
+      if ((got = syscall(__NR_copy_file_range, fd, &in_ofs, ctx->sfd, &out_ofs, (size_t)(size - done), 0U)) <= 0) break;  /* Fails with EXDEV, ENOSYS or EINVAL if not supported. */
+      done += (ud)got;
+    }
+#  endif
+    return done;
+  }
+#endif
+
+/* Returns true iff the first size bytes of copy_buf are all NUL. */
+static char is_copy_buf_zero(unsigned size) {
+  const ud *p = ctx->copy_buf, *q = ctx->copy_buf + (size >> 2);
+  const char *c;
+  for (; p != q; ++p) {
+    if (*p) return 0;
+  }
+  for (c = (const char*)p, size &= 3; size; --size) {
+    if (*c++) return 0;
+  }
+  return 1;
+}
+
+/* Copies bytes [src_ofs, src_ofs + size) of host file fd (a data range,
+ * not a hole) to the same offset after byte offset ofs in the output file.
+ * Blocks of all NUL bytes are skipped, so they remain holes in the (sparse)
+ * output file, which has just been extended with set_file_size_scount(...).
+ * For raw output, the runs of non-NUL blocks between them are copied with
+ * copy_file_data_fast(...) if possible, otherwise with read(...) and
+ * write(...).
+ */
+static void write_pfile_data_range(int fd, const struct pfile *pfp, uint64_t ofs, ud src_ofs, ud size) {
+  unsigned want;
+  char is_seek_needed = 1;
+#ifdef BAKEFAT_COPY_FILE_DATA_FAST
+  const ud src_end = src_ofs + size;
+  ud run_ofs, scan_ofs, done;
+#endif
+  if (ctx->simg_pass == 1) {  /* Don't read the data in the planning pass, also the NUL blocks will be part of the run. */
+    write_simg(ofs + src_ofs, NULL, size);
+    return;
+  }
+#ifdef BAKEFAT_COPY_FILE_DATA_FAST
+  if (!ctx->output_block_sector_mask && !ctx->simg_pass) {
+    if ((ud)bakefat_lseek64(fd, src_ofs, SEEK_SET) != src_ofs) goto error_reading;
+    for (run_ofs = scan_ofs = src_ofs; ; scan_ofs += want) {
+      want = src_end - scan_ofs > sizeof(ctx->copy_buf) ? (unsigned)sizeof(ctx->copy_buf) : (unsigned)(src_end - scan_ofs);
+      if (want && (size_t)read(fd, ctx->copy_buf, want) != want) goto error_reading;
+      if (want && !is_copy_buf_zero(want)) continue;  /* Extend the run of non-NUL blocks. */
+      if (scan_ofs != run_ofs && (done = copy_file_data_fast(fd, ofs + run_ofs, run_ofs, scan_ofs - run_ofs)) != scan_ofs - run_ofs) {
+        src_ofs = run_ofs + done;  /* Not supported. Copy the rest with read(...) and write(...) below. */
+        size = src_end - src_ofs;
+        break;
+      }
+      if (!want) return;
+      run_ofs = scan_ofs + want;
+    }
+  }
+#endif
+  if ((ud)bakefat_lseek64(fd, src_ofs, SEEK_SET) != src_ofs) goto error_reading;
+  for (ofs += src_ofs; size; size -= want, ofs += want) {
+    want = size > sizeof(ctx->copy_buf) ? (unsigned)sizeof(ctx->copy_buf) : (unsigned)size;
+    if (ctx->output_block_sector_mask && ((ofs >> 9) | ctx->output_block_sector_mask) != (((ofs + want - 1U) >> 9) | ctx->output_block_sector_mask)) {  /* Don't cross a block boundary. */
+      want = (unsigned)(((((ofs >> 9) | ctx->output_block_sector_mask) + 1U) << 9) - ofs);
+    }
+    if ((size_t)read(fd, ctx->copy_buf, want) != want) { error_reading:
+      msg_printf("fatal: error reading host file (or it has changed): %s\n", pfp->host_fn);
+      exit(2);
+    }
+    if (is_copy_buf_zero(want)) {
+      is_seek_needed = 1;
+      continue;
+    }
+    if (ctx->simg_pass) {
+      write_simg(ofs, (const char*)ctx->copy_buf, want);
+      continue;
+    }
+    if (is_seek_needed) {
+      const uint64_t mapped_ofs = map_output_ofs(ofs);
+      if ((uint64_t)bakefat_lseek64(ctx->sfd, mapped_ofs, SEEK_SET) != mapped_ofs) {
+        msg_printf("fatal: error seeking in output file: %s\n", ctx->sfn);
+        exit(2);
+      }
+      is_seek_needed = 0;
+    }
+    if ((size_t)write(ctx->sfd, ctx->copy_buf, want) != want) {
+      msg_printf("fatal: error writing to output file: %s\n", ctx->sfn);
+      exit(2);
+    }
+    if (is_output_block_start((ud)((ofs + want) >> 9))) is_seek_needed = 1;
+  }
+}
+
+/* Copies the data of a host file to its clusters starting at sector sec.
+ * Holes in the host file are skipped without reading them if the
+ * host supports SEEK_DATA and SEEK_HOLE.
+ */
+static void write_pfile_data(ud sec, const struct pfile *pfp) {
+  int fd;
+  ud src_ofs, src_end;
+#if defined(BAKEFAT_POSIX) && defined(SEEK_DATA) && defined(SEEK_HOLE)
+  off_t got;
+#endif
+  if ((fd = open_file(pfp->host_fn, O_RDONLY | O_BINARY, 0)) < 0) {
+    msg_printf("fatal: error opening host file: %s\n", pfp->host_fn);
+    exit(2);
+  }
+  for (src_ofs = 0; src_ofs < pfp->size; src_ofs = src_end) {
+    src_end = pfp->size;
+#if defined(BAKEFAT_POSIX) && defined(SEEK_DATA) && defined(SEEK_HOLE)
+    if ((got = lseek(fd, src_ofs, SEEK_DATA)) < 0) {
+      if (errno == ENXIO) break;  /* Only a hole remains. */
+    } else if ((uint64_t)got >= pfp->size) {
+      break;
+    } else {
+      src_ofs = got;
+      if ((got = lseek(fd, src_ofs, SEEK_HOLE)) >= 0 && (uint64_t)got < pfp->size) src_end = got;
+    }
+#endif
+    write_pfile_data_range(fd, pfp, (uint64_t)sec << 9, src_ofs, src_end - src_ofs);
+  }
+  close_file(fd);
+}
+
+/* Writes the root directory entries, and then the directory entries and
+ * file data of pfiles, in ascending sector order.
+ */
+static void write_pfiles(ud fat_rootdir_sec_ofs, ud fat_clusters_sec_ofs, ub log2_sectors_per_cluster) {
+  const struct pfile *pfp, *next_prefetch_pfp = ctx->pfiles;
+  ud sec;
+  write_dir_entries(fat_rootdir_sec_ofs, NULL);
+  for (pfp = ctx->pfiles; pfp != ctx->pfiles + ctx->pfile_count; ++pfp) {
+    if (!pfp->cluster_count) continue;
+    sec = fat_clusters_sec_ofs + ((pfp->start_cluster - 2U) << log2_sectors_per_cluster);
+    if (pfp->attr & FATTR_DIRECTORY) {
+      write_dir_entries(sec, pfp);
+    } else if (!pfp->is_prealloc) {  /* The data clusters of PREALLOC= files remain holes (NUL bytes). */
+      prefetch_pfiles(pfp, &next_prefetch_pfp);
+      if (ctx->simg_pass) flush_sectors();  /* Keep the output in ascending order. */
+      write_pfile_data(sec, pfp);
+    }
+  }
+}
+
+static uw get_first_boot_sector_copy_sec_ofs(const struct fat_params *fpp) {
+  return (fpp->fat_fstype != 32 || fpp->reserved_sector_count <= 2U) ? 0U : fpp->reserved_sector_count < 6U ? 2U : 6U;  /* 6 was created by Linux mkfs.vfat(1), also for Windows XP. */
+}
+
+/* Writes the boot sector containing the FAT header (superblock), its backup
+ * copy for FAT32, and the MBR (which contains a copy of the FAT header).
+ */
+static void write_boot_sectors(const struct fat_params *fpp) {
+  const ud fat_sector_size = 0x200;
+  const ud fat_fat_sec_ofs = fpp->hidden_sector_count + fpp->reserved_sector_count;
+  const ud fat_rootdir_sec_ofs = fat_fat_sec_ofs + ((ud)fpp->fcp.sectors_per_fat << (fpp->fat_count - 1U));
+  const ud fat_clusters_sec_ofs = fat_rootdir_sec_ofs + ((ud)fpp->fcp.rootdir_entry_count >> 4);
+  const uw first_boot_sector_copy_sec_ofs = get_first_boot_sector_copy_sec_ofs(fpp);
+  memcpy(ctx->sbuf, boot_bin + (fpp->fat_fstype == 12 ? BOOT_OFS_FAT12 : fpp->fat_fstype == 16 ? BOOT_OFS_FAT16 : BOOT_OFS_FAT32), 0x200);
+  /* .header: jmp strict short .boot_code */
+  /* nop  ; 0x90 for CHS. Another possible value is 0x0e for LBA. Who uses it? It is ignored by .boot_code. */
+  ctx->s = ctx->sbuf + 3;  /* More info about FAT12, FAT16 and FAT32: https://en.wikipedia.org/wiki/Design_of_the_FAT_file_system */
+  memcpy(ctx->s, oem_name, 8); ctx->s += 8;
+  dw(fat_sector_size);  /* The value 0x200 is hardcoded in boot_sector.boot_code, both explicitly and implicitly. */
+  db((ub)1 << fpp->fcp.log2_sectors_per_cluster);
+  dw(fpp->reserved_sector_count);
+  db(fpp->fat_count);  /* Must be 1 or 2. MS-DOS 6.22 supports only 2. Windows 95 DOS mode supports 1 or 2. */
+  dw(fpp->fcp.rootdir_entry_count);  /* Each FAT directory entry is 0x20 bytes. Each sector is 0x200 bytes. */
+  dw(fpp->fcp.sector_count - fpp->hidden_sector_count > 0xffffU ? 0 : fpp->fcp.sector_count - fpp->hidden_sector_count);  /* 0 doesn't happen for our FAT12. */
+  db(fpp->fcp.media_descriptor);   /* 0xf8 for HDD. 0xf8 is also used for some floppy disk formats as well. */
+  dw(fpp->fat_fstype == 32 ? 0 : fpp->fcp.sectors_per_fat);
+  /* FreeDOS 1.2 `dir c:' needs a correct value for .sectors_per_track and .head_count. MS-DOS 6.22 and FreeDOS 1.3 ignore these values (after boot). */
+  dw(fpp->fcp.sectors_per_track);  /* Track == cylinder. Dummy nonzero value to pacify mtools(1). Here it is not overwritten with value from BIOS int 13h AH == 8. */
+  dw(fpp->fcp.head_count);  /* Dummy nonzero value to pacify mtools(1). Here it is not overwritten with value from BIOS int 13h AH == 8. */
+  dd(fpp->hidden_sector_count); /* Occupied by MBR and previous partitions. */
+  dd(fpp->fcp.sector_count - fpp->hidden_sector_count);
+  if (fpp->fat_fstype == 32) {  /* FAT32. */
+    dd(fpp->fcp.sectors_per_fat);
+    dw(0);  /* mirroring_flags, as created by Linux mkfs.vfat(1). */
+    dw(0);  /* .version. */
+    dd(2);  /* .rootdir_start_cluster. */
+    dw(fpp->reserved_sector_count > 1U ? 1U : 0U);  /* .fsinfo_sec_ofs. */
+    dw(first_boot_sector_copy_sec_ofs);
+    ctx->s += 12;  /* .reserved. The values are 0. */
+  }
+#ifdef DEBUG
+  if (0) {  /* These are already correct in boot_bin. */
+    db(0);  /* fat_drive_number. */
+    db(0);  /* fat_var_unused. Can be used as a temporary variable in .boot_code. */
+    db(EXTENDED_BOOT_SIGNATURE);
+  } else {
+    ctx->s += 3;
+  }
+#else
+  ctx->s += 3;
+#endif
+  dd(fpp->volume_id);
+#ifdef DEBUG
+  if (0) {  /* These are already correct in boot_bin. */
+    memcpy(ctx->s, "NO NAME    ", 11); ctx->s += 11;  /* volume_label. */
+    memcpy(ctx->s, fpp->fat_count == 12 ? "FAT12   " : fpp->fat_count == 16 ? "FAT16   " : "FAT132   ", 8);  /* fstype. */
+  }
+#endif
+  if (fpp->fat_fstype == 12) {
+    ctx->s = ctx->sbuf + gw(boot_bin + BOOT_OFS_FAT12_OFSS + 0); dw(fat_clusters_sec_ofs);
+    ctx->s = ctx->sbuf + gw(boot_bin + BOOT_OFS_FAT12_OFSS + 2); dw(fpp->fcp.rootdir_entry_count);
+    ctx->s = ctx->sbuf + gw(boot_bin + BOOT_OFS_FAT12_OFSS + 4); dw(fat_rootdir_sec_ofs);
+    ctx->s = ctx->sbuf + gw(boot_bin + BOOT_OFS_FAT12_OFSS + 6); dw(fat_fat_sec_ofs);
+  }
+  write_sector(fpp->hidden_sector_count);
+  if (first_boot_sector_copy_sec_ofs) write_sector(fpp->hidden_sector_count + first_boot_sector_copy_sec_ofs);
+
+  if (fpp->hidden_sector_count) {  /* Write the MBR. */
+    ctx->s = ctx->sbuf;
+    memcpy(ctx->s, boot_bin + BOOT_OFS_MBR, 3);  /* The jump instruction to the MBR boot code. */
+    if (fpp->fat_fstype != 32) memset(ctx->s + 0x3e, '-', 0x5a - 0x3e);
+    memcpy(ctx->s + 0x5a, boot_bin + BOOT_OFS_MBR + 0x5a, 0x200 - 0x5a);
+    ctx->s += 0xe; dw(fpp->hidden_sector_count + fpp->reserved_sector_count);  /* reserved_sector_count. */
+    ctx->s += 3; dw(fpp->fcp.sector_count > 0xffffU ? 0 : fpp->fcp.sector_count);
+    ctx->s += 0x18 - 0x15; dw(1);  /* sectors_per_track. Dummy value for Mtools to prevent the ``Total number of sectors (...) not a multiple of sectors per track (63)!'' error. This is unnecessary with the current adjust_geometry(...). */
+    ctx->s += 0x1c - 0x1a; dd(0);  /* hidden_sector_count. */
+    dd(fpp->fcp.sector_count);
+    if (fpp->fat_fstype == 32) {
+      ctx->s += 0x30 - 0x24;
+      dw(fpp->hidden_sector_count + (fpp->reserved_sector_count ? 1U : 0U));  /* .fsinfo_sec_ofs. */
+      dw(fpp->hidden_sector_count + first_boot_sector_copy_sec_ofs);
+    }
+    ctx->s = ctx->sbuf + 0x1be;  /* Partition 1. */
+    db(PSTATUS_ACTIVE);  /* Status (PSTATUS.*: 0: inactive, 0x80: active (bootable)). */
+    db(0);  /* CHS head of first sector. */
+    dw(0);  /* CHS cylinder and sector of first sector. */
+    db(fpp->fat_fstype == 32 ? PTYPE_FAT32_LBA : fpp->fcp.sector_count >> 16 ? PTYPE_FAT16 : PTYPE_FAT16_LESS_THAN_32MIB);  /* Partition type (PTYPE.*). */
+    db(0);  /* CHS head of last sector. */
+    dw(0);  /* CHS cylinder and sector of last sector. */
+    dd(fpp->hidden_sector_count);  /* Sector offset (LBA) of the first sector. */
+    dd(fpp->fcp.sector_count - fpp->hidden_sector_count);  /* Number of sectors. */
+    write_sector(0);
+  }
+}
+
+static ud get_vhd_sector_count(const struct fat_params *fpp) {
+  return (fpp->geometry_sector_count + 0x7ffU) & ~0x7ffU;  /* Round up to the nearest MiB, as required by Microsoft Azure. */
+}
+
+/* Starts dynamic VHD output (see map_output_ofs(...)) for a disk image of
+ * vhd_sector_count sectors. No blocks are allocated yet.
+ */
+static void start_vhd_dynamic(ud vhd_sector_count) {
+  ctx->vhd_bat_sector_count = (((vhd_sector_count + ((ud)1 << VHD_LOG2_BLOCK_SECTORS) - 1U) >> VHD_LOG2_BLOCK_SECTORS) + 0x7fU) >> 7;
+  ctx->vhd_bat = (ud*)alloc_zero(ctx->vhd_bat_sector_count << 9);
+  memset(ctx->vhd_bat, 0xff, ctx->vhd_bat_sector_count << 9);  /* All entries (including the padding) are (ud)-1: not allocated. */
+  ctx->vhd_next_block_sec = VHD_BAT_SEC_OFS + ctx->vhd_bat_sector_count + (ctx->vhd_parent_fn ? 1U : 0U);  /* +1U for the parent locator. */
+  ctx->output_block_sector_mask = ((ud)1 << VHD_LOG2_BLOCK_SECTORS) - 1U;
+  set_file_size_scount(ctx->vhd_next_block_sec);
+}
+
+static char is_absolute_path(const char *pathname) {
+  return pathname[0] == '/' || pathname[0] == '\\' || (pathname[0] != '\0' && pathname[1] == ':');
+}
+
+/* Finishes dynamic or differencing VHD output: writes the VHD footer (in
+ * sbuf) to the start and to the end of the output file, the dynamic disk
+ * header, the BAT and the parent locator.
+ */
+static void finish_vhd_dynamic(ud vhd_sector_count) {
+  ud checksum, i, j;
+  char *p;
+  const char *q, *r;
+  const ud parent_locator_sec = VHD_BAT_SEC_OFS + ctx->vhd_bat_sector_count;
+  flush_sectors();
+  write_output_raw(0, ctx->sbuf, 0x200);  /* Copy of the footer. */
+  write_output_raw((uint64_t)ctx->vhd_next_block_sec << 9, ctx->sbuf, 0x200);
+  if (ctx->vhd_parent_fn) {  /* Write the parent locator: the pathname of the parent in UTF-16LE, with backslashes, as Windows expects. */
+    memset(ctx->s = ctx->sbuf, 0, 0x200);
+    for (q = ctx->vhd_parent_fn; *q != '\0'; ++q) {
+      dw(*q == '/' ? '\\' : (ub)*q);  /* Only ASCII is converted correctly. */
+    }
+    write_output_raw((uint64_t)parent_locator_sec << 9, ctx->sbuf, 0x200);
+  }
+  memset(ctx->s = (char*)ctx->copy_buf, 0, 0x400);
+  memcpy(ctx->s, "cxsparse", 8); ctx->s += 8;  /* cookie. */
+  dd(-1);  /* data_offset high dword. Unused. */
+  dd(-1);  /* data_offset low dword. */
+  dd(0);  /* table_offset high dword. */
+  ddb(VHD_BAT_SEC_OFS << 9);  /* table_offset low dword. */
+  ddb(0x10000);  /* header_version. */
+  ddb((vhd_sector_count + ((ud)1 << VHD_LOG2_BLOCK_SECTORS) - 1U) >> VHD_LOG2_BLOCK_SECTORS);  /* max_table_entries. */
+  ddb((ud)1 << (VHD_LOG2_BLOCK_SECTORS + 9));  /* block_size. */
+  /* checksum, parent_unique_id, parent_time_stamp, parent_unicode_name, parent_locator_entries: 0 for a dynamic VHD. */
+  if (ctx->vhd_parent_fn) {
+    ctx->s = (char*)ctx->copy_buf + 0x28;
+    memcpy(ctx->s, ctx->vhd_parent_id, 0x14); ctx->s += 0x14;  /* parent_unique_id and parent_time_stamp. */
+    ctx->s += 4;  /* reserved. */
+    for (q = r = ctx->vhd_parent_fn; *r != '\0'; ++r) {
+      if (*r == '/' || *r == '\\') q = r + 1;
+    }
+    for (; *q != '\0'; ++q) {
+      dwb((ub)*q);  /* parent_unicode_name: basename of the parent in UTF-16BE. */
+    }
+    ctx->s = (char*)ctx->copy_buf + 0x240;  /* The first parent_locator_entry. */
+    memcpy(ctx->s, is_absolute_path(ctx->vhd_parent_fn) ? "W2ku" : "W2ru", 4); ctx->s += 4;  /* platform_code: absolute or relative Windows pathname. */
+    ddb(0x200);  /* platform_data_space. In bytes, as Windows does it. */
+    ddb(strlen(ctx->vhd_parent_fn) << 1);  /* platform_data_length. */
+    ddb(0);  /* reserved. */
+    dd(0);  /* platform_data_offset high dword. */
+    ddb(parent_locator_sec << 9);  /* platform_data_offset low dword. */
+  }
+  for (checksum = (ud)-1, p = (char*)ctx->copy_buf; p != (char*)ctx->copy_buf + 0x400; checksum -= *(const ub*)p++) {}
+  ctx->s = (char*)ctx->copy_buf + 0x24; ddb(checksum);
+  write_output_raw(0x200, ctx->copy_buf, 0x400);
+  for (i = 0; i < ctx->vhd_bat_sector_count << 7; i += j) {  /* Write the BAT in big endian. */
+    for (ctx->s = (char*)ctx->copy_buf, j = 0; j < sizeof(ctx->copy_buf) >> 2 && i + j < ctx->vhd_bat_sector_count << 7; ++j) {
+      ddb(ctx->vhd_bat[i + j]);
+    }
+    write_output_raw(((uint64_t)VHD_BAT_SEC_OFS << 9) + (i << 2), ctx->copy_buf, (unsigned)(j << 2));
+  }
+  free_memory(ctx->vhd_bat);
+  ctx->vhd_bat = NULL;
+  ctx->vhd_parent_fn = NULL;
+  ctx->output_block_sector_mask = 0;
+}
+
+/* Starts qcow2 output (see map_output_ofs(...)) for the disk image
+ * described by *fpp, with the FAT clusters starting at sector
+ * fat_clusters_sec_ofs. The qcow2 cluster size is the largest power of 2
+ * which divides the byte offset of the FAT clusters, at least 4 KiB, at
+ * most the FAT cluster size. Thus each FAT cluster is within a single
+ * qcow2 cluster if fat_clusters_sec_ofs is aligned to the FAT cluster
+ * size; otherwise (align_fat(...) aligns only to 4 KiB) a FAT cluster spans
+ * multiple whole qcow2 clusters. For large images, it is doubled until the
+ * L1 table fits to 64 KiB, e.g. it is 64 KiB for 2T.
+ */
+static void start_qcow2(const struct fat_params *fpp, ud fat_clusters_sec_ofs) {
+  ud guest_cluster_count;
+  for (ctx->qcow2_cluster_bits = 12; ctx->qcow2_cluster_bits < fpp->fcp.log2_sectors_per_cluster + 9U && !(fat_clusters_sec_ofs & (((ud)2 << (ctx->qcow2_cluster_bits - 9)) - 1U)); ++ctx->qcow2_cluster_bits) {}
+  for (;; ++ctx->qcow2_cluster_bits) {
+    guest_cluster_count = ((fpp->geometry_sector_count - 1U) >> (ctx->qcow2_cluster_bits - 9)) + 1U;
+    ctx->qcow2_l1_size = ((guest_cluster_count - 1U) >> (ctx->qcow2_cluster_bits - 3)) + 1U;  /* Each L2 table has 1 << (qcow2_cluster_bits - 3) 8-byte entries. */
+    if (ctx->qcow2_l1_size <= 0x2000U) break;
+  }
+  ctx->qcow2_l1 = (ud*)alloc_zero(ctx->qcow2_l1_size * sizeof(ud));
+  ctx->qcow2_l2s = (ud**)alloc_zero(ctx->qcow2_l1_size * sizeof(ud*));
+  ctx->qcow2_file_cluster_count = ctx->qcow2_next_cluster = 1U + (((ctx->qcow2_l1_size << 3) - 1U) >> ctx->qcow2_cluster_bits) + 1U;  /* The header and the L1 table. */
+  set_file_size_scount(ctx->qcow2_file_cluster_count << (ctx->qcow2_cluster_bits - 9));
+  ctx->output_block_sector_mask = ((ud)1 << (ctx->qcow2_cluster_bits - 9)) - 1U;
+}
+
+/* Emits a qcow2 L1 or L2 table entry in big endian, pointing to host
+ * cluster index cluster (0 means unallocated).
+ */
+static void emit_qcow2_entry(ud cluster) {
+  if (cluster) {
+    ddb((ud)0x80000000U | cluster >> (32 - ctx->qcow2_cluster_bits));  /* QCOW_OFLAG_COPIED, because the refcount is 1. */
+    ddb(cluster << ctx->qcow2_cluster_bits);
+  } else {
+    dd(0); dd(0);
+  }
+}
+
+/* Finishes qcow2 output of a disk image of sector_count sectors: writes the
+ * L2 tables, the L1 table, the refcount table, the refcount blocks (after
+ * all other clusters) and the header.
+ */
+static void finish_qcow2(ud sector_count) {
+  const ud cluster_size = (ud)1 << ctx->qcow2_cluster_bits, refcounts_per_block = cluster_size >> 1;
+  ud i, j, k, cluster_count, rt_cluster_count = 0, rb_count = 0, prev_rb_count;
+  uint64_t ofs;
+  flush_sectors();
+  for (i = 0; i < ctx->qcow2_l1_size; ++i) {
+    if (!ctx->qcow2_l2s[i]) continue;
+    for (j = 0, ofs = (uint64_t)ctx->qcow2_l1[i] << ctx->qcow2_cluster_bits; j < cluster_size >> 3; ofs += sizeof(ctx->copy_buf)) {
+      for (ctx->s = (char*)ctx->copy_buf, k = 0; k < sizeof(ctx->copy_buf) >> 3; ++k) {
+        emit_qcow2_entry(ctx->qcow2_l2s[i][j++]);
+      }
+      write_output_raw(ofs, ctx->copy_buf, sizeof(ctx->copy_buf));
+    }
+    free_memory(ctx->qcow2_l2s[i]);
+  }
+  for (i = 0, ofs = cluster_size; i < ctx->qcow2_l1_size; ofs += ctx->s - (char*)ctx->copy_buf) {  /* The L1 table starts at cluster 1. */
+    for (ctx->s = (char*)ctx->copy_buf; i < ctx->qcow2_l1_size && ctx->s != (char*)ctx->copy_buf + sizeof(ctx->copy_buf); ++i) {
+      emit_qcow2_entry(ctx->qcow2_l1[i]);
+    }
+    write_output_raw(ofs, ctx->copy_buf, ctx->s - (char*)ctx->copy_buf);
+  }
+  do {  /* Find the number of refcount blocks, which also count themselves and the refcount table. */
+    prev_rb_count = rb_count;
+    rb_count = (ctx->qcow2_next_cluster + rt_cluster_count + rb_count + refcounts_per_block - 1U) / refcounts_per_block;
+    rt_cluster_count = ((rb_count << 3) + cluster_size - 1U) >> ctx->qcow2_cluster_bits;
+  } while (rb_count != prev_rb_count);
+  cluster_count = ctx->qcow2_next_cluster + rt_cluster_count + rb_count;
+  set_file_size_scount(cluster_count << (ctx->qcow2_cluster_bits - 9));
+  for (i = 0, ofs = (uint64_t)ctx->qcow2_next_cluster << ctx->qcow2_cluster_bits; i < rb_count; ofs += ctx->s - (char*)ctx->copy_buf) {  /* Refcount table. */
+    for (ctx->s = (char*)ctx->copy_buf; i < rb_count && ctx->s != (char*)ctx->copy_buf + sizeof(ctx->copy_buf); ++i) {
+      emit_qcow2_entry(ctx->qcow2_next_cluster + rt_cluster_count + i);
+      ctx->s[-8] &= 0x7f;  /* No QCOW_OFLAG_COPIED in the refcount table. */
+    }
+    write_output_raw(ofs, ctx->copy_buf, ctx->s - (char*)ctx->copy_buf);
+  }
+  for (i = 0, ofs = (uint64_t)(ctx->qcow2_next_cluster + rt_cluster_count) << ctx->qcow2_cluster_bits; i < cluster_count; ofs += sizeof(ctx->copy_buf)) {  /* Refcount blocks: each cluster is used once. */
+    for (ctx->s = (char*)ctx->copy_buf; ctx->s != (char*)ctx->copy_buf + sizeof(ctx->copy_buf); ++i) {
+      dwb(i < cluster_count ? 1U : 0U);
+    }
+    write_output_raw(ofs, ctx->copy_buf, sizeof(ctx->copy_buf));
+  }
+  memset(ctx->s = (char*)ctx->copy_buf, 0, 0x200);
+  memcpy(ctx->s, "QFI\xfb", 4); ctx->s += 4;  /* magic. */
+  ddb(2);  /* version. */
+  ctx->s += 8 + 4;  /* backing_file_offset, backing_file_size: 0. */
+  ddb(ctx->qcow2_cluster_bits);  /* cluster_bits. */
+  ddb(sector_count >> 23); ddb(sector_count << 9);  /* size in bytes. */
+  ddb(0);  /* crypt_method: none. */
+  ddb(ctx->qcow2_l1_size);  /* l1_size. */
+  dd(0); ddb(cluster_size);  /* l1_table_offset. */
+  ddb(ctx->qcow2_next_cluster >> (32 - ctx->qcow2_cluster_bits)); ddb(ctx->qcow2_next_cluster << ctx->qcow2_cluster_bits);  /* refcount_table_offset. */
+  ddb(rt_cluster_count);  /* refcount_table_clusters. */
+  /* nb_snapshots, snapshots_offset: 0. */
+  write_output_raw(0, ctx->copy_buf, 0x200);
+  free_memory(ctx->qcow2_l2s);
+  free_memory(ctx->qcow2_l1);
+  ctx->qcow2_l2s = NULL;
+  ctx->output_block_sector_mask = 0;
+}
+
+/* Writes the fixed-size VHD footer after vhd_sector_count sectors. For
+ * dynamic (and differencing) VHD output, it finishes the output with
+ * finish_vhd_dynamic(...) instead, which writes the footer to both ends.
+ */
+static void write_vhd_footer(const struct fat_params *fpp, ud vhd_sector_count) {
+  ud checksum;
+  /* VHD (.vhd) is the virtual hard disk (virtual HDD) file format
+   * introduced by Connectix Virtual PC (now Microsoft Vitual PC). It has
+   * many subformats. We use the fixed-size subformat by default, the
+   * dynamic subformat (with the default block size of 2 MiB) for DYNVHD,
+   * and the differencing subformat for PARENT=. The latter two make it
+   * possible to create sparse disk images also on FAT filesystems.
+   *
+   * File format docs: https://github.com/libyal/libvhdi/blob/main/documentation/Virtual%20Hard%20Disk%20(VHD)%20image%20format.asciidoc
+   *
+   * Docs about QEMU disk image file format support: https://qemu-project.gitlab.io/qemu/system/images.html
+   *
+   * VirtualBox 5.2.42 and QEMU 2.11.1 don't have the 127 GiB limit on
+   * their virtual IDE controller: using EBIOS LBA (int 13h, AH == 42h),
+   * all VHD sectors up to 2040 GiB can be accessed. The maximum sector
+   * count with CHS access (int 13h, AH == 2h) is 1024 * 255 * 63 (==
+   * 8032.5 MiB), sectors beyond that can't be accessed. QEMU 2.11.1 has a
+   * bug in its BIOS disk geometry reporting (int 13h, AH == 8): it
+   * reports 1 less than the actual number of cylinders -- but it can
+   * still access the last cylinder.
+   *
+   * https://kb.msp360.com/standalone-backup/restore/vhd-disk-size-exceeded
+   * says about MSP360 (Formerly CloudBerry) Backup for Windows: The
+   * maximum size for a virtual hard disk is 2,040 gigabytes (GB).
+   * However, any virtual hard disk attached to the IDE controller cannot
+   * exceed 127 gigabytes (GB). [...] VHDX can handle up to 64 TiB.
+   *
+   * https://serverfault.com/a/770425 says: When QEMU creates a VHD image,
+   * it goes by the original spec, calculating the current_size based on
+   * the nearest CHS geometry (with an exception for disks > 127GB).
+   * Apparently, Azure will only allow images that are sized to the
+   * nearest MB, and the current_size as calculated from CHS cannot
+   * guarantee that. Allow QEMU to create images similar to how Hyper-V
+   * creates images, by setting current_size to the specified virtual disk
+   * size. This introduces an option, force_size, to be passed to the vpc
+   * format during image creation.
+   *
+   * From the QEMU 2.11.1 source file qemu-2.11.1/block/vpc.c: Microsoft
+   * Virtual PC and Microsoft Hyper-V produce and read VHD image sizes
+   * differently. VPC will rely on CHS geometry, while Hyper-V and
+   * disk2vhd use the size specified in the footer.
+   *
+   * Example conversion command from raw (.img) to VHD (.vhd): `qemu-img convert -f raw -o subformat=fixed,force_size -O vpc hd.img hd.vhd`
+   *
+   * QEMU 2.11.1 int 13h AH == 8 has a bug: it reports 1 less cyls (for
+   * both raw .img and .vhd); VirtualBox does it correctly.
+   *
+   * QEMU 2.11.1 autodetects the disk geometry (incorrectly) even if
+   * specified in the .vhd file
+   *
+   * VirtualBox respects the disk geometry in the .vhd file up to the max
+   * of C*H*S == 1024*16*63 =~ 504 MiB; above 1024 cyls it starts doing
+   * transformations.
+   */
+  memset(ctx->s = ctx->sbuf, 0, sizeof(ctx->sbuf));
+  memcpy(ctx->s, "conectix", 8); ctx->s += 8;  /* signature. */
+  ddb(2);  /* features. Just the reserved bit is set. */
+  ddb(0x10000);  /* format_version. */
+  if (ctx->vhd_bat) {
+    dd(0);  /* next_offset high dword. */
+    ddb(0x200);  /* next_offset low dword: the dynamic disk header. */
+  } else {
+    dd(-1);  /* next_offset high dword. */
+    dd(-1);  /* next_offset low dword. */
+  }
+  dd(0);  /* modification_time. */
+  dd(fpp->geometry_sector_count > (ud)65535U * 16U * 255U ? (ud)('w' | 'i' << 8 | (ud)'n' << 16 | (ud)' ' << 24) :
+     (ud)('v' | 'p' << 8 | (ud)'c' << 16 | (ud)' ' << 24));  /* creator_application: Typically "qemu" (CHS), "vpc " (CHS), "qem2" (force_size), "win " (force_size). */
+  ddb(0x50003);  /* creator_version. */
+  dd('W' | 'i' << 8 | (ud)'2' << 16 | (ud)'k' << 24);  /* host_os. */
+  dsb(vhd_sector_count);  /* disk_size. */
+  dsb(vhd_sector_count);  /* data_size. */
+  if (fpp->geometry_sector_count <= (ud)1024U * 16U * 63U) {  /* Compatible with bos BIOS and IDE, <= 504 MiB. */
+    dwb((fpp->geometry_sector_count + (16U * 63U - 1U)) / (16U * 63U));  /* disk_geometry.cyls. */  /* Round up. */
+    db(16U);  /* disk_geometry.heads. */
+    db(63U);  /* disk_geometry.secs. */
+  } else if (fpp->geometry_sector_count >= (ud)65535U * 16U * 255U) {
+    dwb(65535U);  /* disk_geometry.cyls. */
+    db(16U);  /* disk_geometry.heads. */
+    db(255U);  /* disk_geometry.secs. */
+  } else {
+    dwb((fpp->geometry_sector_count + (16U * 255U - 1U)) / (16U * 255U));  /* disk_geometry.cyls. */  /* Round up. */
+    db(16U);  /* disk_geometry.heads. */
+    db(255U);  /* disk_geometry.secs. */
+  }
+  ddb(fpp->vhd_mode);  /* disk_type: VHD_FIXED --> 2, VHD_DYNAMIC --> 3. */
+  dd(0);  /* checksum. On mismatch, QEMU reports a warning. */
+  dd(fpp->volume_id);  /* First 4 bytes of identifier: 16-byte big-endian UUID. */
+  dd(fpp->geometry_sector_count);  /* Next 4 bytes of identifier. */
+  db(fpp->fat_fstype + (fpp->fat_count - 1U));  /* Next 1 byte of identifier. */
+  /* VirtualBox doesn't allow adding a disk with the same UUID, so adding
+   * two disk images created with bakefat (without the RNDUUID
+   * command-line flag) won't work. QEMU doesn't have such a limitation.
+   * */
+  memcpy(ctx->s, "\xb5\xd4\x99\xe3\xbc\x63\x46", 7); ctx->s += 7;  /* identifier: Big endian UUID. */
+  /*db(0);*/  /* saved_state. Trailing NUL bytes can be unspecified. */
+  for (checksum = (ud)-1; ctx->s != ctx->sbuf; checksum -= *(const ub*)--ctx->s) {}
+  ctx->s = ctx->sbuf + 0x40; ddb(checksum);
+  if (ctx->vhd_bat) {
+    finish_vhd_dynamic(vhd_sector_count);
+  } else {
+    write_sector(vhd_sector_count);
+  }
+}
+
+#if defined(BAKEFAT_POSIX) && defined(S_ISBLK)
+  static char is_block_device(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISBLK(st.st_mode);
+  }
+#else
+#  define is_block_device(fd) 0
+#endif
+
+/* Bits of the output_flags argument of create_fat(...). */
+#define OF_REUSE 1  /* REUSE. */
+#define OF_THICK 2  /* THICK. */
+
+/* Allocates disk space for the first scount sectors of the output file
+ * (which has at least this size), so that the filesystem of the host can
+ * make it contiguous, and writes by the guest won't fragment it. Elsewhere
+ * (e.g. on Win32) it is enough not to make the output file sparse.
+ */
+static void allocate_output_file(ud scount) {
+#if defined(BAKEFAT_POSIX)
+  int error;
+  if (is_block_device(ctx->sfd)) return;  /* Already allocated. */
+#  ifdef __linux__
+  error = fallocate(ctx->sfd, 0, 0, (uint64_t)scount << 9) == 0 ? 0 : errno;
+  if (error == EOPNOTSUPP) error = posix_fallocate(ctx->sfd, 0, (uint64_t)scount << 9);  /* E.g. on ext2, ext3 or older ZFS. glibc emulates it by writing to each block. */
+#  else
+  error = posix_fallocate(ctx->sfd, 0, (uint64_t)scount << 9);
+#  endif
+  if (error) {
+    msg_printf("fatal: error allocating disk space for output file: %s: %s\n", strerror(error), ctx->sfn);
+    exit(2);
+  }
+#else
+  (void)scount;
+#endif
+}
+
+#if defined(BAKEFAT_POSIX) && defined(__linux__) && defined(FS_IOC_FIEMAP)
+  /* Reports the number of physically contiguous extents the filesystem of
+   * the host has used for the output file. 1 is the best.
+   */
+  static void report_host_extents(void) {
+    uint64_t fiemap_buf[0x800 / sizeof(uint64_t)];  /* Aligned for struct fiemap. */
+    struct fiemap *fmp = (struct fiemap*)fiemap_buf;
+    const struct fiemap_extent *fep, *fep_end;
+    uint64_t next_physical = (uint64_t)-1;
+    ud extent_count = 0;
+    fmp->fm_start = 0;
+    do {
+      fmp->fm_length = ~(uint64_t)0 - fmp->fm_start;
+      fmp->fm_flags = fmp->fm_start ? 0 : FIEMAP_FLAG_SYNC;
+      fmp->fm_mapped_extents = 0;
+      fmp->fm_extent_count = (sizeof(fiemap_buf) - sizeof(*fmp)) / sizeof(*fep);
+      fmp->fm_reserved = 0;
+      if (ioctl(ctx->sfd, FS_IOC_FIEMAP, fmp) != 0) return;  /* E.g. block device or tmpfs. */
+      for (fep = fmp->fm_extents, fep_end = fep + fmp->fm_mapped_extents; fep != fep_end; ++fep) {
+        if (fep->fe_physical != next_physical) ++extent_count;  /* Adjacent extents (e.g. written and unwritten) are counted as one. */
+        next_physical = fep->fe_physical + fep->fe_length;
+        fmp->fm_start = fep->fe_logical + fep->fe_length;
+      }
+    } while (fmp->fm_mapped_extents && !(fep[-1].fe_flags & FIEMAP_EXTENT_LAST));
+    msg_printf("info: thick: output file uses %lu host extents: %s\n", (unsigned long)extent_count, ctx->sfn);
+  }
+#else
+#  define report_host_extents() do {} while (0)
+#endif
+
+/* Replaces the contents of count sectors starting at sector sec of the
+ * output file with NUL bytes. On Linux, it punches a hole, which is fast and
+ * keeps the image file sparse. On a block device, it uses BLKZEROOUT, which
+ * lets the device do it (e.g. with discard or write-zeroes).
+ */
+static void zero_sectors(ud sec, ud count) {
+  uint64_t ofs = (uint64_t)sec << 9;
+  unsigned want;
+#if defined(BAKEFAT_POSIX) && defined(__linux__) && defined(BLKZEROOUT)
+  uint64_t range[2];
+#endif
+  flush_sectors();
+#if defined(BAKEFAT_POSIX) && defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_KEEP_SIZE)
+  if (fallocate(ctx->sfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, ofs, (uint64_t)count << 9) == 0) return;
+#endif
+#if defined(BAKEFAT_POSIX) && defined(__linux__) && defined(BLKZEROOUT)
+  range[0] = ofs;
+  range[1] = (uint64_t)count << 9;
+  if (ioctl(ctx->sfd, BLKZEROOUT, range) == 0) return;  /* Fails with ENOTTY on regular files. */
+#endif
+  if ((uint64_t)bakefat_lseek64(ctx->sfd, ofs, SEEK_SET) != ofs) {
+    msg_printf("fatal: error seeking in output file: %s\n", ctx->sfn);
+    exit(2);
+  }
+  memset(ctx->copy_buf, 0, sizeof(ctx->copy_buf));
+  for (ofs = (uint64_t)count << 9; ofs; ofs -= want) {
+    want = ofs > sizeof(ctx->copy_buf) ? (unsigned)sizeof(ctx->copy_buf) : (unsigned)ofs;
+    if ((size_t)write(ctx->sfd, ctx->copy_buf, want) != want) {
+      msg_printf("fatal: error writing to output file: %s\n", ctx->sfn);
+      exit(2);
+    }
+  }
+}
+
+static void create_fat(const struct fat_params *fpp, ub output_flags) {
+  const ud fat_rootdir_sector_count = (ud)fpp->fcp.rootdir_entry_count >> 4;
+  const ud fat_fat_sec_ofs = fpp->hidden_sector_count + fpp->reserved_sector_count;
+  const ud fat_rootdir_sec_ofs = fat_fat_sec_ofs + ((ud)fpp->fcp.sectors_per_fat << (fpp->fat_count - 1U));
+  const ud fat_clusters_sec_ofs = fat_rootdir_sec_ofs + fat_rootdir_sector_count;
+  ud vhd_sector_count = 0, file_sector_count;
+#  ifdef DEBUG
+    /* We have the +2 here because clusters 0 and 1 have a next-pointer in the FATs, but they are not stored on disk. */
+    const ud min_sectors_per_fat =
+        fpp->fat_fstype == 32 ? (fpp->fcp.cluster_count + (2U + 0x7fU)) >> 7 :
+        fpp->fat_fstype == 16 ? (fpp->fcp.cluster_count + (2U + 0xffU)) >> 8 :
+        /* FAT12: */ ((((fpp->fcp.cluster_count + 2) * 3 + 1) >> 1) + 0x1ff) >> 9;
+    const ud min_sector_count = fat_clusters_sec_ofs - fpp->hidden_sector_count + ((ud)fpp->fcp.cluster_count << fpp->fcp.log2_sectors_per_cluster);
+    const ud max_sector_count = min_sector_count + (ud)(1 << fpp->fcp.log2_sectors_per_cluster) - 1;
+    /* Rootdir entry count must be a multiple of 0x10.  ; Some DOS msload boot code relies on this (i.e. rounding down == rounding up). */
+    if (fpp->fat_fstype != 12 && fpp->fat_fstype != 16 && fpp->fat_fstype != 32) fatal0("ASSERT_BAD_FAT_FSTYPE");
+    if ((fpp->fat_count - 1U) > 2U - 1U) fatal0("ASSERT_BAD_FAT_COUNT");
+    if ((sd)fpp->fcp.cluster_count <= (fpp->fat_fstype == 32 ? 1 : 0)) fatal0("ASSERT_BAD_CLUSTER_COUNT");  /* We count the root directory cluster in FAT32. */
+    if (fpp->fat_fstype == 12 && fpp->fcp.cluster_count > 0xff4) fatal0("TOO_MANY_CLUSTERS_FOR_FAT12");
+    if (fpp->fat_fstype == 16 && fpp->fcp.cluster_count > 0xfff4) fatal0("TOO_MANY_CLUSTERS_FOR_FAT16");
+    if (fpp->fat_fstype == 32 && fpp->fcp.cluster_count > 0xffffff5) fatal0("TOO_MANY_CLUSTERS_FOR_FAT32");
+    if ((sd)fat_fat_sec_ofs < 0 || fat_rootdir_sec_ofs <= fat_fat_sec_ofs || fat_clusters_sec_ofs < fat_rootdir_sec_ofs) fatal0("FAT_TOO_LARGE_BEFORE_CLUSTERS");
+    if (fpp->fcp.log2_sectors_per_cluster > 6) fatal0("ASSERT_BAD_SECTORS_PER_CLUSTER");
+    if (fpp->fcp.cluster_count > (0xffffffffU >> fpp->fcp.log2_sectors_per_cluster)) fatal0("ASSERT_TOO_MANY_SECTORS_IN_CLUSTERS");  /* !! Use ...UL suffix for >16-bit integer literals. */
+    if ((fpp->fcp.cluster_count << fpp->fcp.log2_sectors_per_cluster) > fpp->fcp.sector_count - fat_clusters_sec_ofs) fatal0("ASSERT_TOO_FEW_SECTORS");  /* This can signify an overflow in sector_count calculations. */
+    if (fpp->fcp.sectors_per_fat < min_sectors_per_fat) fatal0("ASSERT_BAD_SECTORS_PER_FAT");
+    if (fpp->fcp.rootdir_entry_count & 0xf) fatal0("ASSERT_BAD_ROOTDIR_ENTRY_COUNT");
+    if (fpp->fat_fstype == 16 && fpp->fcp.cluster_count < 0xff7) fatal0("TOO_FEW_CLUSTERS_FOR_FAT16");
+    if (fpp->fat_fstype == 32 && fpp->fcp.cluster_count < 0xfff5) fatal0("TOO_FEW_CLUSTERS_FOR_FAT32");
+    if (fpp->fcp.sector_count < min_sector_count) fatal0("TOO_FEW_SECTORS");
+    if (fpp->fat_fstype == 12 && fpp->fcp.sector_count > max_sector_count) fatal0("TOO_MANY_SECTORS");  /* Compared to fat12_preset. */
+    if (fpp->hidden_sector_count > 0xffffU - fpp->reserved_sector_count) fatal0("TOO_MANY_HIDDEN_SECTORS");  /* It has to fit to a 16-bit word in the FAT header in the MBR. */
+    if (fpp->fcp.sectors_per_track == 0 || fpp->hidden_sector_count % fpp->fcp.sectors_per_track) fatal0("BAD_HIDDEN_SECTOR_COUNT_MODULO");  /* MS-DOS <=6.x requires that hidden_sector_count is a multiple of sectors_per_track. */
+#  else
+    (void)fatal0;  /* !! Remove definition if not used for DEBUG. */
+#  endif
+  if (IS_VHD(fpp->vhd_mode)) {
+    vhd_sector_count = get_vhd_sector_count(fpp);
+#    ifdef DEBUG
+      msg_printf("info: vhd_sector_count=%lu=0x%lx\n", (unsigned long)vhd_sector_count, (unsigned long)vhd_sector_count);
+#    endif
+    file_sector_count = vhd_sector_count + 1U;  /* +1U for the VHD footer sector. */
+  } else {
+    file_sector_count = fpp->geometry_sector_count;
+  }
+  if (fpp->vhd_mode == VHD_DYNAMIC) {
+    start_vhd_dynamic(vhd_sector_count);
+  } else if (fpp->vhd_mode == VHD_QCOW2) {
+    start_qcow2(fpp, fat_clusters_sec_ofs);
+  } else if ((output_flags & OF_REUSE) && is_block_device(ctx->sfd)) {  /* Its size can't be changed. */
+    if ((uint64_t)bakefat_lseek64(ctx->sfd, 0, SEEK_END) < (uint64_t)file_sector_count << 9) {
+      msg_printf("fatal: block device too small, needs 0x%lx sectors: %s\n", (unsigned long)file_sector_count, ctx->sfn);
+      exit(2);
+    }
+  } else if (!ctx->simg_pass) {
+    set_file_size_scount(file_sector_count);
+  }
+  if (output_flags & OF_REUSE) {  /* Clear the old data in the sectors create_fat(...) relies on being NUL: everything up to the end of the used clusters (including the FAT32 root directory). The free clusters are kept as is, like mkfs does. */
+    zero_sectors(0, fat_clusters_sec_ofs + (ctx->used_cluster_count << fpp->fcp.log2_sectors_per_cluster));
+#    ifdef DEBUG
+      msg_printf("info: reuse: zeroed 0x%lx sectors\n", (unsigned long)(fat_clusters_sec_ofs + (ctx->used_cluster_count << fpp->fcp.log2_sectors_per_cluster)));
+#    endif
+  }
+  if (output_flags & OF_THICK) allocate_output_file(file_sector_count);  /* After zero_sectors(...), which may punch a hole. */
+
+  write_boot_sectors(fpp);
+
+  if (fpp->fat_fstype == 32 && fpp->reserved_sector_count > 1U) {  /* Write fsinfo sector for FAT32. https://en.wikipedia.org/wiki/Design_of_the_FAT_file_system#FS_Information_Sector */
+    memset(ctx->s = ctx->sbuf, 0, sizeof(ctx->sbuf));
+    dd('R' | 'R' << 8 | (ud)'a' << 16 | (ud)'A' << 24);  /* .header. */
+    ctx->s += 0x1e0;  /* .reserved. The values are 0. */
+    dd('r' | 'r' << 8 | (ud)'A' << 16 | (ud)'a' << 24);  /* .signature2. */
+    dd(fpp->fcp.cluster_count - ctx->used_cluster_count);  /* .free_cluster_count. The root directory and the pfiles occupy used_cluster_count clusters. */
+    dd(ctx->used_cluster_count + 1U);  /* .most_recently_allocated_cluster_ofs. The last cluster of the root directory or of the last pfile. */
+    ctx->s += 0xc + 2;  /* .reserved2 and first 2 bytes of .signature3. The values are 0. */
+    dw(BOOT_SIGNATURE);
+    write_sector(fpp->hidden_sector_count + 1U);
+  }
+
+  /* Write the used sectors of each FAT, the root directory entries and the file data. */
+  if (ctx->simg_pass && fpp->fat_count > 1) {  /* Write the FATs one after the other, to keep the output in ascending order. */
+    write_fats(fpp, fat_fat_sec_ofs, 1);
+    write_fats(fpp, fat_fat_sec_ofs + fpp->fcp.sectors_per_fat, 1);
+  } else {
+    write_fats(fpp, fat_fat_sec_ofs, fpp->fat_count);
+  }
+  write_pfiles(fat_rootdir_sec_ofs, fat_clusters_sec_ofs, fpp->fcp.log2_sectors_per_cluster);
+
+  if (IS_VHD(fpp->vhd_mode)) write_vhd_footer(fpp, vhd_sector_count);
+  if (fpp->vhd_mode == VHD_QCOW2) finish_qcow2(fpp->geometry_sector_count);
+  flush_sectors();
+  if (output_flags & OF_THICK) report_host_extents();
+}
+
+static void read_sector(ud sofs, char *buf) {
+  const uint64_t ofs = (uint64_t)sofs << 9;
+  flush_sectors();
+  if ((uint64_t)bakefat_lseek64(ctx->sfd, ofs, SEEK_SET) != ofs || (size_t)read(ctx->sfd, buf, 0x200) != 0x200) {
+    msg_printf("fatal: error reading sector 0x%x of image file: %s\n", (unsigned)sofs, ctx->sfn);
+    exit(2);
+  }
+}
+
+/* Returns a larger copy of array p, which has *capacity_ptr items, the
+ * first count of them used. Updates *capacity_ptr. Exits on out of memory.
+ */
+static void *grow_array(void *p, ud count, ud *capacity_ptr, size_t item_size) {
+  void *q;
+  const ud capacity = *capacity_ptr ? *capacity_ptr << 1 : 16U;
+  if (capacity > ((size_t)-1 >> 1) / item_size) fatal0("out of memory");  /* Prevent overflow below. */
+#if defined(__MMLIBC386__) || defined(BAKEFAT_LIBRARY)  /* No realloc(...) on mmlibc386. In the library, the block must stay in ctx->memory_blocks. */
+  q = alloc_zero(capacity * item_size);
+  if (count) memcpy(q, p, count * item_size);
+  free_memory(p);
+#else
+  (void)count;
+  if ((q = realloc(p, capacity * item_size)) == NULL) fatal0("out of memory");
+#endif
+  *capacity_ptr = capacity;
+  return q;
+}
+
+struct fat_extent {  /* A run of free clusters. */
+  ud start_cluster;
+  ud cluster_count;
+};
+
+struct fat_dirty_sector {  /* A modified sector of the first FAT, not written yet. */
+  ud sec;  /* Relative to the start of the FAT. */
+  char data[0x200];
+};
+
+/* An existing FAT filesystem in the image file sfd, with a free-cluster
+ * map and a cache of modified FAT sectors. Memory usage is proportional
+ * to the fragmentation of the free space and to the number of modified
+ * FAT sectors, not to the size of the filesystem.
+ */
+struct fat_image {
+  ud fat_sec_ofs;  /* Sector offset of the first FAT. */
+  ud sectors_per_fat;
+  ud rootdir_sec_ofs;  /* FAT12 and FAT16 only. */
+  ud clusters_sec_ofs;  /* Sector offset of cluster 2. */
+  ud cluster_count;
+  ud rootdir_start_cluster;  /* FAT32 only. */
+  ud fsinfo_sec_ofs;  /* FAT32 only, 0 if there is no FSInfo sector. */
+  ud fsinfo_copy_sec_ofs;  /* FAT32 only, 0 if there is no backup FSInfo sector. */
+  uw rootdir_entry_count;  /* FAT12 and FAT16 only. */
+  ub fat_fstype;
+  ub fat_count;
+  ub log2_sectors_per_cluster;
+  struct fat_extent *extents;  /* Sorted by start_cluster, nonadjacent. Built by scan_fat_image(...). */
+  ud extent_count, extent_capacity;
+  ud free_cluster_count;
+  struct fat_dirty_sector *dirty_sectors;  /* Sorted by sec. Written by flush_fat_image(...). */
+  ud dirty_sector_count, dirty_sector_capacity;
+  ud read_sec;  /* The sector of the first FAT in read_buf, or (ud)-1. */
+  char read_buf[0x200];
+};
+
+/* Parses the FAT boot sector in sbuf, which is at sector part_sec_ofs.
+ * Returns 1 on success, 0 if it doesn't look like a FAT filesystem.
+ */
+static ub parse_fat_boot_sector(struct fat_image *fip, ud part_sec_ofs) {
+  ud sector_count, sectors_per_fat, fat_entry_count, meta_sector_count;
+  const uw reserved_sector_count = gw(ctx->sbuf + 0xe);
+  ub log2_spc;
+  if (gw(ctx->sbuf + 0xb) != 0x200 || gw(ctx->sbuf + 0x1fe) != BOOT_SIGNATURE) return 0;
+  for (log2_spc = 0; log2_spc < 8U && (1U << log2_spc) != (ub)ctx->sbuf[0xd]; ++log2_spc) {}
+  fip->fat_count = ctx->sbuf[0x10];
+  fip->rootdir_entry_count = gw(ctx->sbuf + 0x11);
+  sector_count = gw(ctx->sbuf + 0x13) ? gw(ctx->sbuf + 0x13) : gd(ctx->sbuf + 0x20);
+  sectors_per_fat = gw(ctx->sbuf + 0x16) ? gw(ctx->sbuf + 0x16) : gd(ctx->sbuf + 0x24);
+  if (log2_spc == 8U || reserved_sector_count == 0 || fip->fat_count - 1U > 1U || (fip->rootdir_entry_count & 0xfU) || sectors_per_fat == 0) return 0;
+  if (sectors_per_fat >= sector_count >> 1) return 0;  /* Also prevents overflow below. */
+  meta_sector_count = reserved_sector_count + (sectors_per_fat << (fip->fat_count - 1U)) + (fip->rootdir_entry_count >> 4);
+  if (meta_sector_count >= sector_count) return 0;
+  fip->log2_sectors_per_cluster = log2_spc;
+  fip->sectors_per_fat = sectors_per_fat;
+  fip->fat_sec_ofs = part_sec_ofs + reserved_sector_count;
+  fip->rootdir_sec_ofs = fip->fat_sec_ofs + (sectors_per_fat << (fip->fat_count - 1U));
+  fip->clusters_sec_ofs = part_sec_ofs + meta_sector_count;
+  fip->cluster_count = (sector_count - meta_sector_count) >> log2_spc;
+  if (gw(ctx->sbuf + 0x16) == 0) {
+    if (fip->rootdir_entry_count) return 0;
+    fip->fat_fstype = 32;
+    fat_entry_count = sectors_per_fat > (0xffffff8U >> 7) ? 0xffffff8U : sectors_per_fat << 7;
+    fip->rootdir_start_cluster = gd(ctx->sbuf + 0x2c);
+    if (gw(ctx->sbuf + 0x30) - 1U < reserved_sector_count - 1U) {
+      fip->fsinfo_sec_ofs = part_sec_ofs + gw(ctx->sbuf + 0x30);
+      if (gw(ctx->sbuf + 0x32) && gw(ctx->sbuf + 0x32) + gw(ctx->sbuf + 0x30) < reserved_sector_count) fip->fsinfo_copy_sec_ofs = fip->fsinfo_sec_ofs + gw(ctx->sbuf + 0x32);
+    }
+  } else {
+    fip->fat_fstype = fip->cluster_count < 0xff5U ? 12 : 16;
+    fat_entry_count = fip->fat_fstype == 12 ? (sectors_per_fat << 10) / 3U : sectors_per_fat << 8;
+  }
+  if (fip->cluster_count > fat_entry_count - 2U) fip->cluster_count = fat_entry_count - 2U;
+  if (fip->cluster_count == 0) return 0;
+  if (fip->fat_fstype == 32 && fip->rootdir_start_cluster - 2U >= fip->cluster_count) return 0;
+  return 1;
+}
+
+/* Finds the FAT filesystem in the image file sfd: in the first partition
+ * (if the image starts with an MBR), or at the beginning.
+ */
+static void open_fat_image(struct fat_image *fip) {
+  ud part_sec_ofs;
+  ub ptype;
+  memset(fip, 0, sizeof(*fip));
+  fip->read_sec = (ud)-1;
+  read_sector(0, ctx->sbuf);
+  ptype = ctx->sbuf[0x1be + 4];
+  part_sec_ofs = gd(ctx->sbuf + 0x1be + 8);
+  if (part_sec_ofs && (ptype == PTYPE_FAT12 || ptype == PTYPE_FAT16_LESS_THAN_32MIB || ptype == PTYPE_FAT16 || ptype == PTYPE_FAT32 || ptype == PTYPE_FAT32_LBA || ptype == PTYPE_FAT16_LBA)) {
+    read_sector(part_sec_ofs, ctx->sbuf);
+    if (parse_fat_boot_sector(fip, part_sec_ofs)) return;
+    read_sector(0, ctx->sbuf);
+  }
+  if (!parse_fat_boot_sector(fip, 0)) {
+    msg_printf("fatal: no FAT filesystem found in image file: %s\n", ctx->sfn);
+    exit(2);
+  }
+}
+
+static void add_free_extent(struct fat_image *fip, ud start_cluster, ud cluster_count) {
+  if (fip->extent_count == fip->extent_capacity) fip->extents = (struct fat_extent*)grow_array(fip->extents, fip->extent_count, &fip->extent_capacity, sizeof(struct fat_extent));
+  fip->extents[fip->extent_count].start_cluster = start_cluster;
+  fip->extents[fip->extent_count++].cluster_count = cluster_count;
+  fip->free_cluster_count += cluster_count;
+}
+
+/* Reads the first FAT sequentially (only once), and builds the
+ * free-cluster map: fip->extents and fip->free_cluster_count.
+ */
+static void scan_fat_image(struct fat_image *fip) {
+  const ud cluster_end = fip->cluster_count + 2U;
+  ud cluster = 0, run_start = 0, value, i;
+  unsigned want;
+  const char *p;
+  const uint64_t ofs = (uint64_t)fip->fat_sec_ofs << 9;
+  flush_sectors();
+  if ((uint64_t)bakefat_lseek64(ctx->sfd, ofs, SEEK_SET) != ofs) goto error_reading;
+  while (cluster != cluster_end) {
+    i = cluster_end - cluster;
+    if (i > sizeof(ctx->copy_buf) >> 2) i = sizeof(ctx->copy_buf) >> 2;  /* Fits in copy_buf also with FAT32. Even, so FAT12 entry pairs (3 bytes) are not split. */
+    want = fip->fat_fstype == 12 ? (unsigned)((i * 3U + 1U) >> 1) : (unsigned)i << (fip->fat_fstype == 32 ? 2 : 1);
+    if ((size_t)read(ctx->sfd, ctx->copy_buf, want) != want) { error_reading:
+      msg_printf("fatal: error reading FAT in image file: %s\n", ctx->sfn);
+      exit(2);
+    }
+    for (p = (const char*)ctx->copy_buf; i; --i, ++cluster) {
+      if (fip->fat_fstype == 32) {
+        value = gd(p) & 0x0fffffffU; p += 4;
+      } else if (fip->fat_fstype == 16) {
+        value = gw(p); p += 2;
+      } else if (cluster & 1) {
+        value = ((ub)p[0] >> 4) | (ud)(ub)p[1] << 4; p += 2;
+      } else {
+        value = (ub)p[0] | ((ud)(ub)p[1] & 0xfU) << 8; ++p;
+      }
+      if (value == 0 && cluster >= 2U) {
+        if (!run_start) run_start = cluster;
+      } else if (run_start) {
+        add_free_extent(fip, run_start, cluster - run_start);
+        run_start = 0;
+      }
+    }
+  }
+  if (run_start) add_free_extent(fip, run_start, cluster - run_start);
+}
+
+/* Allocates cluster_count contiguous free clusters, the first fit.
+ * Returns the first cluster, or 0 if there is no free run long enough.
+ * Doesn't modify the FAT.
+ */
+static ud alloc_clusters(struct fat_image *fip, ud cluster_count) {
+  struct fat_extent *fep;
+  ud cluster;
+  for (fep = fip->extents; fep != fip->extents + fip->extent_count; ++fep) {
+    if (fep->cluster_count >= cluster_count) {
+      cluster = fep->start_cluster;
+      fep->start_cluster += cluster_count;
+      if ((fep->cluster_count -= cluster_count) == 0) {
+        memmove(fep, fep + 1, (fip->extents + --fip->extent_count - fep) * sizeof(*fep));
+      }
+      fip->free_cluster_count -= cluster_count;
+      return cluster;
+    }
+  }
+  return 0;
+}
+
+/* Returns sector sec (relative) of the first FAT, reading it if needed.
+ * If is_dirty, the returned copy will be written by flush_fat_image(...).
+ * The returned pointer is valid only until the next call.
+ */
+static char *get_fat_sector(struct fat_image *fip, ud sec, ub is_dirty) {
+  ud lo = 0, hi = fip->dirty_sector_count, mid;
+  struct fat_dirty_sector *fdsp;
+  while (lo < hi) {  /* Binary search. */
+    mid = lo + ((hi - lo) >> 1);
+    if (fip->dirty_sectors[mid].sec < sec) {
+      lo = mid + 1U;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo < fip->dirty_sector_count && fip->dirty_sectors[lo].sec == sec) return fip->dirty_sectors[lo].data;
+  if (fip->read_sec != sec) {
+    read_sector(fip->fat_sec_ofs + sec, fip->read_buf);
+    fip->read_sec = sec;
+  }
+  if (!is_dirty) return fip->read_buf;
+  if (fip->dirty_sector_count == fip->dirty_sector_capacity) fip->dirty_sectors = (struct fat_dirty_sector*)grow_array(fip->dirty_sectors, fip->dirty_sector_count, &fip->dirty_sector_capacity, sizeof(struct fat_dirty_sector));
+  fdsp = fip->dirty_sectors + lo;
+  memmove(fdsp + 1, fdsp, (fip->dirty_sector_count++ - lo) * sizeof(*fdsp));
+  fdsp->sec = sec;
+  memcpy(fdsp->data, fip->read_buf, 0x200);
+  return fdsp->data;
+}
+
+static ub get_fat_byte(struct fat_image *fip, ud byte_ofs) {
+  return get_fat_sector(fip, byte_ofs >> 9, 0)[byte_ofs & 0x1ffU];
+}
+
+static void set_fat_byte(struct fat_image *fip, ud byte_ofs, ub value, ub mask) {
+  char *p = get_fat_sector(fip, byte_ofs >> 9, 1) + (byte_ofs & 0x1ffU);
+  *p = (*p & ~mask) | (value & mask);
+}
+
+static ud get_fat_entry(struct fat_image *fip, ud cluster) {
+  ud byte_ofs, value;
+  if (fip->fat_fstype == 12) {
+    byte_ofs = cluster + (cluster >> 1);
+    value = get_fat_byte(fip, byte_ofs) | (ud)get_fat_byte(fip, byte_ofs + 1U) << 8;
+    return cluster & 1 ? value >> 4 : value & 0xfffU;
+  }
+  byte_ofs = cluster << (fip->fat_fstype == 32 ? 2 : 1);
+  return fip->fat_fstype == 32 ? gd(get_fat_sector(fip, byte_ofs >> 9, 0) + (byte_ofs & 0x1ffU)) & 0x0fffffffU :
+      gw(get_fat_sector(fip, byte_ofs >> 9, 0) + (byte_ofs & 0x1ffU));
+}
+
+/* Sets the FAT entry of cluster to value (truncated to 12, 16 or 28 bits). */
+static void set_fat_entry(struct fat_image *fip, ud cluster, ud value) {
+  ud byte_ofs;
+  if (fip->fat_fstype == 12) {
+    byte_ofs = cluster + (cluster >> 1);
+    if (cluster & 1) {
+      set_fat_byte(fip, byte_ofs, value << 4, 0xf0);
+      set_fat_byte(fip, byte_ofs + 1U, value >> 4, 0xff);
+    } else {
+      set_fat_byte(fip, byte_ofs, value, 0xff);
+      set_fat_byte(fip, byte_ofs + 1U, value >> 8, 0x0f);
+    }
+  } else {
+    byte_ofs = cluster << (fip->fat_fstype == 32 ? 2 : 1);
+    set_fat_byte(fip, byte_ofs, value, 0xff);
+    set_fat_byte(fip, byte_ofs + 1U, value >> 8, 0xff);
+    if (fip->fat_fstype == 32) {
+      set_fat_byte(fip, byte_ofs + 2U, value >> 16, 0xff);
+      set_fat_byte(fip, byte_ofs + 3U, value >> 24, 0x0f);  /* Keep the high 4 bits. */
+    }
+  }
+}
+
+/* Writes the modified FAT sectors to each FAT, in ascending sector order,
+ * so that flush_sectors(...) can coalesce contiguous runs.
+ */
+static void flush_fat_image(struct fat_image *fip) {
+  const struct fat_dirty_sector *fdsp, *fdsp_end = fip->dirty_sectors + fip->dirty_sector_count;
+  ub i;
+  for (i = 0; i < fip->fat_count; ++i) {
+    for (fdsp = fip->dirty_sectors; fdsp != fdsp_end; ++fdsp) {
+      memcpy(ctx->sbuf, fdsp->data, 0x200);
+      write_sector(fip->fat_sec_ofs + i * fip->sectors_per_fat + fdsp->sec);
+    }
+  }
+  fip->dirty_sector_count = 0;
+  fip->read_sec = (ud)-1;  /* read_buf may be stale. */
+}
+
+/* Updates the free cluster count and the next-free hint in the FAT32
+ * FSInfo sector and its backup copy, based on the free-cluster map.
+ */
+static void write_fsinfo(const struct fat_image *fip) {
+  ud sec, hint;
+  ub i;
+  hint = fip->extent_count ? fip->extents[0].start_cluster : (ud)-1;  /* (ud)-1 means unknown. */
+  if (hint != (ud)-1 && hint > 2U) --hint;  /* Like create_fat(...), use the last used cluster before the first free cluster. */
+  for (i = 0; i < 2U; ++i) {
+    if ((sec = i ? fip->fsinfo_copy_sec_ofs : fip->fsinfo_sec_ofs) == 0) continue;
+    read_sector(sec, ctx->sbuf);
+    if (gd(ctx->sbuf) != ('R' | 'R' << 8 | (ud)'a' << 16 | (ud)'A' << 24) || gd(ctx->sbuf + 0x1e4) != ('r' | 'r' << 8 | (ud)'A' << 16 | (ud)'a' << 24)) continue;  /* Not an FSInfo sector. */
+    ctx->s = ctx->sbuf + 0x1e8;
+    dd(fip->free_cluster_count);  /* .free_cluster_count. */
+    dd(hint);  /* .most_recently_allocated_cluster_ofs. */
+    write_sector(sec);
+  }
+}
+
+/* Adds a directory entry for pfp to the root directory. Extends the FAT32
+ * root directory by a cluster if needed.
+ */
+static void add_root_dir_entry(struct fat_image *fip, const struct pfile *pfp) {
+  ud cluster = fip->rootdir_start_cluster, prev_cluster = 0, sec = 0, sec_end, free_sec = 0, cluster_limit = fip->cluster_count;
+  unsigned i, free_i = 0;
+  for (;;) {
+    if (fip->fat_fstype == 32) {
+      if (cluster - 2U >= fip->cluster_count || !cluster_limit--) fatal0("bad root directory cluster chain");
+      sec = fip->clusters_sec_ofs + ((cluster - 2U) << fip->log2_sectors_per_cluster);
+      sec_end = sec + ((ud)1 << fip->log2_sectors_per_cluster);
+    } else {
+      sec = fip->rootdir_sec_ofs;
+      sec_end = sec + (fip->rootdir_entry_count >> 4);
+    }
+    for (; sec != sec_end; ++sec) {
+      read_sector(sec, ctx->sbuf);
+      for (i = 0; i < 0x200U; i += 32U) {
+        if (ctx->sbuf[i] == 0) {  /* No more entries. */
+          if (!free_sec) { free_sec = sec; free_i = i; }
+          goto write_entry;
+        }
+        if ((ub)ctx->sbuf[i] == 0xe5) {  /* Deleted entry. */
+          if (!free_sec) { free_sec = sec; free_i = i; }
+        } else if (!(ctx->sbuf[i + 11] & FATTR_VOLUME_LABEL) && is_same_dos_name(ctx->sbuf + i, pfp->dos_name)) {  /* Long filename entries also have FATTR_VOLUME_LABEL. */
+          bad_usage1("file already exists in the root directory", pfp->host_fn);
+        }
+      }
+    }
+    if (fip->fat_fstype != 32 || (cluster = get_fat_entry(fip, prev_cluster = cluster)) >= 0x0ffffff8U) break;
+  }
+  if (!free_sec) {
+    if (fip->fat_fstype != 32) bad_usage0("root directory is full");
+    if ((cluster = alloc_clusters(fip, 1)) == 0) fatal0("no free cluster for extending the root directory");
+    set_fat_entry(fip, prev_cluster, cluster);
+    set_fat_entry(fip, cluster, 0x0ffffff8U);
+    free_sec = fip->clusters_sec_ofs + ((cluster - 2U) << fip->log2_sectors_per_cluster);
+    zero_sectors(free_sec, (ud)1 << fip->log2_sectors_per_cluster);
+  }
+ write_entry:
+  read_sector(free_sec, ctx->sbuf);
+  ctx->s = ctx->sbuf + free_i;
+  emit_dir_entry(pfp->dos_name, pfp->attr, pfp->start_cluster, pfp->size);
+  write_sector(free_sec);
+}
+
+/* Adds the PREALLOC= files (the only pfiles in EDIT mode) to the root
+ * directory of the existing filesystem in the image file sfd, each in the
+ * first contiguous free run which is long enough. Without PREALLOC= files,
+ * it only recomputes the FAT32 FSInfo free cluster count and hint.
+ */
+static void edit_fat_image(void) {
+  struct fat_image fi;
+  struct pfile *pfp;
+  ud cluster;
+  open_fat_image(&fi);
+  if (ctx->pfile_count == 0 && fi.fsinfo_sec_ofs == 0) {
+    msg_printf("fatal: no FSInfo sector to update in image file: %s\n", ctx->sfn);
+    exit(2);
+  }
+  scan_fat_image(&fi);
+#  ifdef DEBUG
+    msg_printf("info: edit: FAT%u cluster_count=0x%lx free_cluster_count=0x%lx free_extent_count=0x%lx\n", (unsigned)fi.fat_fstype, (unsigned long)fi.cluster_count, (unsigned long)fi.free_cluster_count, (unsigned long)fi.extent_count);
+#  endif
+  for (pfp = ctx->pfiles; pfp != ctx->pfiles + ctx->pfile_count; ++pfp) {
+    if ((pfp->cluster_count = size_to_cluster_count(pfp->size, fi.log2_sectors_per_cluster)) != 0) {
+      if ((pfp->start_cluster = alloc_clusters(&fi, pfp->cluster_count)) == 0) {
+        msg_printf("fatal: no contiguous free space for file: %s\n", pfp->host_fn);
+        exit(2);
+      }
+      for (cluster = pfp->start_cluster; cluster != pfp->start_cluster + pfp->cluster_count - 1U; ++cluster) {
+        set_fat_entry(&fi, cluster, cluster + 1U);
+      }
+      set_fat_entry(&fi, cluster, 0x0ffffff8U);  /* End-of-chain marker, truncated to 12 or 16 bits. */
+      zero_sectors(fi.clusters_sec_ofs + ((pfp->start_cluster - 2U) << fi.log2_sectors_per_cluster), pfp->cluster_count << fi.log2_sectors_per_cluster);  /* Don't expose data of deleted files. */
+    }
+    add_root_dir_entry(&fi, pfp);
+  }
+  flush_fat_image(&fi);
+  write_fsinfo(&fi);
+  flush_sectors();
+}
+
+/* Punches holes in the image file sfd over the free clusters of the
+ * existing filesystem, so that the data clusters of files deleted by the
+ * guest become sparse again. Only whole 4 KiB blocks are punched (the
+ * block size of most host filesystems), the rest of each free run is left
+ * as is. The FATs and the data of used clusters are not touched.
+ */
+static void compact_fat_image(void) {
+#if defined(BAKEFAT_POSIX) && defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_KEEP_SIZE)
+  struct fat_image fi;
+  const struct fat_extent *fep;
+  uint64_t ofs, end, punched_size = 0;
+  open_fat_image(&fi);
+  scan_fat_image(&fi);
+  flush_sectors();
+  for (fep = fi.extents; fep != fi.extents + fi.extent_count; ++fep) {
+    ofs = (uint64_t)(fi.clusters_sec_ofs + ((fep->start_cluster - 2U) << fi.log2_sectors_per_cluster)) << 9;
+    end = ofs + ((uint64_t)fep->cluster_count << (fi.log2_sectors_per_cluster + 9));
+    ofs = (ofs + 0xfffU) & ~(uint64_t)0xfffU;
+    end &= ~(uint64_t)0xfffU;
+    if (ofs >= end) continue;
+    if (fallocate(ctx->sfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, ofs, end - ofs) != 0) {
+      msg_printf("fatal: error punching hole in image file: %s: %s\n", strerror(errno), ctx->sfn);
+      exit(2);
+    }
+    punched_size += end - ofs;
+  }
+#  ifdef DEBUG
+    msg_printf("info: compact: FAT%u free_cluster_count=0x%lx free_extent_count=0x%lx punched_kib=0x%lx\n", (unsigned)fi.fat_fstype, (unsigned long)fi.free_cluster_count, (unsigned long)fi.extent_count, (unsigned long)(punched_size >> 10));
+#  else
+    (void)punched_size;
+#  endif
+#else
+  fatal0("COMPACT needs punching holes with fallocate(2), only available on Linux");
+#endif
+}
+
+/* Converts the image file in place between raw (vhd_mode == VHD_NOVHD) and
+ * fixed-size VHD (vhd_mode == VHD_FIXED), by removing or appending the VHD
+ * footer. The data sectors are not touched. Appending the footer rounds
+ * the data size up to the nearest MiB, like create_fat(...) does, by
+ * extending the file with ftruncate(2) (keeping it sparse). Removing the
+ * footer of a VHD created by bakefat also removes this rounding. Returns
+ * true iff the image file was a VHD. With vhd_mode == 0, it only detects.
+ */
+static ub convert_vhd_image(ub vhd_mode) {
+  struct fat_params fp;
+  struct fat_image fi;
+  int64_t size;
+  ub is_vhd;
+  flush_sectors();
+  if ((size = bakefat_lseek64(ctx->sfd, 0, SEEK_END)) < 0 || (size & 0x1ff)) {
+    msg_printf("fatal: image file size is not a multiple of 0x200: %s\n", ctx->sfn);
+    exit(2);
+  }
+  is_vhd = 0;
+  if (size >= 0x400) {
+    read_sector((ud)(size >> 9) - 1U, ctx->sbuf);
+    is_vhd = is_same_bytes(ctx->sbuf, "conectix", 8);
+  }
+  if (is_vhd && gd(ctx->sbuf + 0x3c) != (ud)VHD_FIXED << 24) {  /* Big-endian disk_type. */
+    msg_printf("fatal: only fixed-size VHD images can be converted: %s\n", ctx->sfn);
+    exit(2);
+  }
+  if (!vhd_mode) return is_vhd;
+  if (is_vhd == (vhd_mode == VHD_FIXED)) {
+#  ifdef DEBUG
+    msg_printf("info: convert: image file is already in the requested format: %s\n", ctx->sfn);
+#  endif
+    return is_vhd;
+  }
+  if (!is_vhd) {
+    open_fat_image(&fi);  /* Leaves the FAT boot sector in sbuf. */
+    memset(&fp, '\0', sizeof(fp));
+    fp.geometry_sector_count = (ud)(size >> 9);
+    fp.volume_id = gd(ctx->sbuf + (fi.fat_fstype == 32 ? 0x43 : 0x27));
+    fp.fat_fstype = fi.fat_fstype;
+    fp.fat_count = fi.fat_count;
+    fp.vhd_mode = VHD_FIXED;
+    bakefat_set_sparse(ctx->sfd);
+    set_file_size_scount(get_vhd_sector_count(&fp) + 1U);  /* +1U for the VHD footer sector. */
+    write_vhd_footer(&fp, get_vhd_sector_count(&fp));
+    flush_sectors();
+  } else {
+    size -= 0x200;
+    if (is_same_bytes(ctx->sbuf + 0x4d, "\xb5\xd4\x99\xe3\xbc\x63\x46", 7) && gd(ctx->sbuf + 0x48) <= (ud)(size >> 9)) size = (int64_t)gd(ctx->sbuf + 0x48) << 9;  /* Created by bakefat, see the identifier in write_vhd_footer(...). */
+    set_file_size_scount((ud)(size >> 9));
+  }
+  return is_vhd;
+}
+
+static ud align_fat(struct fat_params *fpp, ud fat_clusters_sec_ofs) {
+  ud sector_delta = 0;
+  if (fpp->fcp.log2_sectors_per_cluster >= 3U && (fat_clusters_sec_ofs & 7U)) {  /* Simple alignment: align clusters to a multiple of 4K. */  /* !! Do better alignment, even for the FAT table and the root directory. */
+    sector_delta = -fpp->fcp.log2_sectors_per_cluster & 7U;
+    fpp->reserved_sector_count += sector_delta;
+  }
+  return sector_delta;
+}
+
+/* Adjust geometry for rounding in QEMU 2.11.1.
+ *
+ * Inputs: fpp->fcp.sector_count, fpp->fcp.cluster_count, fpp->fcp.log2_sectors_per_cluster, fpp->fat_fstype.
+ * Outputs: fpp->geometry_sector_count, fpp->fcp.sector_count, fpp->fcp.cluster_count, fpp->cylinder_count (cyls), fpp->head_count (heads), fpp->sectors_per_track (secs).
+ */
+static void adjust_hdd_geometry(struct fat_params *fpp, ud fat_clusters_sec_ofs) {
+  ud cyls, heads, hs;
+  ub mod;
+  fpp->fcp.sectors_per_track = 63U;
+  fpp->fcp.head_count = heads =
+      (fpp->fcp.sector_count <= (ud)1024U * 16U * 63U) ? 16U :
+      (fpp->fcp.sector_count <= (ud)2048U * 32U * 63U) ? 32U :
+      (fpp->fcp.sector_count <= (ud)4096U * 64U * 63U) ? 64U :
+      (fpp->fcp.sector_count <= (ud)8192U * 128U * 63U) ? 128U : 255U;
+  hs = fpp->fcp.head_count * 63U;
+  cyls = fpp->fcp.sector_count == 0U ? (ud)0 : (fpp->fcp.sector_count - 1U) / hs + 1U;  /* This is round_up_div(fpp->fcp.sector_count, hs), but avoids overflow. */
+  fpp->cylinder_count = cyls =
+      (heads == 32U && cyls < 543U) ? 543U :
+      (heads == 64U && cyls < 527U) ? 527U :
+      (heads == 128U && cyls < 519U) ? 519U :
+      (heads == 255U && cyls < 517U) ? 517U : cyls;
+  fpp->geometry_sector_count = cyls * (fpp->fcp.head_count * 63U);
+#  ifdef DEBUG
+    msg_printf("info: geometry: sector_count=0x%lx geometry_sector_count=0x%lx CHS=%lu:%u:%u\n", (unsigned long)fpp->fcp.sector_count, (unsigned long)fpp->geometry_sector_count, (unsigned long)fpp->cylinder_count, (unsigned)fpp->fcp.head_count, (unsigned)fpp->fcp.sectors_per_track);
+    if (fpp->fcp.sector_count > fpp->geometry_sector_count) fatal0("ASSERT_GEOMETRY_BAD_SECTOR_COUNT");
+#  endif
+ fix_sector_count:
+  mod = fpp->fcp.sector_count % 63U;
+  if (mod) {  /* Mtools requires sector_count-hidden_sector_count to be a multiple of sectors_per_track. */
+    /* Here we can choose to round fpp->fcp.sector_count up or down, thus
+     * keeping (up or down), increasing (up) or decreasing (down)
+     * fpp->fcp.cluster_count.
+     */
+    hs = fpp->fcp.sector_count - fat_clusters_sec_ofs;
+    if (((hs + (63U - mod)) >> fpp->fcp.log2_sectors_per_cluster) == (hs >> fpp->fcp.log2_sectors_per_cluster)) {
+#      ifdef DEBUG
+        msg_printf("info: geometry: rounding up without cluster count increase\n");
+#      endif
+     simple_round_up:  /* Rounding up doesn't increase fpp->fcp.cluster_count, so we round up. */
+      fpp->fcp.sector_count += 63U - mod;
+    } else if (((hs - mod) >> fpp->fcp.log2_sectors_per_cluster) < (fpp->fat_fstype == 16 ? 0xff7U : 0xfff5U)) {  /* Rounding down would make the filesystem too small, so we round up, possibly increasing fpp->fcp.sectors_per_fat. */
+      /* This affects FAT16 2M, FAT32 32M, FAT32 64M. */
+      hs = fpp->fcp.sector_count + 63U - mod;
+      mod = fpp->fcp.log2_sectors_per_cluster;
+      heads = (hs - fat_clusters_sec_ofs) >> mod;
+      if ((fpp->fcp.sectors_per_fat << (8 - (fpp->fat_fstype == 32))) - 2U < heads) {  /* The new fpp->fcp.cluster_count doesn't fit in the old FAT table. */
+        /* This affects FAT16 2M, FAT32 32M, FAT32 64M. */
+        ++fpp->fcp.sectors_per_fat;
+        fat_clusters_sec_ofs += fpp->fat_count;
+        fat_clusters_sec_ofs += align_fat(fpp, fat_clusters_sec_ofs);  /* Realign because fat_clusters_sec_ofs has changed. Also ets fpp->fcp.sector_count. */
+        fpp->fcp.sector_count = fat_clusters_sec_ofs + (fpp->fcp.cluster_count << mod);
+#        ifdef DEBUG
+          msg_printf("info: geometry: rounding up with sectors-per-fat increase: sector_count=0x%lx\n", (unsigned long)fpp->fcp.sector_count);
+#        endif
+        goto fix_sector_count;
+      }
+      /* TODO(pts): Add tests. This is never reached. */
+#      ifdef DEBUG
+        msg_printf("info: geometry: rounding up with cluster count increase: new cluster_count=0x%lx sector_count=0x%lx\n", (unsigned long)heads, (unsigned long)hs);
+#      endif
+      fpp->fcp.cluster_count = heads;
+      fpp->fcp.sector_count = hs;
+    } else {  /* Round down, decreasing fpp->fcp.cluster_count and maybe decreasing fpp->fcp.sector_count. */
+      /* This affects most size configurations. */
+      fpp->fcp.sector_count -= mod;
+      mod = fpp->fcp.log2_sectors_per_cluster;
+      fpp->fcp.cluster_count = (fpp->fcp.sector_count - fat_clusters_sec_ofs) >> mod;
+      fpp->fcp.sector_count = fat_clusters_sec_ofs + (fpp->fcp.cluster_count << mod);
+#      ifdef DEBUG
+        msg_printf("info: geometry: rounding down: new cluster_count=0x%lx sector_count=0x%lx\n", (unsigned long)fpp->fcp.cluster_count, (unsigned long)fpp->fcp.sector_count);
+#      endif
+      mod = fpp->fcp.sector_count % 63U;
+      if (mod) goto simple_round_up;
+    }
+  }
+#  ifdef DEBUG
+    if (fpp->fcp.cluster_count > (fpp->fat_fstype == 16 ? 0xfff4U : 0xffffff5U)) fatal0("ASSERT_TOO_MANY_CLUSTERS_AFTER_ROUNDING");
+    if (fpp->fcp.sector_count > fpp->geometry_sector_count) fatal0("ASSERT_GEOMETRY_BAD_FINAL_SECTOR_COUNT");
+    if (fpp->fcp.sector_count % 63U) fatal0("ASSERT_GEOMETRY_SECTOR_COUNT_MODULO_SECS");
+#  endif
+}
+
+static ub is_aligned_fat32_sector_count_at_most(const struct fat_params *fpp, ud fat_cluster_count) {
+  struct fat_params fp = *fpp;  /* This is a memcpy(). */
+  ud fat_clusters_sec_ofs, fat_sector_in_cluster_count;
+  fp.fcp.cluster_count = fat_cluster_count;
+  fp.fcp.sectors_per_fat = (fp.fcp.cluster_count + (2U + 0x7fU)) >> 7U;
+  fat_clusters_sec_ofs = fp.hidden_sector_count + fp.reserved_sector_count + ((ud)fp.fcp.sectors_per_fat << (fp.fat_count - 1U)) /* + (fp.fcp.rootdir_entry_count >> 4U) */;
+  fat_clusters_sec_ofs += align_fat(&fp, fat_clusters_sec_ofs);
+  fat_sector_in_cluster_count = fp.fcp.cluster_count << fp.fcp.log2_sectors_per_cluster;
+  return fat_sector_in_cluster_count <= fp.fcp.sector_count && fat_clusters_sec_ofs <= fp.fcp.sector_count - fat_sector_in_cluster_count;
+}
+
+typedef enum parseint_error_t {
+  PARSEINT_OK = 0,
+  PARSEINT_BAD_PREFIX = 1,
+  PARSEINT_BAD_CHAR = 2,
+  PARSEINT_OVERFLOW = 3,
+  PARSEINT_TOO_SHORT = 4  /* For parse_volume_id(...). */
+} parseint_error_t;
+
+/* Parses a C unsigned decimal, hexadecimal, octal literal, sets *result_ptr
+ * to a result. Returns PARSEINT_OK == 0 on success.
+ */
+static parseint_error_t parse_ud(const char *s, ud *result_ptr) {
+  ud u, limit;
+  ub base, digit;
+  parseint_error_t result;
+#  if ('A' | 0x20) != 'a'
+#    error ASCII required.
+#  endif
+  if (s[0] == '0' && (s[1] | 0x20) == 'x') {
+    base = 16;
+    limit = (ud)-1 / 16U;
+    s += 2;
+  } else if (s[0] == '0') {
+    base = 8;
+    limit = (ud)-1 / 8U;
+    ++s;
+  } else if ((s[0] - ('1' + 0U)) <= 9U - 1U) {
+    base = 10;
+    limit = (ud)-1 / 10U;
+  } else {
+    return PARSEINT_BAD_PREFIX;
+  }
+  for (u = 0, result = PARSEINT_OK; *s != '\0'; ++s) {
+    digit = *s;
+    digit = (base == 16 && (digit | 32U) - ('a' + 0U) < 6U) ? (digit | 32U) - ('a' - 10U) : digit - ('0' + 0U);
+    if (digit >= base) return PARSEINT_BAD_CHAR;
+    if (u > limit) result = PARSEINT_OVERFLOW;
+    u *= base;
+    if (u + digit < u) result = PARSEINT_OVERFLOW;
+    u += digit;
+  }
+  *result_ptr = u;
+  return result;
+}
+
+/* Parses a FAT volume ID (8-digit hexadecimal, with a hyphen (dash, -) in
+ * the middle), sets *result_ptr to a result. The parser is lenient on the
+ * hyphens: it allows them anywhere. Returns PARSEINT_OK == 0 on success.
+ */
+static parseint_error_t parse_volume_id(const char *s, ud *result_ptr) {
+  ud u;
+  ub count, digit;
+  for (u = 0, count = 8; *s != '\0'; ++s) {
+    if ((digit = *s) == '-') continue;
+    if (!count) return PARSEINT_OVERFLOW;
+    digit = (digit | 32U) - ('a' + 0U) < 6U ? (digit | 32U) - ('a' - 10U) : digit - ('0' + 0U);
+    if (digit > 0xfU) return PARSEINT_BAD_CHAR;
+    --count;
+    u <<= 4U;
+    u |= digit;
+  }
+  if (count != 0) return PARSEINT_TOO_SHORT;
+  *result_ptr = u;
+  return PARSEINT_OK;
+}
+
+/* Adds the comma-separated list of <name>:<size> specs in p to pfiles.
+ * The size is in bytes, optionally followed by K, M or G. Modifies p.
+ */
+static void add_prealloc_files(char *p) {
+  struct pfile *pfp;
+  const struct pfile *pfq;
+  char *q, *r;
+  ub shift;
+  ud size;
+  for (;;) {
+    for (q = p; *q != '\0' && *q != ','; ++q) {}
+    for (r = p; r != q && *r != ':'; ++r) {}
+    if (r == q) bad_usage1("missing :<size> in PREALLOC= file", p);
+    pfp = new_pfile();
+    pfp->host_fn = p;
+    pfp->is_prealloc = 1;
+    *r++ = '\0';
+    p = q;
+    if (*p != '\0') *p++ = '\0';
+    if (!set_dos_name(pfp->dos_name, pfp->host_fn)) bad_usage1("PREALLOC= file name is not a valid DOS 8.3 filename", pfp->host_fn);
+    shift = 0;
+    if (q != r) {
+      switch (q[-1] | 0x20) {
+       case 'k': shift = 10; break;
+       case 'm': shift = 20; break;
+       case 'g': shift = 30; break;
+      }
+      if (shift) q[-1] = '\0';
+    }
+    if (parse_ud(r, &size) != PARSEINT_OK) bad_usage1("invalid size in PREALLOC= file", pfp->host_fn);
+    if (size > (0xffffffffU >> shift)) bad_usage1("PREALLOC= file too large for FAT", pfp->host_fn);
+    pfp->size = size << shift;
+    for (pfq = ctx->pfiles; pfq != pfp; ++pfq) {
+      if (is_same_dos_name(pfq->dos_name, pfp->dos_name)) bad_usage1("duplicate SYS= or PREALLOC= file name", pfp->host_fn);
+    }
+    pfp->attr = FATTR_ARCHIVE;
+    if (*p == '\0') break;
+  }
+}
+
+static noreturn void usage(ub is_help, const char *argv0) {
+  char *p = ctx->sbuf;  /* TODO(pts): Check for overflow below. */
+  const char **csp;
+  const char *q, *cluster_size_flags, *hdd_image_size_flags;
+  const struct fat12_preset *prp;
+  /* TODO(pts): Precompute this help message, making the code shorter. */
+  for (prp = fat12_presets; prp != ARRAY_END(fat12_presets); ++prp) {
+    for (q = prp->name, *p++ = ' '; *q != '\0'; *p++ = *q++) {}
+  }
+  *p++ = '\0';
+  hdd_image_size_flags = p;
+  for (csp = hdd_size_presets_m_21; csp != ARRAY_END(hdd_size_presets_m_21); ++csp) {
+    if (strcmp(*csp, "1024M") == 0) break;
+    for (q = *csp, *p++ = ' '; *q != '\0'; *p++ = *q++) {}
+  }
+  for (csp = hdd_size_presets_g_30; csp != ARRAY_END(hdd_size_presets_g_30); ++csp) {
+    if (strcmp(*csp, "1024G") == 0) break;
+    for (q = *csp, *p++ = ' '; *q != '\0'; *p++ = *q++) {}
+  }
+  for (csp = hdd_size_presets_t_40; csp != ARRAY_END(hdd_size_presets_t_40); ++csp) {
+    for (q = *csp, *p++ = ' '; *q != '\0'; *p++ = *q++) {}
+  }
+  *p++ = '\0';
+  cluster_size_flags = p;
+  for (csp = sectors_per_cluster_presets_k_10; csp != ARRAY_END(sectors_per_cluster_presets_k_10); ++csp) {
+    for (q = *csp, *p++ = ' '; *q != '\0'; *p++ = *q++) {}
+  }
+  *p = '\0';
+  /* This help message doesn't contain some alternate spellings of some flags. */
+  msg_printf("bakefat: bootable external FAT disk image creator v%d\n"
+             "Usage: %s <flag> [...] <outfile.img>\n", BAKEFAT_VERSION, argv0);
+#ifdef BAKEFAT_POSIX
+  msg_printf("Batch usage: %s --batch [-j<jobs>] <manifest.txt>\n"
+             "Server usage: %s --serve <socket>\n"
+             "Delta usage: %s --delta <old.img> <new.img> <out.delta>\n"
+             "Apply delta usage: %s --apply <in.delta> <target.img>\n"
+#  ifdef BAKEFAT_DEDUPE
+             "Dedupe usage: %s --dedupe <image.img> [...]\n"
+#  endif
+             "Checksum usage: %s --manifest [-j<jobs>] <image.img> <out.crc>; %s --verify [-j<jobs>] <in.crc> <image.img>\n",
+             argv0, argv0, argv0, argv0,
+#  ifdef BAKEFAT_DEDUPE
+             argv0,
+#  endif
+             argv0, argv0);
+#endif
+  msg_printf("Floppy image size flags:%s\n"
+             "HDD image size flags:%s\n"
+             "Cluster size flags: 512B%s\n%s%s%s",
+             ctx->sbuf, hdd_image_size_flags, cluster_size_flags,
+             "Filesystem type flags: FAT12 FAT16 FAT32\n"
+             "FAT count flags: 1FAT 2FATS FC=<number>\n"
+             "Root directory entry count: RDEC=<number>\n"
+             "Reserved sector count: RSC=<number>\n"
+             "Volume ID: VID=<hex-with-hyphen>\n"
+             "System files to copy: SYS=<file>[,<file>...]\n"
+             "Host directory to copy recursively: TREE=<dir>\n"
+             "Template image cache directory: CACHE=<dir>\n"
+             "Contiguous files to preallocate: PREALLOC=<name>:<size>[K|M|G][,...]\n"
+             "Add PREALLOC= files to (or fix FSInfo in, convert or grow) an existing image: EDIT\n",
+             "Punch holes over the free clusters of an existing image: EDIT COMPACT\n"
+             "Make the files of an existing image contiguous: EDIT DEFRAG\n"
+             "Reformat existing output file or block device in place: REUSE\n"
+             "Allocate the entire output file (not sparse): THICK\n",
+             "Print the number of sectors written and syscalls used: STATS\n"
+             "DOS compatibility flags: DOS3 DOS3.3 DOS4 DOS5 DOS6 DOS7 DOS7.0 DOS7.1 MSDOS7.0 MSDOS7.1 PCDOS7.0 PCDOS7.1 DOS8 WIN95A WIN95OSR2 WIN98 WINME\n"
+             "VHD footer flags: NOVHD VHD DYNVHD QCOW2\n"
+             "Differencing VHD of a parent VHD created with the same flags: PARENT=<file>\n");
+  exit(is_help ? 0 : 1);
+}
+
+/* Command-line flags which are not stored in struct fat_params. */
+struct image_flags {
+  const char *tree_dir;  /* TREE=. */
+  const char *cache_dir;  /* CACHE=. */
+  const char *parent_fn;  /* PARENT=. */
+  char *prealloc_spec;  /* PREALLOC=. */
+  ub is_edit;  /* EDIT. */
+  ub is_compact;  /* COMPACT. */
+  ub is_defrag;  /* DEFRAG. */
+  ub is_reuse;  /* REUSE. */
+  ub is_thick;  /* THICK. */
+  ub is_stats;  /* STATS. */
+  ub had_create_flag;  /* Any flag other than PREALLOC=, EDIT, COMPACT, DEFRAG, STATS, NOVHD, VHD and HDD image sizes. */
+};
+
+/* Parses the command-line flags in arg ... arge-1 to *fpp and *ifp, which
+ * must be zero-initialized by the caller. Exits on error.
+ */
+static void parse_flags(struct fat_params *fpp, struct image_flags *ifp, const char **arg, const char **arge) {
   const char *flag;
+  const struct fat12_preset *prp;
+  const char **csp;
+  ud u;
+  ub b;
+  ub had_volume_id = 0;
+
+  fpp->default_log2_sectors_per_cluster = fpp->fcp.log2_sectors_per_cluster = (ub)-1;  /* Unspecified. */
+  for (; arg != arge; ++arg) {
+    for (flag = *arg; *flag == '-' || *flag == '/'; ++flag) {}  /* Skip leading - and / characters in flag. */
+    for (prp = fat12_presets; prp != ARRAY_END(fat12_presets); ++prp) {
+      if (strcasecmp(flag, prp->name) == 0) {
+        if (fpp->fat_fstype && fpp->fat_fstype != 12) goto error_conflicting_fat_fstype;
+        if (fpp->log2_size && (fpp->log2_size != -1 || fpp->fcp.sector_count != prp->fcp.sector_count)) { error_conflicting_size:
+          bad_usage0("conflicting image sizes specified");
+        }
+        fpp->log2_size = -1;
+        u = fpp->fcp.rootdir_entry_count;  /* Save. */
+        b = fpp->fcp.log2_sectors_per_cluster;  /* Save. */
+        fpp->fcp = prp->fcp;  /* This is a memcpy(). */
+        fpp->default_fat_count = 2;
+        fpp->default_reserved_sector_count = 1;
+        fpp->default_rootdir_entry_count = fpp->fcp.rootdir_entry_count;
+        fpp->default_log2_sectors_per_cluster = fpp->fcp.log2_sectors_per_cluster;
+        fpp->fcp.rootdir_entry_count = u;  /* Restore. */
+        fpp->fcp.log2_sectors_per_cluster = b;  /* Restore. */
+        fpp->fat_fstype = 12;
+        goto next_flag;
+      }
+    }
+    for (csp = hdd_size_presets_m_21; csp != ARRAY_END(hdd_size_presets_m_21); ++csp) {
+      if (strcasecmp(flag, *csp) == 0) { b = csp - hdd_size_presets_m_21 + 21; set_size: if (fpp->log2_size && (ub)fpp->log2_size != b) goto error_conflicting_size; fpp->log2_size = b; goto next_edit_flag; }
+    }
+    for (csp = hdd_size_presets_g_30; csp != ARRAY_END(hdd_size_presets_g_30); ++csp) {
+      if (strcasecmp(flag, *csp) == 0) { b = csp - hdd_size_presets_g_30 + 30; goto set_size; }
+    }
+    for (csp = hdd_size_presets_t_40; csp != ARRAY_END(hdd_size_presets_t_40); ++csp) {
+      if (strcasecmp(flag, *csp) == 0) { b = csp - hdd_size_presets_t_40 + 40; goto set_size; }
+    }
+    for (csp = sectors_per_cluster_presets_b_9; csp != ARRAY_END(sectors_per_cluster_presets_b_9); ++csp) {
+      if (strcasecmp(flag, *csp) == 0) {
+        b = csp - sectors_per_cluster_presets_b_9 + 9 - 9;
+        if (fpp->fcp.log2_sectors_per_cluster != (ub)-1 && fpp->fcp.log2_sectors_per_cluster != b) { error_conflicting_spc:
+          bad_usage0("conflicting sectors-per-cluster specified");
+        }
+        fpp->fcp.log2_sectors_per_cluster = b;
+        goto next_flag;
+      }
+    }
+    for (csp = sectors_per_cluster_presets_s_9; csp != ARRAY_END(sectors_per_cluster_presets_s_9); ++csp) {
+      if (strcasecmp(flag, *csp) == 0) { if (fpp->fcp.log2_sectors_per_cluster != (ub)-1) goto error_conflicting_spc; fpp->fcp.log2_sectors_per_cluster = csp - sectors_per_cluster_presets_s_9 + 9 - 9; goto next_flag; }
+    }
+    for (csp = sectors_per_cluster_presets_k_10; csp != ARRAY_END(sectors_per_cluster_presets_k_10); ++csp) {
+      if (strcasecmp(flag, *csp) == 0) { if (fpp->fcp.log2_sectors_per_cluster != (ub)-1) goto error_conflicting_spc; fpp->fcp.log2_sectors_per_cluster = csp - sectors_per_cluster_presets_k_10 + 10 - 9; goto next_flag; }
+    }
+    if (strcasecmp(flag, "FAT12") == 0) {
+      if (fpp->fat_fstype && fpp->fat_fstype != 12) { error_conflicting_fat_fstype:
+        bad_usage0("conflicting FAT type flags specified");
+      }
+      fpp->fat_fstype = 12;
+    } else if (strcasecmp(flag, "FAT16") == 0) {
+      if (fpp->fat_fstype && fpp->fat_fstype != 16) goto error_conflicting_fat_fstype;
+      fpp->fat_fstype = 16;
+    } else if (strcasecmp(flag, "FAT32") == 0) {
+      if (fpp->fat_fstype && fpp->fat_fstype != 32) goto error_conflicting_fat_fstype;
+      fpp->fat_fstype = 32;
+    } else if (strncasecmp(flag, "RDEC=", 5) == 0) {
+      if (parse_ud(flag + 5, &u) != PARSEINT_OK) goto error_invalid_integer;
+      if (u - 1U > 0xfff0U - 1U) bad_usage0("root directory entry count must be between 1 and 65520");
+      if (fpp->fcp.rootdir_entry_count && fpp->fcp.rootdir_entry_count != u) {
+        bad_usage0("conflicting root directory entry counts specified");
+      }
+      fpp->fcp.rootdir_entry_count = u;
+    } else if (strncasecmp(flag, "RSC=", 4) == 0) {
+      if (parse_ud(flag + 4, &u) != PARSEINT_OK) goto error_invalid_integer;
+      if (u - 1U > 0xffffU - 1U) bad_usage0("reserved sector count must be between 1 and 65535");
+      if (fpp->reserved_sector_count && fpp->reserved_sector_count != u) {
+        bad_usage0("conflicting reserved sector counts specified");
+      }
+      fpp->reserved_sector_count = u;
+    } else if (strncasecmp(flag, "VID=", 4) == 0) {
+      if (parse_volume_id(flag + 4, &u) != PARSEINT_OK) bad_usage1("invalid FAT volume ID in flag", flag);
+      if (had_volume_id && fpp->volume_id != u) bad_usage0("conflicting FAT volume IDs specified");
+      fpp->volume_id = u;
+      had_volume_id = 1;
+    } else if (strncasecmp(flag, "FC=", 3) == 0) {
+      if (parse_ud(flag + 3, &u) != PARSEINT_OK) { error_invalid_integer:
+        bad_usage1("invalid integer in flag", flag);
+      }
+      if (u - 1U > 2U - 1U) bad_usage0("FAT FAT count must be 1 or 2");
+      if (fpp->fat_count && fpp->fat_count != u) { error_conflicting_fat_count:
+        bad_usage0("conflicting FAT FAT counts specified");
+      }
+      fpp->fat_count = u;
+    } else if (strcasecmp(flag, "1FAT") == 0 || strcasecmp(flag, "1F") == 0) {
+      if (fpp->fat_count && fpp->fat_count != 1) goto error_conflicting_fat_count;
+      fpp->fat_count = 1;
+    } else if (strcasecmp(flag, "2FATS") == 0 ||strcasecmp(flag, "2F") == 0) {
+      if (fpp->fat_count && fpp->fat_count != 2) goto error_conflicting_fat_count;
+      fpp->fat_count = 2;
+    } else if (strncasecmp(flag, "SYS=", 4) == 0) {
+      add_sys_files((char*)flag + 4);
+    } else if (strncasecmp(flag, "PREALLOC=", 9) == 0) {
+      if (ifp->prealloc_spec && strcmp(ifp->prealloc_spec, flag + 9) != 0) bad_usage0("conflicting preallocated files specified");
+      ifp->prealloc_spec = (char*)flag + 9;
+      continue;  /* Skip had_create_flag, because PREALLOC= is also valid with EDIT. */
+    } else if (strcasecmp(flag, "EDIT") == 0) {
+      ifp->is_edit = 1;
+      continue;  /* Skip had_create_flag. */
+    } else if (strcasecmp(flag, "COMPACT") == 0) {
+      ifp->is_compact = 1;
+      continue;  /* Skip had_create_flag, because COMPACT is valid only with EDIT. */
+    } else if (strcasecmp(flag, "DEFRAG") == 0) {
+      ifp->is_defrag = 1;
+      continue;  /* Skip had_create_flag, because DEFRAG is valid only with EDIT. */
+    } else if (strcasecmp(flag, "STATS") == 0) {
+      ifp->is_stats = 1;
+      continue;  /* Skip had_create_flag, because STATS is also valid with EDIT. */
+    } else if (strcasecmp(flag, "REUSE") == 0) {
+      ifp->is_reuse = 1;
+    } else if (strcasecmp(flag, "THICK") == 0) {
+      ifp->is_thick = 1;
+    } else if (strncasecmp(flag, "TREE=", 5) == 0) {
+      if (ifp->tree_dir && strcmp(ifp->tree_dir, flag + 5) != 0) bad_usage0("conflicting host directory trees specified");
+      ifp->tree_dir = flag + 5;
+    } else if (strncasecmp(flag, "CACHE=", 6) == 0) {
+      if (ifp->cache_dir && strcmp(ifp->cache_dir, flag + 6) != 0) bad_usage0("conflicting template cache directories specified");
+      ifp->cache_dir = flag + 6;
+    } else if (strcasecmp(flag, "NOVHD") == 0) {
+      if (fpp->vhd_mode && fpp->vhd_mode != VHD_NOVHD) { error_conflicting_vhd_mode:
+        bad_usage0("conflicting VHD values specified");
+      }
+      fpp->vhd_mode = VHD_NOVHD;
+      continue;  /* Skip had_create_flag, because NOVHD is also valid with EDIT, for conversion. */
+    } else if (strcasecmp(flag, "VHD") == 0) {
+      if (fpp->vhd_mode && fpp->vhd_mode != VHD_FIXED) goto error_conflicting_vhd_mode;
+      fpp->vhd_mode = VHD_FIXED;
+      continue;  /* Skip had_create_flag, because VHD is also valid with EDIT, for conversion. */
+    } else if (strcasecmp(flag, "QCOW2") == 0) {
+      if (fpp->vhd_mode && fpp->vhd_mode != VHD_QCOW2) goto error_conflicting_vhd_mode;
+      fpp->vhd_mode = VHD_QCOW2;
+    } else if (strcasecmp(flag, "DYNVHD") == 0 || strcasecmp(flag, "SPARSEVHD") == 0) {
+      if (fpp->vhd_mode && fpp->vhd_mode != VHD_DYNAMIC) goto error_conflicting_vhd_mode;
+      fpp->vhd_mode = VHD_DYNAMIC;
+    } else if (strncasecmp(flag, "PARENT=", 7) == 0) {
+      if (fpp->vhd_mode && fpp->vhd_mode != VHD_DIFFERENCING) goto error_conflicting_vhd_mode;
+      if (ifp->parent_fn && strcmp(ifp->parent_fn, flag + 7) != 0) bad_usage0("conflicting parent images specified");
+      if (flag[7] == '\0' || strlen(flag + 7) > 255U) bad_usage0("bad parent image filename");  /* It must fit to the 0x200-byte parent locator in UTF-16. */
+      fpp->vhd_mode = VHD_DIFFERENCING;
+      ifp->parent_fn = flag + 7;
+    } else if (strcasecmp(flag, "DOS3") == 0 || strcasecmp(flag, "DOS3.3") == 0) {
+      fpp->os_compat |= OSC_DOS3;
+    } else if (strcasecmp(flag, "DOS4") == 0) {
+      fpp->os_compat |= OSC_DOS4;
+    } else if (strcasecmp(flag, "DOS5") == 0 || strcasecmp(flag, "DOS6") == 0) {
+      fpp->os_compat |= OSC_DOS5_6;
+    } else if (strcasecmp(flag, "DOS7") == 0) {
+      fpp->os_compat |= OSC_MSDOS70 | OSC_MSDOS71_8 | OSC_PCDOS70 | OSC_PCDOS71;
+    } else if (strcasecmp(flag, "DOS7.0") == 0) {
+      fpp->os_compat |= OSC_MSDOS70 | OSC_PCDOS70;
+    } else if (strcasecmp(flag, "DOS7.1") == 0) {
+      fpp->os_compat |= OSC_MSDOS71_8 | OSC_PCDOS71;
+    } else if (strcasecmp(flag, "PCDOS7.0") == 0) {
+      fpp->os_compat |= OSC_PCDOS70;
+    } else if (strcasecmp(flag, "PCDOS7.1") == 0) {
+      fpp->os_compat |= OSC_PCDOS71;
+    } else if (strcasecmp(flag, "MSDOS7.0") == 0 || strcasecmp(flag, "WIN95A") == 0 || strcasecmp(flag, "WIN95RTM") == 0) {
+      fpp->os_compat |= OSC_MSDOS70;
+    } else if (strcasecmp(flag, "MSDOS7.1") == 0 || strcasecmp(flag, "DOS8") == 0 || strcasecmp(flag, "WIN95OSR2") == 0 || strcasecmp(flag, "WIN98") == 0 || strcasecmp(flag, "WINME") == 0) {
+      fpp->os_compat |= OSC_MSDOS71_8;
+    } else {
+      msg_printf("fatal: unknown command-line flag: %s\n", flag);
+      exit(1);
+    }
+   next_flag:
+    ifp->had_create_flag = 1;
+   next_edit_flag: ;  /* Skip had_create_flag, because a HDD image size is also valid with EDIT, for resizing. */
+  }
+  if (!had_volume_id) fpp->volume_id = 0x1234abcd;
+}
+
+/* Fills the defaults for the unspecified values in *fpp (as returned by
+ * parse_flags(...)), checks OS compatibility, and calculates the geometry and
+ * the filesystem parameters. It uses only *fpp, so it is reentrant. Exits
+ * on error.
+ */
+static void solve_fat_geometry(struct fat_params *fpp) {
+  const signed char log2_size = fpp->log2_size;
+  int min_log2_spc, max_log2_spc;
+  uw old_sectors_per_fat;
+  ud fat_clusters_sec_ofs;
+  ud hi, lo, mid;
+  ud u;
+
+  if (!fpp->fat_fstype) {  /* Autodetect. */
+    fpp->fat_fstype = log2_size < 0 ? 12 : log2_size <= 31 ? 16 : 32;  /* Use FAT16 for up to 2 GiB, use FAT32 for anything larger. FAT16 doesn't support more than 2 GiB. */
+  }
+  if (!fpp->fat_count) {  /* Autodetect. */
+    if ((fpp->fat_count = fpp->default_fat_count) == 0) {
+      fpp->fat_count = fpp->fat_fstype == 32 ? 1 : 2;  /* 2 for compatibility with MS-DOS <=6.22. */
+    }
+  }
+  if (!fpp->vhd_mode) fpp->vhd_mode = (log2_size < 0) ? VHD_NOVHD : VHD_FIXED;  /* Autodetect. */
+  if (!fpp->reserved_sector_count) {  /* Autodetect. */
+    if ((fpp->reserved_sector_count = fpp->default_reserved_sector_count) == 0) {
+      fpp->reserved_sector_count = fpp->fat_fstype == 32 ? 17 : 1;  /* 17 for compatibility with the Windows XP FAT32 boot sector code (written during Windows XP installation), which loads additional boot code from sector 8. */
+    }
+  }
+  if (!fpp->fcp.rootdir_entry_count) {
+    if ((fpp->fcp.rootdir_entry_count = fpp->default_rootdir_entry_count) == 0) {  /* Autodetect. */
+      fpp->fcp.rootdir_entry_count = 128;  /* !! Maybe 256? Look at alignment. */
+      if (fpp->os_compat & OSC_DOS3) fpp->fcp.rootdir_entry_count = 512;  /* For compatibility with DOS 3.30. It can read and write a filesystem with another value, but it can't boot from it. */
+    }
+  }
+  fpp->fcp.rootdir_entry_count = (fpp->fcp.rootdir_entry_count + 0xf) & ~0xf;  /* Round up to a multiple of 16. */
+  if (fpp->fat_fstype == 32) fpp->fcp.rootdir_entry_count = 0;
+  if (fpp->fcp.log2_sectors_per_cluster == (ub)-1) fpp->fcp.log2_sectors_per_cluster = fpp->default_log2_sectors_per_cluster;  /* Can still be (ub)-1 (unspecified) for non-floppy. */
+  if (fpp->os_compat & (OSC_DOS3 | OSC_DOS4 | OSC_DOS5_6 | OSC_MSDOS70 | OSC_PCDOS70)) {
+    if (fpp->fat_count != 2) bad_usage0("OS compatibility requires 2FATS");
+  }
+  if (fpp->os_compat & (OSC_DOS3 | OSC_DOS4)) {
+    if (fpp->reserved_sector_count != 1) bad_usage0("OS compatibility requires RSC=1");
+  }
+  if (fpp->os_compat & (OSC_DOS3 | OSC_DOS4 | OSC_DOS5_6 | OSC_MSDOS70 | OSC_PCDOS70 | OSC_PCDOS71)) {
+    if (fpp->fcp.log2_sectors_per_cluster > 0U && (fpp->fcp.sector_count == (160U << 1) || fpp->fcp.sector_count == (180U << 1) || (fpp->fcp.sector_count == (1440U << 1) && (fpp->os_compat & (OSC_DOS3 | OSC_DOS4))))) bad_usage0("OS compatibility requires cluster size 512B for this floppy size");
+    if (fpp->fcp.log2_sectors_per_cluster > 1U && (fpp->os_compat & OSC_DOS3)) bad_usage0("OS compatibility requires floppy cluster size 512B or 1K");
+    if (fpp->fcp.log2_sectors_per_cluster > 5U && (fpp->os_compat & (OSC_DOS4 | OSC_DOS5_6 | OSC_PCDOS70 | OSC_PCDOS71))) bad_usage0("OS compatibility requires floppy cluster size at most 16K");
+  }
+  if (log2_size < 0) {  /* Floppy FAT12. */
+    if (fpp->fat_fstype != 12) bad_usage0("only FAT12 is supported for floppy");  /* Because boot code is not implemented. */
+    if (fpp->os_compat & (OSC_DOS3 | OSC_DOS4)) {
+      if (fpp->fcp.sector_count == (2880U << 1)) bad_usage0("OS compatibility conflicts with 2880K; use e.g. 1440K instead");
+    }
+    if (fpp->fcp.rootdir_entry_count != fpp->default_rootdir_entry_count ||
+        fpp->fcp.log2_sectors_per_cluster != fpp->default_log2_sectors_per_cluster ||
+        fpp->reserved_sector_count != fpp->default_reserved_sector_count ||
+        fpp->fat_count != fpp->default_fat_count ||
+        0) { /* Recalculate (fpp->fcp.cluster_count, fpp->fcp.sectors_per_fat). */
+#    if DEBUG
+      if (!fpp->fcp.sector_count) fatal0("ASSERT_SECTORS");
+#    endif
+      fpp->fcp.sectors_per_fat = 0;
+      do {
+        old_sectors_per_fat = fpp->fcp.sectors_per_fat;
+        u = fpp->hidden_sector_count + fpp->reserved_sector_count + ((ud)fpp->fcp.sectors_per_fat << (fpp->fat_count - 1U)) + (fpp->fcp.rootdir_entry_count >> 4);
+        if (fpp->fcp.sector_count <= u) goto fatal_no_clusters;
+        fpp->fcp.cluster_count = (fpp->fcp.sector_count - u) >> fpp->fcp.log2_sectors_per_cluster;
+        if (fpp->fcp.cluster_count == 0) goto fatal_no_clusters;
+        if ((sd)fpp->fcp.cluster_count <= 0) bad_usage0("FAT12 filesystem too small, no space for clusters");
+        fpp->fcp.sectors_per_fat = ((((fpp->fcp.cluster_count + 2) * 3 + 1) >> 1) + 0x1ff) >> 9;  /* FAT12. */
+      } while (fpp->fcp.sectors_per_fat != old_sectors_per_fat);  /* Repeat until a fixed point is found for (fpp->fcp.cluster_count, fpp->fcp.sectors_per_fat). */
+      if (fpp->fcp.cluster_count > 0xff4) bad_usage0("floppy FAT12 cluster size too small to this floppy size, specify at least 1K");  /* This happens with: 2880K 512B */
+    }
+    fpp->geometry_sector_count = fpp->fcp.sector_count;
+#    ifdef DEBUG
+      fpp->cylinder_count = fpp->geometry_sector_count / ((ud)fpp->fcp.head_count * fpp->fcp.sectors_per_track);
+#    endif
+  } else {
+    fpp->hidden_sector_count = 63U;  /* Partition 1 starts here, after the MBR and the rest of cylinder 0, head 0. Must be a multiple of sectors_per_track for MS-DOS <=6.x */
+    fpp->fcp.media_descriptor = 0xf8;  /* 0xf8 for HDD. 0xf8 is also used by some nonstandard floppy disk formats. */
+    if (!log2_size) bad_usage0("image size not specified");
+#    ifdef DEBUG
+      if (log2_size < 21) fatal0("ASSERT_IMAGE_TOO_SMALL");
+      if (log2_size > 43) fatal0("ASSERT_IMAGE_TOO_LARGE");
+#    endif
+    if (fpp->fat_fstype == 12) {
+      bad_usage0("FAT12 is not supported for hard disk");  /* Because boot code is not implemented. */
+    } else if (fpp->fat_fstype == 16) {
+      /* No need to check `if (log2_size < 12 + 9) bad_usage0("FAT16 too small");', because we we have log_size >= 21 (2M) here, we don't support smaller values. */
+      if (log2_size > 16 + 15) bad_usage0("FAT16 too large, maximum is FAT16 2G");
+    } else /* if (fpp->fat_fstype == 32) */ {
+      if (log2_size < 16 + 9) bad_usage0("FAT32 too small, minimum is FAT32 32M");
+      /* No need to check `if (log2_size > 28 + 15) bad_usage0("FAT32 too large");', because we we have log_size <= 41 (2T) <= 43 here, we don't support larger values. */
+    }
+    /* Cluster count limits:
+     * For FAT16: 12 <= log2_size - (log2_spc + 9) <= 16.  log2_size - 25 <= log2_spc <= log2_size - 21.
+     * For FAT32: 16 <= log2_size - (log2_spc + 9) <= 28.  log2_size - 37 <= log2_spc <= log2_size - 25.
+     */
+    if (fpp->fcp.log2_sectors_per_cluster == (ub)-1) {
+      if (fpp->fat_fstype == 16) {
+        min_log2_spc = ((fpp->os_compat & OSC_DOS3) && log2_size >= 23) ? 2 : (int)log2_size - 25;  /* DOS 3.30 requires cluster size 2K on HDD. */
+        fpp->fcp.log2_sectors_per_cluster = min_log2_spc >= 0 ? min_log2_spc : 0;
+      } else {
+        min_log2_spc = (int)log2_size - 37;
+        /* Use 4K clusters if possible. */
+        fpp->fcp.log2_sectors_per_cluster = log2_size == 26 ? 1 : log2_size == 27 ? 2 : log2_size - 28U <= 40U - 28U ? 3 : min_log2_spc >= 0 ? min_log2_spc : 0;
+      }
+    } else {
+      min_log2_spc = log2_size - (fpp->fat_fstype == 16 ? 16U + 9U : 28U + 9U);
+      max_log2_spc = log2_size - (fpp->fat_fstype == 16 ? 12U + 9U : 16U + 9U);
+      if (max_log2_spc < (int)fpp->fcp.log2_sectors_per_cluster) bad_usage0("sectors-per-cluster too large for this image size");
+      if (min_log2_spc > (int)fpp->fcp.log2_sectors_per_cluster) bad_usage0("sectors-per-cluster too small for this image size");
+    }
+    if (fpp->os_compat & (OSC_DOS3 | OSC_DOS4 | OSC_DOS5_6 | OSC_MSDOS70 | OSC_PCDOS70)) {
+      if (fpp->fat_fstype != 16) bad_usage0("OS compatibility requires FAT16 on HDD");
+    }
+    if (fpp->os_compat & OSC_DOS3) {
+      if (log2_size - 24U > 25U - 24U) bad_usage0("OS compatibility requires 16M or 32M");
+      if (fpp->fcp.log2_sectors_per_cluster != 2) bad_usage0("OS compatibility requires cluster size 2K");
+      if (fpp->fcp.rootdir_entry_count != 512) bad_usage0("OS compatiiblity requires RDEC=512 for booting");
+    }
+    fpp->fcp.cluster_count = ((ud)1 << (log2_size - (fpp->fcp.log2_sectors_per_cluster + 9U))) - 2;  /* -2 is for the 2 special cluster entries at the beginning of the FAT table. */
+    /* fpp->fcp.cluster_count = (fpp->fat_fstype == 16 ? auto_fat16_cluster_counts_12 - 12 : auto_fat32_cluster_counts_16 - 16)[log2_size - (fpp->fcp.log2_sectors_per_cluster + 9U)]; */
+    /* FAT filesystem cluster limits based on:
+     *
+     * [MS-EFI-FAT32]: https://github.com/LeeKyuHyuk/fat16/raw/refs/heads/master/documentation/fatgen103.pdf
+     * [FAT32-Win2000]: https://web.archive.org/web/20150511155943/https://support.microsoft.com/en-us/kb/184006/en-us
+     * [FAT32-WinXP]: https://web.archive.org/web/20150513003749/https://support.microsoft.com/en-us/kb/314463
+     * [MSDOS-Win95]: https://web.archive.org/web/20150612114245/https://support.microsoft.com/en-us/kb/67321
+     * [WinNT4]: experimentation by the Mtools team with Windows NT 4.0: https://github.com/Distrotech/mtools/blob/13058eb225d3e804c8c29a9930df0e414e75b18f/mformat.c#L222
+     * [Mtools]: https://github.com/Distrotech/mtools/blob/13058eb225d3e804c8c29a9930df0e414e75b18f/mformat.c#L222 and https://github.com/Distrotech/mtools/blob/13058eb225d3e804c8c29a9930df0e414e75b18f/msdos.h#L215-L225
+     * [Linux3.13]: https://github.com/torvalds/linux/blob/d8ec26d7f8287f5788a494f56e8814210f0e64be/include/uapi/linux/msdos_fs.h#L65-L67
+     * [Linux6.13]: https://github.com/torvalds/linux/blob/ffd294d346d185b70e28b1a28abe367bbfe53c04/include/uapi/linux/msdos_fs.h#L65-L67
+     *
+     * The documented cluster limits:
+     *
+     * * FAT12: at most 0xff4 clusters [MS-EFI-FAT32] [Linux3.13] [Linux6.13] [Mtools], at most 0xff6 clusters [MSDOS-Win95] [WinNT4]
+     * * FAT16: at least 0xff5 clusters [MS-EFI-FAT32] [Linux3.13] [Linux6.13] [Mtools], at least 0xff7 clusters [MSDOS-Win95] [WinNT4], at most 0xfff4 clusters [MS-EFI-FAT32] [Linux3.13] [Linux6.13] [Mtools]
+     * * FAT32: at least 0xfff5 clusters [MS-EFI-FAT32] [Linux3.13] [Linux6.13] [Mtools], at most 0xffffff5 clusters [FAT32-Win2000] [FAT32-WinXP], at most 0xffffff6 clusters [Linux3.13] [Linux6.13]
+     *
+     * So our conservative limits become:
+     *
+     * * FAT12: at least 1 cluster, at most 0xff4 clusters
+     * * FAT16: at least 0xff7 clusters, at most 0xfff4 clusters
+     * * FAT32: at least 0xfff5 clusters, at most 0xffffff5 clusters; but we want to fit the entire partition in <2TiB, so we will allow less
+     */
+    if (fpp->fat_fstype == 16) {
+      if (fpp->fcp.cluster_count == 0xfffeU) fpp->fcp.cluster_count -= 10U;  /* Maximum 0xfff4 clusters on a FAT16 filesystem. */
+    } else if (fpp->fat_fstype == 32) {
+      if (log2_size == 41) {  /* Avoid overflows below, make sure that fpp->geometry_sector_count fits to ud (32-bit unsigned). */
+        fpp->fcp.sector_count = (IS_VHD(fpp->vhd_mode) ? VHD_MAX_SECTORS : (ud)0xffffffffU) / (255U * 63U) * (255U * 63U);  /* An upper limit. */
+       limit_fat32_by_sector_count:
+        if (fpp->fcp.sector_count <= fpp->hidden_sector_count + fpp->reserved_sector_count) goto fatal_no_clusters;
+        /* !! TODO(pts): Make hi lower by doing this without ud overflow: (...) * 512U / ((1U << fpp->fcp.log2_sectors_per_cluster) + (2U << fpp->fat_count)). */
+        hi = (fpp->fcp.sector_count - fpp->hidden_sector_count - fpp->reserved_sector_count) >> fpp->fcp.log2_sectors_per_cluster;  /* An upper limit on fpp->fcp.cluster_count. */
+        lo = hi - ((hi + (2U + 0x7fU)) >> 7U << (fpp->fat_count - 1U));  /* A lower limit on fpp->fcp.cluster_count. */
+        while (lo < hi) {  /* Binary search. About 21 iterations. */
+          mid = lo + ((hi - lo) >> 1U);
+          if (is_aligned_fat32_sector_count_at_most(fpp, mid + 1U)) {
+            lo = mid + 1U;
+          } else {
+            hi = mid;
+          }
+        }
+        if ((fpp->fcp.cluster_count = lo) == 0) { fatal_no_clusters:
+          /* This can happen e.g. if a very large fpp->fcp.rootdir_entry_count or fpp->reserved_sector_count was specified, such as `160K RSC=314'. */
+          fatal0("FAT filesystem too small, no space for even a single cluster");
+        }
+      } else if (fpp->fcp.cluster_count == (ud)0xffffffeU) {
+        fpp->fcp.cluster_count -= 9U;  /* Maximum 0xffffff5 clusters on a FAT32 filesystem. */
+      } else if (log2_size == 37 && IS_VHD(fpp->vhd_mode)) {
+        /* Limit to ~127.498 GiB instead of 128 GiB, for better VHD
+         * compatibility of the virtual IDE controller in Virtual PC.
+         *
+         * The ~127.498 GiB limit probably still applied to the virtual IDE
+         * controller in Virtual PC 2007 (no definitive evidence on the
+         * web). Hyper-V (introduced in 2008) has increased the limit to
+         * 2040 GiB.
+         */
+        fpp->fcp.sector_count = (ud)65535U * 16U * 255U / (255U * 63U) * (255U * 63U);
+        goto limit_fat32_by_sector_count;
+      }
+    }
+    /*if (fpp->fat_fstype == 32 && log2_size == 41) fpp->fcp.cluster_count -= 0x1fff5 + (0x7ebbc5>>6) - 0x1f73e;*/
+    fpp->fcp.sectors_per_fat = fpp->fat_fstype == 32 ? (fpp->fcp.cluster_count + (2U + 0x7fU)) >> 7U : /* fat16: */ (fpp->fcp.cluster_count + (2U + 0xffU)) >> 8U;
+    fat_clusters_sec_ofs = fpp->hidden_sector_count + fpp->reserved_sector_count + ((ud)fpp->fcp.sectors_per_fat << (fpp->fat_count - 1U)) + (fpp->fcp.rootdir_entry_count >> 4U);
+    fat_clusters_sec_ofs += align_fat(fpp, fat_clusters_sec_ofs);
+   recalc_sector_count:
+    fpp->fcp.sector_count = fat_clusters_sec_ofs + (fpp->fcp.cluster_count << fpp->fcp.log2_sectors_per_cluster);
+    if (fpp->fat_fstype == 16 && log2_size == 25 && fpp->fcp.log2_sectors_per_cluster == 2 && fpp->fcp.sector_count >> 16) {  /* Use at most 0xffff sectors, for compatibility with DOS 3.30. 4.01 supports much more, reaching 2 GiB FAT16. */
+      fpp->fcp.cluster_count -= (fpp->fcp.sector_count - 0xffffU - 1U + ((ud)1 << 2U)) >> 2U;
+      goto recalc_sector_count;
+    }
+#    if DEBUG
+      if (fpp->fcp.cluster_count > ((ud)0xffffffffU >> fpp->fcp.log2_sectors_per_cluster) ||
+          fpp->fcp.sector_count <= fat_clusters_sec_ofs ||
+          (fpp->fcp.cluster_count << fpp->fcp.log2_sectors_per_cluster) > fpp->fcp.sector_count - fat_clusters_sec_ofs
+         ) fatal0("ASSERT_SECTOR_COUNT_OVERFLOW");
+#    endif
+    adjust_hdd_geometry(fpp, fat_clusters_sec_ofs);
+  }
+#  if DEBUG
+    msg_printf("info: cluster_count=0x%lx sector_count=%lu=0x%lx geometry_sector_count=%lu=0x%lx CHS=%lu:%u:%u\n", (unsigned long)fpp->fcp.cluster_count, (unsigned long)fpp->fcp.sector_count, (unsigned long)fpp->fcp.sector_count, (unsigned long)fpp->geometry_sector_count, (unsigned long)fpp->geometry_sector_count, (unsigned long)fpp->cylinder_count, (unsigned)fpp->fcp.head_count, (unsigned)fpp->fcp.sectors_per_track);
+#  endif
+}
+
+static ud get_old_fat_entry(ud cluster) {
+  const char *p;
+  if (ctx->rsz_fat_fstype == 12) {
+    p = ctx->rsz_fat + cluster + (cluster >> 1);
+    return (cluster & 1) ? ((ub)p[0] >> 4) | (ud)(ub)p[1] << 4 : (ub)p[0] | ((ud)(ub)p[1] & 0xfU) << 8;
+  }
+  return ctx->rsz_fat_fstype == 32 ? gd(ctx->rsz_fat + (cluster << 2)) & 0x0fffffffU : gw(ctx->rsz_fat + (cluster << 1));
+}
+
+/* Returns the new value of FAT entry (or start cluster) v. */
+static ud map_resized_cluster(ud v) {
+  if (v < 2U || v >= ctx->rsz_old_cluster_count + 2U) return v;  /* Free, end-of-chain or bad. */
+  return ctx->rsz_map[v - 2U] ? ctx->rsz_map[v - 2U] : ctx->rsz_fat_fstype == 32 ? 0x0ffffff8U : 0xfff8U;  /* Pointing to a free cluster: end the chain there. */
+}
+
+/* Changes the start cluster of each directory entry in the directory sector
+ * buf. Adds the old start clusters of the subdirectories to subdirs.
+ * Returns the number of subdirectories added.
+ */
+static unsigned remap_dir_sector(char *buf, ud *subdirs) {
+  char *p;
+  ud cluster;
+  unsigned n = 0;
+  for (p = buf; p != buf + 0x200 && *p != '\0'; p += 0x20) {
+    if (*p == (char)0xe5 || (p[0xb] & FATTR_VOLUME_LABEL)) continue;  /* Deleted entry, volume label or long filename (LFN) entry. */
+    if ((cluster = gw(p + 0x1a) | (ctx->rsz_fat_fstype == 32 ? (ud)gw(p + 0x14) << 16 : 0U)) == 0) continue;
+    if ((p[0xb] & FATTR_DIRECTORY) && *p != '.') subdirs[n++] = cluster;
+    cluster = map_resized_cluster(cluster);
+    ctx->s = p + 0x14; dw(ctx->rsz_fat_fstype == 32 ? cluster >> 16 : gw(p + 0x14));
+    ctx->s = p + 0x1a; dw(cluster);
+  }
+  return n;
+}
+
+/* Changes the start clusters in the directory starting at old cluster
+ * cluster, and in its subdirectories, recursively.
+ */
+static void resize_dir(ud cluster, unsigned depth) {
+  char buf[0x200];
+  ud subdirs[0x10], sec, count = 0;
+  unsigned i, n;
+  if (depth > 64U) fatal0("directory tree too deep, or it has a loop");
+  for (; cluster - 2U < ctx->rsz_old_cluster_count; cluster = get_old_fat_entry(cluster)) {
+    if (++count > ctx->rsz_old_cluster_count) fatal0("loop in directory cluster chain");
+    sec = ctx->rsz_clusters_sec_ofs + ((map_resized_cluster(cluster) - 2U) << ctx->rsz_log2_spc);
+    for (i = 0; i < 1U << ctx->rsz_log2_spc; ++i, ++sec) {
+      read_sector(sec, buf);
+      n = remap_dir_sector(buf, subdirs);
+      memcpy(ctx->sbuf, buf, 0x200);
+      write_sector(sec);
+      while (n) resize_dir(subdirs[--n], depth + 1U);
+    }
+  }
+}
+
+/* Reads size bytes starting at sector sec of the image file to buf. */
+static void read_image_bytes(ud sec, char *buf, ud size) {
+  uint64_t ofs = (uint64_t)sec << 9;
+  unsigned want;
+  flush_sectors();
+  if ((uint64_t)bakefat_lseek64(ctx->sfd, ofs, SEEK_SET) != ofs) goto error_reading;
+  for (; size; size -= want, buf += want) {
+    want = size > 0x4000U ? 0x4000U : (unsigned)size;
+    if ((size_t)read(ctx->sfd, buf, want) != want) { error_reading:
+      msg_printf("fatal: error reading sector 0x%x of image file: %s\n", (unsigned)sec, ctx->sfn);
+      exit(2);
+    }
+  }
+}
+
+/* Reads or writes the data of the cluster starting at sector sec of the
+ * image file (from or to buf). When writing a cluster of NUL bytes, it
+ * punches a hole instead, keeping the image sparse.
+ */
+static void rw_image_cluster(ud sec, ud *buf, ub is_write) {
+  const unsigned size = 0x200U << ctx->rsz_log2_spc;
+  const uint64_t ofs = (uint64_t)sec << 9;
+  const ud *p;
+  if (is_write) {
+    for (p = buf; p != buf + (size >> 2) && *p == 0; ++p) {}
+    if (p == buf + (size >> 2)) {
+      zero_sectors(sec, (ud)1 << ctx->rsz_log2_spc);
+    } else {
+      write_output_raw(ofs, buf, size);
+    }
+  } else if ((uint64_t)bakefat_lseek64(ctx->sfd, ofs, SEEK_SET) != ofs || (size_t)read(ctx->sfd, buf, size) != size) {
+    msg_printf("fatal: error reading cluster from image file: %s\n", ctx->sfn);
+    exit(2);
+  }
+}
+
+/* Returns 1 iff the old cluster chain starting at cluster contains an old
+ * cluster before end which doesn't have a new cluster yet.
+ */
+static ub has_unplanned_cluster_before(ud cluster, ud end) {
+  ud count = 0;
+  for (; cluster - 2U < ctx->rsz_old_cluster_count && count++ <= ctx->rsz_old_cluster_count; cluster = get_old_fat_entry(cluster)) {
+    if (cluster < end && !ctx->rsz_map[cluster - 2U]) return 1;
+  }
+  return 0;
+}
+
+/* Assigns consecutive new clusters starting at *next_ptr to the old cluster
+ * chain starting at cluster, in chain order, until the end of the chain or
+ * an old cluster which already has a new cluster (cross-link or loop).
+ */
+static void plan_resized_chain(ud cluster, ud *next_ptr) {
+  for (; cluster - 2U < ctx->rsz_old_cluster_count && !ctx->rsz_map[cluster - 2U]; cluster = get_old_fat_entry(cluster)) {
+    ctx->rsz_map[cluster - 2U] = (*next_ptr)++;
+  }
+}
+
+#define RSZ_MAX_SYSTEM_FILE_COUNT 0x10U
+
+/* Adds the start clusters of the system files (such as IO.SYS) in the root
+ * directory sector buf to sys_clusters, in ascending order. Returns 0 at
+ * the end of the directory.
+ */
+static ub add_resized_system_files(const char *buf, ud *sys_clusters, unsigned *count_ptr) {
+  const char *p;
+  ud cluster;
+  unsigned i;
+  for (p = buf; p != buf + 0x200; p += 0x20) {
+    if (*p == '\0') return 0;  /* No more entries. */
+    if (*p == (char)0xe5 || (p[0xb] & (FATTR_SYSTEM | FATTR_DIRECTORY | FATTR_VOLUME_LABEL)) != FATTR_SYSTEM) continue;  /* Not a system file (long filename (LFN) entries also have FATTR_VOLUME_LABEL). */
+    cluster = gw(p + 0x1a) | (ctx->rsz_fat_fstype == 32 ? (ud)gw(p + 0x14) << 16 : 0U);
+    if (cluster - 2U >= ctx->rsz_old_cluster_count || *count_ptr == RSZ_MAX_SYSTEM_FILE_COUNT) continue;
+    for (i = (*count_ptr)++; i && sys_clusters[i - 1] > cluster; --i) {
+      sys_clusters[i] = sys_clusters[i - 1];
+    }
+    sys_clusters[i] = cluster;
+  }
+  return 1;
+}
+
+/* Grows the FAT16 or FAT32 filesystem in the image file created by bakefat
+ * (with an MBR) to log2_size, without copying the data: it extends the
+ * file, recomputes the geometry (as solve_fat_geometry(...) does for a new
+ * image with the same filesystem parameters), and grows the FATs in place.
+ * The start of the cluster area moves by a multiple of the cluster size,
+ * so all clusters get renumbered, but their data stays in place, except
+ * for the cluster chains (files and directories) now in the way of the
+ * FATs. Each of them is relocated as a whole, contiguously, to the new
+ * space. The system files in the way (such as IO.SYS, which DOS <5.00
+ * needs at the earliest cluster) are relocated to the start of the new
+ * cluster area instead, evicting the chains there. All planning is done
+ * before the first write. Then it rewrites the FATs and the start clusters
+ * in the directory entries, and updates the boot sector (BPB), the MBR
+ * (with the partition entry) and the FSInfo sector.
+ */
+static void resize_fat_image(signed char log2_size) {
+  struct fat_params fp;
+  struct fat_image fi;
+  struct fat_extent free_extent;
+  char boot[0x200], buf[0x200], *rootdir = NULL, *p, *preds;
+  ud old_fat_sec_ofs, old_clusters_sec_ofs, old_sector_count, fat_bytes, clusters_sec_ofs, reloc_base, reloc_count, front_count, evict_end, bad_value, next, c, t, v, sec, i, used_count, subdirs[0x10], sys_clusters[RSZ_MAX_SYSTEM_FILE_COUNT], *srcs, *cbuf, *front_buf = NULL;
+  unsigned n, sys_count = 0;
+  ub was_vhd, is_nonzero, fi_idx;
+  was_vhd = convert_vhd_image(0);
+  open_fat_image(&fi);  /* Leaves the FAT boot sector in sbuf. */
+  memcpy(boot, ctx->sbuf, 0x200);
+  old_fat_sec_ofs = fi.fat_sec_ofs;
+  if (fi.fat_fstype == 12 || old_fat_sec_ofs - gw(boot + 0xe) != 63U) {
+    msg_printf("fatal: only FAT16 and FAT32 hard disk images created by bakefat can be resized: %s\n", ctx->sfn);
+    exit(2);
+  }
+  old_clusters_sec_ofs = fi.clusters_sec_ofs;
+  old_sector_count = 63U + (gw(boot + 0x13) ? gw(boot + 0x13) : gd(boot + 0x20));
+  memset(&fp, '\0', sizeof(fp));
+  fp.log2_size = log2_size;
+  fp.fat_fstype = fi.fat_fstype;
+  fp.fat_count = fi.fat_count;
+  fp.fcp.log2_sectors_per_cluster = fi.log2_sectors_per_cluster;
+  fp.fcp.rootdir_entry_count = fi.rootdir_entry_count;
+  fp.reserved_sector_count = gw(boot + 0xe);
+  fp.volume_id = gd(boot + (fi.fat_fstype == 32 ? 0x43 : 0x27));
+  fp.vhd_mode = was_vhd ? VHD_FIXED : VHD_NOVHD;
+  solve_fat_geometry(&fp);
+  /* Move the start of the cluster area (forward) by a multiple of the cluster size, by adding reserved sectors. */
+  clusters_sec_ofs = fp.hidden_sector_count + fp.reserved_sector_count + ((ud)fp.fcp.sectors_per_fat << (fp.fat_count - 1U)) + (fp.fcp.rootdir_entry_count >> 4);
+  v = clusters_sec_ofs < old_clusters_sec_ofs ? old_clusters_sec_ofs - clusters_sec_ofs : 0U;
+  v += -(clusters_sec_ofs + v - old_clusters_sec_ofs) & (((ud)1 << fi.log2_sectors_per_cluster) - 1U);
+  fp.reserved_sector_count += v;
+  clusters_sec_ofs += v;
+  if ((c = (fp.fcp.sector_count - clusters_sec_ofs) >> fi.log2_sectors_per_cluster) < fp.fcp.cluster_count) fp.fcp.cluster_count = c;
+  ctx->rsz_fat_fstype = fi.fat_fstype;
+  ctx->rsz_log2_spc = fi.log2_sectors_per_cluster;
+  ctx->rsz_old_cluster_count = fi.cluster_count;
+  ctx->rsz_shift = (clusters_sec_ofs - old_clusters_sec_ofs) >> fi.log2_sectors_per_cluster;
+  ctx->rsz_clusters_sec_ofs = clusters_sec_ofs;
+#  ifdef DEBUG
+    msg_printf("info: resize: FAT%u cluster_count=0x%lx-->0x%lx sectors_per_fat=0x%lx-->0x%lx cluster_shift=0x%lx\n", (unsigned)fi.fat_fstype, (unsigned long)fi.cluster_count, (unsigned long)fp.fcp.cluster_count, (unsigned long)fi.sectors_per_fat, (unsigned long)fp.fcp.sectors_per_fat, (unsigned long)ctx->rsz_shift);
+#  endif
+  if (fp.fcp.sector_count <= old_sector_count || ctx->rsz_shift >= fi.cluster_count) {
+    msg_printf("fatal: the new image size must be larger: %s\n", ctx->sfn);
+    exit(2);
+  }
+  /* Read the first FAT, and the FAT16 root directory. */
+  fat_bytes = fi.sectors_per_fat << 9;
+  if ((fat_bytes >> 9) != fi.sectors_per_fat || (size_t)fat_bytes != fat_bytes || (size_t)(fi.cluster_count << 2) != fi.cluster_count << 2) fatal0("out of memory");
+  ctx->rsz_fat = (char*)alloc_zero(fat_bytes);
+  read_image_bytes(old_fat_sec_ofs, ctx->rsz_fat, fat_bytes);
+  if (fi.rootdir_entry_count) read_image_bytes(fi.rootdir_sec_ofs, rootdir = (char*)alloc_zero((size_t)fi.rootdir_entry_count << 5), (ud)fi.rootdir_entry_count << 5);
+
+  /* Plan the new location of each used cluster, before changing anything. First the system files in the way, at the start. */
+  ctx->rsz_map = (ud*)alloc_zero((size_t)fi.cluster_count * sizeof(ud));
+  bad_value = fi.fat_fstype == 32 ? 0x0ffffff7U : 0xfff7U;
+  if (fi.fat_fstype == 32) {
+    for (i = 0, c = fi.rootdir_start_cluster; c - 2U < fi.cluster_count && i++ <= fi.cluster_count; c = get_old_fat_entry(c)) {
+      for (sec = old_clusters_sec_ofs + ((c - 2U) << ctx->rsz_log2_spc), t = (ud)1 << ctx->rsz_log2_spc; t; --t, ++sec) {
+        read_sector(sec, buf);
+        if (!add_resized_system_files(buf, sys_clusters, &sys_count)) goto done_system_files;
+      }
+    }
+   done_system_files: ;
+  } else {
+    for (p = rootdir; p != rootdir + ((ud)fi.rootdir_entry_count << 5) && add_resized_system_files(p, sys_clusters, &sys_count); p += 0x200) {}
+  }
+  for (next = 2, n = 0; n < sys_count; ++n) {  /* Keep the system files which are in the way (and the ones after them), in their order. */
+    if (has_unplanned_cluster_before(sys_clusters[n], ctx->rsz_shift + 2U + (next - 2U))) plan_resized_chain(sys_clusters[n], &next);
+  }
+  front_count = next - 2U;
+  evict_end = ctx->rsz_shift + 2U + front_count;  /* Old clusters before it must be evicted: they are in the way of the FATs or of the system files. */
+  /* Then the other chains in the way, to the end, each chain contiguously. */
+  preds = (char*)alloc_zero((size_t)(fi.cluster_count >> 3) + 1U);  /* Bitmap: is the old cluster pointed to by a FAT entry? */
+  for (c = 2; c < fi.cluster_count + 2U; ++c) {
+    if ((v = get_old_fat_entry(c)) - 2U < fi.cluster_count) preds[(v - 2U) >> 3] |= 1U << ((v - 2U) & 7U);
+  }
+  reloc_base = fi.cluster_count + 2U - ctx->rsz_shift;  /* The first new cluster after the old data. */
+  for (next = reloc_base, c = 2; c < fi.cluster_count + 2U; ++c) {
+    if (!(preds[(c - 2U) >> 3] & (1U << ((c - 2U) & 7U))) && (v = get_old_fat_entry(c)) != 0 && v != bad_value && has_unplanned_cluster_before(c, evict_end)) plan_resized_chain(c, &next);
+  }
+  for (c = 2; c < evict_end && c < fi.cluster_count + 2U; ++c) {  /* Clusters of chains without a start (loops). */
+    if (!ctx->rsz_map[c - 2U] && (v = get_old_fat_entry(c)) != 0 && v != bad_value) ctx->rsz_map[c - 2U] = next++;
+  }
+  reloc_count = next - reloc_base;
+  if (front_count + 2U > reloc_base || next > fp.fcp.cluster_count + 2U) fatal0("no space for relocating clusters, specify a larger image size");
+  for (c = evict_end; c < fi.cluster_count + 2U; ++c) {  /* The rest (including bad clusters) stays in place. */
+    if (!ctx->rsz_map[c - 2U] && get_old_fat_entry(c) != 0) ctx->rsz_map[c - 2U] = c - ctx->rsz_shift;
+  }
+  free_memory(preds);
+  srcs = (ud*)alloc_zero((size_t)(front_count + reloc_count + 1U) * sizeof(ud));  /* The old cluster of each relocated new cluster. */
+  for (c = 2; c < fi.cluster_count + 2U; ++c) {
+    if ((t = ctx->rsz_map[c - 2U]) - 2U < front_count) {
+      srcs[t - 2U] = c;
+    } else if (t >= reloc_base) {
+      srcs[front_count + (t - reloc_base)] = c;
+    }
+  }
+#  ifdef DEBUG
+    msg_printf("info: resize: relocating 0x%lx clusters of system files to the start and 0x%lx clusters to the end\n", (unsigned long)front_count, (unsigned long)reloc_count);
+#  endif
+
+  /* Extend the file, and relocate the clusters. The system files are read first, because their new location may contain them. */
+  convert_vhd_image(VHD_NOVHD);  /* Remove the VHD footer, it will be added back at the end. */
+  set_file_size_scount(fp.geometry_sector_count);
+  flush_sectors();
+  cbuf = (ud*)alloc_zero((size_t)0x200U << ctx->rsz_log2_spc);
+  if (front_count) front_buf = (ud*)alloc_zero((size_t)front_count << (9 + ctx->rsz_log2_spc));
+  for (i = 0; i < front_count; ++i) {
+    rw_image_cluster(old_clusters_sec_ofs + ((srcs[i] - 2U) << ctx->rsz_log2_spc), front_buf + (i << (7 + ctx->rsz_log2_spc)), 0);
+  }
+  for (i = 0; i < reloc_count; ++i) {
+    rw_image_cluster(old_clusters_sec_ofs + ((srcs[front_count + i] - 2U) << ctx->rsz_log2_spc), cbuf, 0);
+    rw_image_cluster(clusters_sec_ofs + ((reloc_base + i - 2U) << ctx->rsz_log2_spc), cbuf, 1);
+  }
+  for (i = 0; i < front_count; ++i) {
+    rw_image_cluster(clusters_sec_ofs + (i << ctx->rsz_log2_spc), front_buf + (i << (7 + ctx->rsz_log2_spc)), 1);
+  }
+  free_memory(front_buf);
+  free_memory(cbuf);
+
+  /* Clear the old FATs, root directory and the clusters in the way. */
+  zero_sectors(old_fat_sec_ofs, clusters_sec_ofs - old_fat_sec_ofs);
+
+  /* Update the start clusters in the directory entries. */
+  if (fi.fat_fstype == 32) {
+    resize_dir(fi.rootdir_start_cluster, 0);
+  } else {
+    sec = fp.hidden_sector_count + fp.reserved_sector_count + ((ud)fp.fcp.sectors_per_fat << (fp.fat_count - 1U));
+    for (p = rootdir; p != rootdir + ((ud)fi.rootdir_entry_count << 5); p += 0x200, ++sec) {
+      n = remap_dir_sector(p, subdirs);
+      memcpy(ctx->sbuf, p, 0x200);
+      write_sector(sec);
+      while (n) resize_dir(subdirs[--n], 1);
+    }
+  }
+
+  /* Write the new FATs. */
+  for (used_count = 0, sec = 0, c = 0; c < fp.fcp.cluster_count + 2U; ++sec) {
+    memset(ctx->s = ctx->sbuf, 0, sizeof(ctx->sbuf));
+    for (is_nonzero = 0; ctx->s != ctx->sbuf + sizeof(ctx->sbuf) && c < fp.fcp.cluster_count + 2U; ++c) {
+      if (c < 2U) {
+        v = fi.fat_fstype == 32 ? gd(ctx->rsz_fat + (c << 2)) : gw(ctx->rsz_fat + (c << 1));  /* Media descriptor and flags, unchanged. */
+      } else if (c - 2U < front_count) {  /* Relocated system file cluster. */
+        v = map_resized_cluster(get_old_fat_entry(srcs[c - 2U]));
+      } else if (c < reloc_base) {
+        v = ctx->rsz_map[c + ctx->rsz_shift - 2U] == c ? map_resized_cluster(get_old_fat_entry(c + ctx->rsz_shift)) : 0U;  /* Free if its old cluster was relocated. */
+      } else if (c < reloc_base + reloc_count) {  /* Relocated cluster. */
+        v = map_resized_cluster(get_old_fat_entry(srcs[front_count + (c - reloc_base)]));
+      } else {
+        v = 0;
+      }
+      if (v) {
+        is_nonzero = 1;
+        if (c >= 2U) ++used_count;
+      }
+      if (fi.fat_fstype == 32) { dd(v); } else { dw(v); }
+    }
+    if (is_nonzero) {
+      for (fi_idx = 0; fi_idx < fp.fat_count; ++fi_idx) {
+        write_sector(fp.hidden_sector_count + fp.reserved_sector_count + fi_idx * fp.fcp.sectors_per_fat + sec);
+      }
+    }
+  }
+
+  /* Update the boot sector, its backup copy, the MBR and the FSInfo sector. */
+  for (i = 0; i < 2U; ++i) {
+    if (i) {
+      read_sector(0, ctx->sbuf);
+      if (!is_same_bytes(ctx->sbuf + 0x5a, boot_bin + BOOT_OFS_MBR + 0x5a, 0x1be - 0x5a)) goto update_partition;  /* Not the MBR of bakefat, it doesn't contain a copy of the BPB. */
+    } else {
+      memcpy(ctx->sbuf, boot, 0x200);
+    }
+    ctx->s = ctx->sbuf + 0xe; dw((i ? fp.hidden_sector_count : 0U) + fp.reserved_sector_count);
+    ctx->s = ctx->sbuf + 0x13; dw((i ? fp.fcp.sector_count : fp.fcp.sector_count - fp.hidden_sector_count) > 0xffffU ? 0 : (i ? fp.fcp.sector_count : fp.fcp.sector_count - fp.hidden_sector_count));
+    ctx->s = ctx->sbuf + 0x16; dw(fi.fat_fstype == 32 ? 0 : fp.fcp.sectors_per_fat);
+    if (!i) { dw(fp.fcp.sectors_per_track); } else { ctx->s += 2; }
+    dw(fp.fcp.head_count);
+    ctx->s = ctx->sbuf + 0x20; dd(i ? fp.fcp.sector_count : fp.fcp.sector_count - fp.hidden_sector_count);
+    if (fi.fat_fstype == 32) {
+      dd(fp.fcp.sectors_per_fat);
+      ctx->s = ctx->sbuf + 0x2c; dd(map_resized_cluster(fi.rootdir_start_cluster));
+    }
+    if (i) { update_partition:
+      if (fi.fat_fstype == 16) ctx->sbuf[0x1be + 4] = fp.fcp.sector_count >> 16 ? PTYPE_FAT16 : PTYPE_FAT16_LESS_THAN_32MIB;
+      ctx->s = ctx->sbuf + 0x1be + 12; dd(fp.fcp.sector_count - fp.hidden_sector_count);
+      write_sector(0);
+    } else {
+      write_sector(fp.hidden_sector_count);
+      if (fi.fat_fstype == 32 && gw(boot + 0x32)) write_sector(fp.hidden_sector_count + gw(boot + 0x32));
+    }
+  }
+  fi.cluster_count = fp.fcp.cluster_count;
+  fi.free_cluster_count = fp.fcp.cluster_count - used_count;
+  free_extent.start_cluster = reloc_base + reloc_count;
+  free_extent.cluster_count = fp.fcp.cluster_count + 2U - free_extent.start_cluster;
+  fi.extents = &free_extent;
+  fi.extent_count = free_extent.cluster_count ? 1 : 0;
+  write_fsinfo(&fi);
+  flush_sectors();
+  free_memory(rootdir);
+  free_memory(srcs);
+  free_memory(ctx->rsz_map);
+  free_memory(ctx->rsz_fat);
+  ctx->rsz_map = NULL;
+  if (was_vhd) convert_vhd_image(VHD_FIXED);
+}
+
+#define DFG_MOVED 0x80000000U  /* Flag in rsz_map[...]: the data of the old cluster has been moved. */
+
+/* Allocates the next new cluster to old cluster, skipping bad clusters. */
+static void defrag_alloc_cluster(ud cluster) {
+  for (; get_old_fat_entry(ctx->dfg_next_cluster) == ctx->dfg_bad_value; ++ctx->dfg_next_cluster) {}
+  ctx->rsz_map[cluster - 2U] = ctx->dfg_next_cluster++;
+}
+
+static void add_defrag_dir(ud cluster) {
+  if (ctx->dfg_dir_count == ctx->dfg_dir_capacity) ctx->dfg_dirs = (ud*)grow_array(ctx->dfg_dirs, ctx->dfg_dir_count, &ctx->dfg_dir_capacity, sizeof(ud));
+  ctx->dfg_dirs[ctx->dfg_dir_count++] = cluster;
+}
+
+/* Allocates contiguous new clusters to the old cluster chain starting at
+ * cluster. Exits if the chain joins an already allocated chain (or itself).
+ */
+static void defrag_plan_chain(ud cluster) {
+  for (; cluster - 2U < ctx->rsz_old_cluster_count; cluster = get_old_fat_entry(cluster)) {
+    if (ctx->rsz_map[cluster - 2U]) fatal0("cross-linked or looping cluster chain, fix the filesystem first (e.g. with ScanDisk or fsck.vfat)");
+    defrag_alloc_cluster(cluster);
+  }
+}
+
+/* Allocates new clusters to the entries of the directory starting at old
+ * cluster (0 for the FAT12 or FAT16 root directory), in directory order.
+ * In the root directory, system files (such as IO.SYS) come first, because
+ * some boot sectors need them at the start of the cluster area. Appends the
+ * subdirectories to dfg_dirs. The directory itself must be already planned.
+ */
+static void defrag_plan_dir(const struct fat_image *fip, ud cluster, ub is_root) {
+  char buf[0x200], *p;
+  ud c, sec, sec_end, start_cluster;
+  ub pass, is_system;
+  for (pass = is_root ? 0 : 1; pass < 2U; ++pass) {
+    for (c = cluster;;) {
+      if (c == 0) {
+        sec = fip->rootdir_sec_ofs;
+        sec_end = sec + (fip->rootdir_entry_count >> 4);
+      } else {
+        sec = fip->clusters_sec_ofs + ((c - 2U) << fip->log2_sectors_per_cluster);
+        sec_end = sec + ((ud)1 << fip->log2_sectors_per_cluster);
+      }
+      for (; sec != sec_end; ++sec) {
+        read_sector(sec, buf);
+        for (p = buf; p != buf + 0x200; p += 0x20) {
+          if (*p == '\0') goto next_pass;  /* No more entries. */
+          if (*p == (char)0xe5 || *p == '.' || (p[0xb] & FATTR_VOLUME_LABEL)) continue;  /* Deleted entry, `.', `..', volume label or long filename (LFN) entry. */
+          is_system = (p[0xb] & (FATTR_SYSTEM | FATTR_DIRECTORY)) == FATTR_SYSTEM;
+          if (is_system != !pass) continue;
+          if ((start_cluster = gw(p + 0x1a) | (fip->fat_fstype == 32 ? (ud)gw(p + 0x14) << 16 : 0U)) == 0) continue;
+          defrag_plan_chain(start_cluster);
+          if (p[0xb] & FATTR_DIRECTORY) add_defrag_dir(start_cluster);
+        }
+      }
+      if (c == 0 || (c = get_old_fat_entry(c)) - 2U >= ctx->rsz_old_cluster_count) break;
+    }
+   next_pass: ;
+  }
+}
+
+static void defrag_rw_cluster(ud cluster, ud *buf, ub is_write) {
+  rw_image_cluster(ctx->rsz_clusters_sec_ofs + ((cluster - 2U) << ctx->rsz_log2_spc), buf, is_write);
+}
+
+/* Defragments the existing filesystem in the image file sfd in place: makes
+ * each file and directory contiguous, in breadth-first order (like
+ * create_fat(...) does), starting with the FAT32 root directory and the
+ * system files in the root directory. Lost clusters (used, but not
+ * reachable from a directory) are kept, after the files. Bad clusters stay
+ * in place. All planning (and consistency checking) is done before the
+ * first write. The data is moved by following the cycles of the cluster
+ * permutation, so each cluster is read and written at most once, and no
+ * free space is needed. Memory usage is 12 bytes per cluster at most.
+ */
+static void defrag_fat_image(void) {
+  struct fat_image fi;
+  struct fat_params fp;
+  struct fat_extent free_extent;
+  char boot[0x200], buf[0x200];
+  ud *cbuf[2], *inv, subdirs[0x10], fat_bytes, part_sec_ofs, c, src, t, v, i, sec, moved_count = 0;
+  ub k, is_last;
+  open_fat_image(&fi);  /* Leaves the FAT boot sector in sbuf. */
+  memcpy(boot, ctx->sbuf, 0x200);
+  part_sec_ofs = fi.fat_sec_ofs - gw(boot + 0xe);
+  ctx->rsz_fat_fstype = fi.fat_fstype;
+  ctx->rsz_log2_spc = fi.log2_sectors_per_cluster;
+  ctx->rsz_old_cluster_count = fi.cluster_count;
+  ctx->rsz_shift = 0;
+  ctx->rsz_clusters_sec_ofs = fi.clusters_sec_ofs;
+  ctx->dfg_bad_value = fi.fat_fstype == 32 ? 0x0ffffff7U : fi.fat_fstype == 16 ? 0xfff7U : 0xff7U;
+  fat_bytes = fi.sectors_per_fat << 9;
+  if ((fat_bytes >> 9) != fi.sectors_per_fat || (size_t)fat_bytes != fat_bytes || (size_t)(fi.cluster_count << 2) != fi.cluster_count << 2) fatal0("out of memory");
+  ctx->rsz_fat = (char*)alloc_zero(fat_bytes);
+  read_image_bytes(fi.fat_sec_ofs, ctx->rsz_fat, fat_bytes);
+
+  /* Plan the new location of each used cluster. */
+  ctx->rsz_map = (ud*)alloc_zero((size_t)fi.cluster_count * sizeof(ud));
+  for (c = 2; c < fi.cluster_count + 2U; ++c) {
+    if ((v = get_old_fat_entry(c)) == ctx->dfg_bad_value) {
+      ctx->rsz_map[c - 2U] = c;
+    } else if (v == 0) {
+      ++fi.free_cluster_count;
+    }
+  }
+  ctx->dfg_next_cluster = 2;
+  ctx->dfg_dirs = NULL;
+  ctx->dfg_dir_count = ctx->dfg_dir_capacity = 0;
+  if (fi.fat_fstype == 32) defrag_plan_chain(fi.rootdir_start_cluster);
+  add_defrag_dir(fi.fat_fstype == 32 ? fi.rootdir_start_cluster : 0U);
+  for (i = 0; i < ctx->dfg_dir_count; ++i) {
+    defrag_plan_dir(&fi, ctx->dfg_dirs[i], i == 0);
+  }
+  for (c = 2; c < fi.cluster_count + 2U; ++c) {  /* Lost clusters. */
+    if (ctx->rsz_map[c - 2U] == 0 && get_old_fat_entry(c) != 0) defrag_alloc_cluster(c);
+  }
+  for (; ctx->dfg_next_cluster < fi.cluster_count + 2U && get_old_fat_entry(ctx->dfg_next_cluster) == ctx->dfg_bad_value; ++ctx->dfg_next_cluster) {}
+
+  /* Move the data, cycle by cycle. The cycle ends at a free old cluster, or at its start. */
+  cbuf[0] = (ud*)alloc_zero((size_t)0x400U << ctx->rsz_log2_spc);
+  cbuf[1] = cbuf[0] + (0x80U << ctx->rsz_log2_spc);
+  flush_sectors();
+  for (c = 2; c < fi.cluster_count + 2U; ++c) {
+    if ((t = ctx->rsz_map[c - 2U]) == 0 || t == c || (t & DFG_MOVED)) continue;
+    defrag_rw_cluster(src = c, cbuf[k = 0], 0);
+    for (;;) {
+      t = ctx->rsz_map[src - 2U];
+      ctx->rsz_map[src - 2U] = t | DFG_MOVED;
+      v = ctx->rsz_map[t - 2U];  /* Old cluster t is overwritten now. */
+      if (!(is_last = v == 0 || (v & DFG_MOVED))) defrag_rw_cluster(t, cbuf[k ^ 1], 0);
+      defrag_rw_cluster(t, cbuf[k], 1);
+      ++moved_count;
+      if (is_last) break;
+      src = t;
+      k ^= 1;
+    }
+  }
+  for (c = 0; c < fi.cluster_count; ++c) {
+    ctx->rsz_map[c] &= ~DFG_MOVED;
+  }
+#  ifdef DEBUG
+    msg_printf("info: defrag: FAT%u cluster_count=0x%lx used_cluster_count=0x%lx directory_count=0x%lx moved_cluster_count=0x%lx\n", (unsigned)fi.fat_fstype, (unsigned long)fi.cluster_count, (unsigned long)(fi.cluster_count - fi.free_cluster_count), (unsigned long)ctx->dfg_dir_count, (unsigned long)moved_count);
+#  endif
+
+  /* Update the start clusters in the directory entries, now in their new location. */
+  for (i = 0; i < ctx->dfg_dir_count; ++i) {
+    for (c = ctx->dfg_dirs[i];;) {
+      sec = c ? fi.clusters_sec_ofs + ((map_resized_cluster(c) - 2U) << ctx->rsz_log2_spc) : fi.rootdir_sec_ofs;
+      for (t = c ? (ud)1 << ctx->rsz_log2_spc : (ud)fi.rootdir_entry_count >> 4; t; --t, ++sec) {
+        read_sector(sec, buf);
+        remap_dir_sector(buf, subdirs);  /* The subdirectories are already in dfg_dirs. */
+        memcpy(ctx->sbuf, buf, 0x200);
+        write_sector(sec);
+      }
+      if (c == 0 || (c = get_old_fat_entry(c)) - 2U >= ctx->rsz_old_cluster_count) break;
+    }
+  }
+
+  /* Write the new FATs, in ascending order. */
+  inv = (ud*)alloc_zero((size_t)fi.cluster_count * sizeof(ud));
+  for (c = 2; c < fi.cluster_count + 2U; ++c) {
+    if ((t = ctx->rsz_map[c - 2U]) != 0) inv[t - 2U] = c;
+  }
+  memset(&fp, '\0', sizeof(fp));
+  fp.fat_fstype = fi.fat_fstype;
+  fp.fcp.sectors_per_fat = fi.sectors_per_fat;
+  ctx->fatw_fpp = &fp;
+  ctx->fatw_fat_count = fi.fat_count;
+  ctx->fatw_fat_sec_ofs = fi.fat_sec_ofs;
+  ctx->fatw_sec = 0;
+  memset(ctx->sbuf, 0, sizeof(ctx->sbuf));
+  fatw_put(0, get_old_fat_entry(0));
+  fatw_put(1, get_old_fat_entry(1));
+  for (t = 2; t < fi.cluster_count + 2U; ++t) {
+    fatw_put(t, inv[t - 2U] ? map_resized_cluster(get_old_fat_entry(inv[t - 2U])) : 0U);
+  }
+  fatw_flush();
+
+  /* Update the FAT32 root directory start cluster in the boot sector, its backup copy and the MBR of bakefat. */
+  if (fi.fat_fstype == 32 && (v = map_resized_cluster(fi.rootdir_start_cluster)) != fi.rootdir_start_cluster) {
+    for (i = 0; i < 3U; ++i) {
+      if (i == 0) {
+        sec = part_sec_ofs;
+      } else if (i == 1) {
+        if (!gw(boot + 0x32)) continue;  /* No backup boot sector. */
+        sec = part_sec_ofs + gw(boot + 0x32);
+      } else {
+        if (!part_sec_ofs) continue;  /* No MBR. */
+        sec = 0;
+      }
+      read_sector(sec, ctx->sbuf);
+      if (i == 2 && !is_same_bytes(ctx->sbuf + 0x5a, boot_bin + BOOT_OFS_MBR + 0x5a, 0x1be - 0x5a)) continue;  /* Not the MBR of bakefat, it doesn't contain a copy of the BPB. */
+      ctx->s = ctx->sbuf + 0x2c; dd(v);
+      write_sector(sec);
+    }
+    fi.rootdir_start_cluster = v;
+  }
+  free_extent.start_cluster = ctx->dfg_next_cluster;
+  free_extent.cluster_count = fi.free_cluster_count;
+  fi.extents = &free_extent;
+  fi.extent_count = fi.free_cluster_count ? 1 : 0;
+  write_fsinfo(&fi);
+  flush_sectors();
+  free_memory(inv);
+  free_memory(cbuf[0]);
+  free_memory(ctx->dfg_dirs);
+  free_memory(ctx->rsz_map);
+  free_memory(ctx->rsz_fat);
+  ctx->rsz_map = NULL;
+}
+
+/* Creates the filesystem described by *fpp (as returned by
+ * solve_fat_geometry(...)) and the planned pfiles in the already opened
+ * output file fd. filename is used in error messages. output_flags is a
+ * bitmask of OF_... values: with OF_REUSE, fd is an existing file or block
+ * device, and only its metadata region is zeroed (rather than relying on it
+ * having been truncated); with OF_THICK, the entire file is allocated.
+ */
+static void write_fat_image(const struct fat_params *fpp, int fd, const char *filename, ub output_flags) {
+  ctx->sfd = fd;
+  ctx->sfn = filename;
+  if (!(output_flags & OF_THICK)) bakefat_set_sparse(ctx->sfd);
+  create_fat(fpp, output_flags);
+}
+
+/* Writes the disk image as an Android sparse image (simg) to fd, which
+ * can be a pipe. It reads the host files twice (see simg_pass).
+ */
+static void write_fat_image_simg(const struct fat_params *fpp, int fd, const char *filename) {
+  ctx->sfd = fd;
+  ctx->sfn = filename;
+#ifdef BAKEFAT_DOS_OR_WIN32
+  setmode(fd, O_BINARY);
+#endif
+  start_simg(IS_VHD(fpp->vhd_mode) ? get_vhd_sector_count(fpp) + 1U : fpp->geometry_sector_count);
+  create_fat(fpp, 0);
+#ifdef DEBUG
+  msg_printf("info: simg: 0x%lx blocks in 0x%lx runs\n", (unsigned long)ctx->simg_block_count, (unsigned long)ctx->simg_run_count);
+#endif
+  start_simg_output();
+  create_fat(fpp, 0);
+  write_simg_until(ctx->simg_block_count);
+  ctx->simg_pass = 0;
+}
+
+/* Creates the differencing VHD child of parent_fn (a VHD created by bakefat
+ * with the same size and filesystem flags, but a different volume ID) in
+ * the already opened output file fd (opened for reading and writing). The
+ * child contains only the sectors containing the volume ID (boot sectors and
+ * MBR), the rest is read from the parent. A relative parent_fn is relative
+ * to the directory of the output file (filename), as in the parent locator.
+ */
+static void write_fat_image_child(const struct fat_params *fpp, int fd, const char *filename, const char *parent_fn) {
+  const ud vhd_sector_count = get_vhd_sector_count(fpp);
+  char expected_id[0xc];
+  const char *p, *q;
+  char *pathname;
+  int pfd;
+  int64_t size;
+  for (p = q = filename; *q != '\0'; ++q) {
+    if (*q == '/' || *q == '\\') p = q + 1;
+  }
+  if (is_absolute_path(parent_fn)) p = filename;
+  pathname = (char*)alloc_zero((p - filename) + strlen(parent_fn) + 1U);
+  memcpy(pathname, filename, p - filename);
+  strcpy(pathname + (p - filename), parent_fn);
+  if ((pfd = open_file(pathname, O_RDONLY | O_BINARY, 0)) < 0) {
+    msg_printf("fatal: error opening parent image file: %s\n", pathname);
+    exit(2);
+  }
+  if ((size = bakefat_lseek64(pfd, 0, SEEK_END)) < 0x200 || bakefat_lseek64(pfd, size - 0x200, SEEK_SET) != size - 0x200 || read(pfd, ctx->sbuf, 0x200) != 0x200) {
+    msg_printf("fatal: error reading VHD footer of parent image file: %s\n", pathname);
+    exit(2);
+  }
+  close_file(pfd);
+  ctx->s = expected_id;  /* See the identifier in write_vhd_footer(...). */
+  dd(fpp->geometry_sector_count);
+  db(fpp->fat_fstype + (fpp->fat_count - 1U));
+  memcpy(ctx->s, "\xb5\xd4\x99\xe3\xbc\x63\x46", 7);
+  if (!is_same_bytes(ctx->sbuf, "conectix", 8) || (ub)ctx->sbuf[0x3f] < VHD_FIXED || (ub)ctx->sbuf[0x3f] > VHD_DIFFERENCING) {
+    msg_printf("fatal: parent image file is not a VHD: %s\n", pathname);
+    exit(2);
+  }
+  if (!is_same_bytes(ctx->sbuf + 0x48, expected_id, sizeof(expected_id))) {
+    msg_printf("fatal: parent image file was not created by bakefat with the same size and filesystem flags: %s\n", pathname);
+    exit(2);
+  }
+  if (gd(ctx->sbuf + 0x44) == fpp->volume_id) {
+    msg_printf("fatal: specify a VID= different from the volume ID of the parent image file: %s\n", pathname);
+    exit(2);
+  }
+  memcpy(ctx->vhd_parent_id, ctx->sbuf + 0x44, 0x10);  /* unique_id. */
+  memcpy(ctx->vhd_parent_id + 0x10, ctx->sbuf + 0x18, 4);  /* modification_time. */
+  free_memory(pathname);
+  ctx->sfd = fd;
+  ctx->sfn = filename;
+  bakefat_set_sparse(ctx->sfd);
+  ctx->vhd_parent_fn = parent_fn;
+  start_vhd_dynamic(vhd_sector_count);
+  write_boot_sectors(fpp);
+  write_vhd_footer(fpp, vhd_sector_count);
+}
+
+#ifdef BAKEFAT_POSIX
+/* Copies the first size bytes of the image file src_fd (of the same size)
+ * to the output file. Only the data ranges (found by SEEK_DATA and
+ * SEEK_HOLE where available) are read, and blocks of NUL bytes are not
+ * written, so they remain holes.
+ */
+static void copy_image_file(int src_fd, uint64_t size) {
+  uint64_t ofs, end;
+  unsigned want;
+  char is_seek_needed;
+#  if defined(SEEK_DATA) && defined(SEEK_HOLE)
+  off_t got;
+#  endif
+  set_file_size_scount(size >> 9);
+  for (ofs = 0; ofs < size; ofs = end) {
+    end = size;
+#  if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    if ((got = lseek(src_fd, ofs, SEEK_DATA)) < 0) {
+      if (errno == ENXIO) break;  /* Only a hole remains. */
+    } else {
+      if ((uint64_t)got >= size) break;
+      ofs = got;
+      if ((got = lseek(src_fd, ofs, SEEK_HOLE)) >= 0 && (uint64_t)got < size) end = got;
+    }
+#  endif
+    if ((uint64_t)bakefat_lseek64(src_fd, ofs, SEEK_SET) != ofs) goto error_reading;
+    for (is_seek_needed = 1; ofs != end; ofs += want) {
+      want = end - ofs > sizeof(ctx->copy_buf) ? (unsigned)sizeof(ctx->copy_buf) : (unsigned)(end - ofs);
+      if ((size_t)read(src_fd, ctx->copy_buf, want) != want) { error_reading:
+        fatal0("error reading template image file");
+      }
+      if (is_copy_buf_zero(want)) {
+        is_seek_needed = 1;
+        continue;
+      }
+      if (is_seek_needed) {
+        if ((uint64_t)bakefat_lseek64(ctx->sfd, ofs, SEEK_SET) != ofs) {
+          msg_printf("fatal: error seeking in output file: %s\n", ctx->sfn);
+          exit(2);
+        }
+        is_seek_needed = 0;
+      }
+      if ((size_t)write(ctx->sfd, ctx->copy_buf, want) != want) {
+        msg_printf("fatal: error writing to output file: %s\n", ctx->sfn);
+        exit(2);
+      }
+    }
+  }
+}
+
+/* Like write_fat_image(...), but creates the image as a copy of a template
+ * image in cache_dir, and then rewrites only the sectors containing the
+ * volume ID: the boot sector (and its backup copy), the MBR and the VHD
+ * footer. On
+ * Linux, on Btrfs and XFS, the copy shares the extents of the template
+ * (FICLONE), so it is instant. If the template doesn't exist yet, it is
+ * created first. Only for images without pfiles.
+ */
+static void write_fat_image_cached(const struct fat_params *fpp, int fd, const char *filename, const char *cache_dir) {
+  struct fat_params key_fp;
+  char *template_fn, *tmp_fn, *p;
+  const unsigned char *kp;
+  int tfd;
+  int64_t size;
+  size_t fn_size;
+  ud boot_hash = 0x811c9dc5U;
+  /* The template filename contains all bytes of *fpp (except for the volume ID) as the key, rather than a hash, so there are no collisions. */
+  memcpy(&key_fp, fpp, sizeof(key_fp));  /* memcpy(...) also copies the (zero) padding bytes. */
+  key_fp.volume_id = 0;
+  for (kp = (const unsigned char*)boot_bin; kp != (const unsigned char*)boot_bin + BOOT_OFS_END; ++kp) {  /* FNV-1a hash of the boot code, because it may change without a BAKEFAT_VERSION change. */
+    boot_hash = ((boot_hash ^ *kp) * 0x1000193U) & 0xffffffffU;
+  }
+  fn_size = strlen(cache_dir) + (sizeof(key_fp) << 1) + 64U;
+  template_fn = (char*)alloc_zero(fn_size << 1);
+  p = template_fn + sprintf(template_fn, "%s/bakefat%d-%08lx-", cache_dir, BAKEFAT_VERSION, (unsigned long)boot_hash);
+  for (kp = (const unsigned char*)&key_fp; kp != (const unsigned char*)(&key_fp + 1); ++kp) {
+    p += sprintf(p, "%02x", *kp);
+  }
+  strcpy(p, ".img");
+  if ((tfd = open_file(template_fn, O_RDONLY | O_BINARY, 0)) < 0) {
+    tmp_fn = template_fn + fn_size;  /* Temporary filename, so that concurrent bakefat processes don't see a partial template. */
+    strcpy(tmp_fn, template_fn);
+    sprintf(tmp_fn + (p + 4 - template_fn), ".%lu.tmp", (unsigned long)getpid());
+    if ((ctx->sfd = open_file(tmp_fn, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0666)) < 0) {
+      msg_printf("fatal: error creating template image file: %s\n", tmp_fn);
+      exit(2);
+    }
+    write_fat_image(fpp, ctx->sfd, tmp_fn, 0);
+    if (rename(tmp_fn, template_fn) != 0) {
+      msg_printf("fatal: error renaming template image file: %s\n", tmp_fn);
+      exit(2);
+    }
+    tfd = ctx->sfd;
+  }
+  ctx->sfd = fd;
+  ctx->sfn = filename;
+  if ((size = bakefat_lseek64(tfd, 0, SEEK_END)) < 0) fatal0("error seeking in template image file");
+#  if defined(__linux__) && defined(FICLONE)
+  if (ioctl(ctx->sfd, FICLONE, tfd) != 0)
+#  endif
+  {
+    bakefat_set_sparse(ctx->sfd);
+    copy_image_file(tfd, size);
+  }
+  close_file(tfd);
+  free_memory(template_fn);
+  write_boot_sectors(fpp);
+  if (fpp->vhd_mode == VHD_FIXED) write_vhd_footer(fpp, get_vhd_sector_count(fpp));
+  flush_sectors();
+}
+#endif
+
+/* Computes the FAT geometry of a new image, and adds and plans the pfiles. */
+static void plan_image(struct fat_params *fpp, const struct image_flags *ifp) {
+  if (ifp->is_compact || ifp->is_defrag) bad_usage0("COMPACT and DEFRAG can be used only with EDIT");
+  solve_fat_geometry(fpp);
+  if (ifp->prealloc_spec) add_prealloc_files(ifp->prealloc_spec);  /* After all SYS= files. */
+  if (ifp->tree_dir) {
+#ifdef BAKEFAT_POSIX
+    add_host_tree(ifp->tree_dir);
+#else
+    bad_usage0("TREE= is not supported on this platform");
+#endif
+  }
+  plan_pfiles(fpp);
+  if ((fpp->vhd_mode == VHD_DYNAMIC || fpp->vhd_mode == VHD_QCOW2) && (ifp->is_reuse || ifp->is_thick || ifp->cache_dir)) bad_usage0("DYNVHD and QCOW2 can't be combined with REUSE, THICK or CACHE=");
+  if (ifp->parent_fn && (ifp->is_reuse || ifp->is_thick || ifp->cache_dir || ctx->pfile_count)) bad_usage0("PARENT= can't be combined with REUSE, THICK, CACHE=, SYS=, TREE= or PREALLOC=");
+  if (ifp->cache_dir) {
+#ifdef BAKEFAT_POSIX
+    if (ctx->pfile_count) bad_usage0("CACHE= can't be combined with SYS=, TREE= or PREALLOC=");
+    if (ifp->is_reuse || ifp->is_thick) bad_usage0("CACHE= can't be combined with REUSE or THICK");
+#else
+    bad_usage0("CACHE= is not supported on this platform");
+#endif
+  }
+}
+
+/* Writes the image planned by plan_image(...) to fd, which is not a pipe.
+ * filename is used only in error messages and for PARENT=.
+ */
+static void write_planned_image(const struct fat_params *fpp, const struct image_flags *ifp, int fd, const char *filename) {
+#ifdef BAKEFAT_POSIX
+  if (ifp->cache_dir) {
+    write_fat_image_cached(fpp, fd, filename, ifp->cache_dir);
+  } else
+#endif
+  if (ifp->parent_fn) {
+    write_fat_image_child(fpp, fd, filename, ifp->parent_fn);
+  } else {
+    write_fat_image(fpp, fd, filename, (ifp->is_reuse ? OF_REUSE : 0) | (ifp->is_thick ? OF_THICK : 0));
+  }
+  print_output_stats(ifp->is_stats);
+}
+
+/* Creates (or edits) a single image file as specified by the command-line
+ * arguments argv (argv[0] is the program name). If fd is nonnegative, writes
+ * the image to fd instead of opening the output file. Returns the process
+ * exit code, or exits on error.
+ */
+static int create_image_main(char **argv, int fd) {
+  const char **arge, **argfn = NULL;
   ub is_help;
-  signed char log2_size = 0;  /* Unspecified. -1 means FAT12 preset. */
-  const struct fat12_preset *prp;
-  const char **csp;
   struct fat_params fp;
-  int min_log2_spc, max_log2_spc;
-  uw old_sectors_per_fat;
-  ud fat_clusters_sec_ofs;
-  ud hi, lo, mid;
-  ud u;
-  ub b;
-  ub had_volume_id;
+  struct image_flags imf;
+  ub is_fd_opened = 0;
 
-  (void)argc;
-#  ifdef __MMLIBC386__
-  stdout_fd = STDERR_FILENO;  /* For msg_printf(...). */
-#  endif
   memset(&fp, '\0', sizeof(fp));
-  fp.default_log2_sectors_per_cluster = fp.fcp.log2_sectors_per_cluster = (ub)-1;  /* Unspecified. */
-  had_volume_id = 0;
+  memset(&imf, '\0', sizeof(imf));
   is_help = argv[1] && (strcasecmp(argv[1], "--help") == 0 || (!argv[2] && strcasecmp(argv[1], "help") == 0));
   for (arge = (const char **)argv + 1; ; ++arge) {
     if (!*arge) {  /* The last argument is the output image file name (<outfile.img>). */
       argfn = --arge;
-      if ((char**)argfn != argv && argfn[0][0] == '-') argfn = ++arge;
+      if ((char**)argfn != argv && argfn[0][0] == '-' && argfn[0][1] != '\0') argfn = ++arge;  /* `-' is stdout. */
       break;
     }
     if (strcmp(*arge, "--") == 0) {
@@ -991,334 +4221,1284 @@ int main(int argc, char **argv) {
       break;
     }
   }
-  if (is_help || (char**)argfn == argv) usage(is_help, argv[0]);
-  for (arg = (const char **)argv + 1; arg != arge; ++arg) {
-    for (flag = *arg; *flag == '-' || *flag == '/'; ++flag) {}  /* Skip leading - and / characters in flag. */
-    for (prp = fat12_presets; prp != ARRAY_END(fat12_presets); ++prp) {
-      if (strcasecmp(flag, prp->name) == 0) {
-        if (fp.fat_fstype && fp.fat_fstype != 12) goto error_conflicting_fat_fstype;
-        if (log2_size && (log2_size != -1 || fp.fcp.sector_count != prp->fcp.sector_count)) { error_conflicting_size:
-          bad_usage0("conflicting image sizes specified");
-        }
-        log2_size = -1;
-        u = fp.fcp.rootdir_entry_count;  /* Save. */
-        b = fp.fcp.log2_sectors_per_cluster;  /* Save. */
-        fp.fcp = prp->fcp;  /* This is a memcpy(). */
-        fp.default_fat_count = 2;
-        fp.default_reserved_sector_count = 1;
-        fp.default_rootdir_entry_count = fp.fcp.rootdir_entry_count;
-        fp.default_log2_sectors_per_cluster = fp.fcp.log2_sectors_per_cluster;
-        fp.fcp.rootdir_entry_count = u;  /* Restore. */
-        fp.fcp.log2_sectors_per_cluster = b;  /* Restore. */
-        fp.fat_fstype = 12;
-        goto next_flag;
-      }
-    }
-    for (csp = hdd_size_presets_m_21; csp != ARRAY_END(hdd_size_presets_m_21); ++csp) {
-      if (strcasecmp(flag, *csp) == 0) { b = csp - hdd_size_presets_m_21 + 21; set_size: if (log2_size && (ub)log2_size != b) goto error_conflicting_size; log2_size = b; goto next_flag; }
-    }
-    for (csp = hdd_size_presets_g_30; csp != ARRAY_END(hdd_size_presets_g_30); ++csp) {
-      if (strcasecmp(flag, *csp) == 0) { b = csp - hdd_size_presets_g_30 + 30; goto set_size; }
-    }
-    for (csp = hdd_size_presets_t_40; csp != ARRAY_END(hdd_size_presets_t_40); ++csp) {
-      if (strcasecmp(flag, *csp) == 0) { b = csp - hdd_size_presets_t_40 + 40; goto set_size; }
+  if (is_help || (char**)argfn == argv) usage(is_help, argv[0]);
+  parse_flags(&fp, &imf, (const char **)argv + 1, arge);
+  if (!*argfn) bad_usage0("output filename not specified");
+  if (argfn[1]) bad_usage0("multiple output filenames specified");
+  ctx->sfn = *argfn;
+  if (imf.is_edit) {
+    if (imf.had_create_flag) bad_usage0("EDIT can't be combined with image creation flags");
+    if (strcmp(ctx->sfn, "-") == 0) bad_usage0("EDIT can't be combined with output to - (stdout)");
+    if (imf.prealloc_spec) add_prealloc_files(imf.prealloc_spec);
+    if ((ctx->sfd = fd) < 0 && (ctx->sfd = open_file(ctx->sfn, O_RDWR | O_BINARY, 0)) < 0) {
+      msg_printf("fatal: error opening image file: %s\n", ctx->sfn);
+      exit(2);
+    }
+    if (fp.log2_size > 0) resize_fat_image(fp.log2_size);
+    if (imf.prealloc_spec || (!fp.vhd_mode && !fp.log2_size && !imf.is_compact && !imf.is_defrag)) edit_fat_image();
+    if (imf.is_defrag) defrag_fat_image();
+    if (imf.is_compact) compact_fat_image();
+    if (fp.vhd_mode) convert_vhd_image(fp.vhd_mode);
+    print_output_stats(imf.is_stats);
+    if (fd < 0) close_file(ctx->sfd);
+    return 0;
+  }
+  if (!fp.vhd_mode && strcmp(ctx->sfn, "-") == 0) fp.vhd_mode = VHD_NOVHD;  /* The simg output is a container itself. */
+  plan_image(&fp, &imf);
+  if (strcmp(ctx->sfn, "-") == 0 && (imf.is_reuse || imf.is_thick || imf.cache_dir || imf.parent_fn || fp.vhd_mode == VHD_DYNAMIC || fp.vhd_mode == VHD_QCOW2)) bad_usage0("output to - (stdout) can't be combined with REUSE, THICK, CACHE=, PARENT=, DYNVHD or QCOW2");
+  if (fd < 0 && strcmp(ctx->sfn, "-") == 0) {
+    fd = 1;  /* STDOUT_FILENO. */
+  } else if (fd < 0) {
+    if ((fd = open_file(ctx->sfn, (imf.parent_fn ? O_RDWR : O_WRONLY) | O_CREAT | (imf.is_reuse ? 0 : O_TRUNC) | O_BINARY, 0666)) < 0) {  /* REUSE keeps the allocated extents of the file. PARENT= reads the VHD block bitmaps. */
+      msg_printf("fatal: error opening output file: %s\n", ctx->sfn);
+      exit(2);
+    }
+    is_fd_opened = 1;
+  }
+  if (strcmp(ctx->sfn, "-") == 0) {
+    write_fat_image_simg(&fp, fd, ctx->sfn);
+    print_output_stats(imf.is_stats);
+  } else {
+    write_planned_image(&fp, &imf, fd, ctx->sfn);
+  }
+  if (is_fd_opened) close_file(fd);
+  return 0;
+}
+
+#ifdef BAKEFAT_LIBRARY
+struct bakefat_context {
+  struct bakefat_state state;
+  struct fat_params fp;
+  struct image_flags imf;
+  ub step;  /* 1 after bakefat_parse_flags(...), 2 after bakefat_solve_fat_geometry(...). */
+  /* Arguments of the library function being called. */
+  char **argv;
+  int fd;
+  const char *filename;
+};
+
+/* Closes the files left open by a failed library function. */
+static void close_open_files(struct bakefat_state *sp) {
+  unsigned i;
+  for (i = 0; i < OPEN_FD_CAPACITY; ++i) {
+    if (sp->open_fds[i] >= 0) close(sp->open_fds[i]);
+    sp->open_fds[i] = -1;
+  }
+#  ifdef BAKEFAT_POSIX
+  if (sp->open_dir) closedir(sp->open_dir);
+  sp->open_dir = NULL;
+#  endif
+}
+
+/* Calls func(cp) with ctx set to the state of cp. Returns the exit code:
+ * 0 if func(...) returned, or the argument of exit(...). On error, closes
+ * the files opened by func(...).
+ */
+static int call_with_context(struct bakefat_context *cp, void (*func)(struct bakefat_context *cp)) {
+  struct bakefat_state *const old_ctx = ctx;  /* For nested calls. */
+  jmp_buf jb;
+  int exit_code;
+  ctx = &cp->state;
+  ctx->exit_jmp = &jb;
+  if ((exit_code = setjmp(jb)) != 0) {  /* Called exit(...). */
+    --exit_code;
+    close_open_files(&cp->state);
+  } else {
+    func(cp);
+  }
+  ctx = old_ctx;
+  return exit_code;
+}
+
+struct bakefat_context *bakefat_new_context(void) {
+  struct bakefat_context *cp;
+  if ((cp = (struct bakefat_context*)calloc(1, sizeof(*cp))) != NULL) init_state(&cp->state);
+  return cp;
+}
+
+void bakefat_free_context(struct bakefat_context *cp) {
+  union memory_block_header *hp, *next_hp;
+  if (!cp) return;
+  close_open_files(&cp->state);
+  for (hp = cp->state.memory_blocks; hp; hp = next_hp) {
+    next_hp = hp->link.next;
+    free(hp);
+  }
+  free(cp);
+}
+
+static void parse_flags_step(struct bakefat_context *cp) {
+  const char **args;
+  ud arg_count, i;
+  size_t size;
+  if (cp->step != 0) fatal0("bakefat_parse_flags(...) called twice");
+  for (arg_count = 0; cp->argv[arg_count]; ++arg_count) {}
+  args = (const char**)alloc_zero((arg_count + 1U) * sizeof(*args));
+  for (i = 0; i < arg_count; ++i) {  /* Copy the strings, because e.g. SYS= and PREALLOC= split them in place, and the caller may free them. */
+    size = strlen(cp->argv[i]) + 1U;
+    args[i] = (const char*)memcpy(alloc_zero(size), cp->argv[i], size);
+  }
+  parse_flags(&cp->fp, &cp->imf, args, args + arg_count);
+  if (cp->imf.is_edit) bad_usage0("EDIT is supported only by bakefat_create_image(...)");
+  cp->step = 1;
+}
+
+int bakefat_parse_flags(struct bakefat_context *cp, char **argv) {
+  cp->argv = argv;
+  return call_with_context(cp, parse_flags_step);
+}
+
+static void solve_fat_geometry_step(struct bakefat_context *cp) {
+  if (cp->step != 1) fatal0("bakefat_solve_fat_geometry(...) must be called once, after bakefat_parse_flags(...)");
+  plan_image(&cp->fp, &cp->imf);
+  cp->step = 2;
+}
+
+int bakefat_solve_fat_geometry(struct bakefat_context *cp) {
+  return call_with_context(cp, solve_fat_geometry_step);
+}
+
+static void write_fat_image_step(struct bakefat_context *cp) {
+  if (cp->step != 2) fatal0("bakefat_write_fat_image(...) must be called once, after bakefat_solve_fat_geometry(...)");
+  cp->step = 3;
+  ctx->sfn = cp->filename;
+  write_planned_image(&cp->fp, &cp->imf, cp->fd, cp->filename);
+}
+
+int bakefat_write_fat_image(struct bakefat_context *cp, int fd, const char *filename) {
+  cp->fd = fd;
+  cp->filename = filename;
+  return call_with_context(cp, write_fat_image_step);
+}
+
+static void create_image_step(struct bakefat_context *cp) {
+  (void)create_image_main(cp->argv, cp->fd);
+}
+
+int bakefat_create_image(char **argv, int fd) {
+  struct bakefat_context *cp;
+  int exit_code;
+  if ((cp = bakefat_new_context()) == NULL) {
+    msg_printf("fatal: out of memory\n");
+    return 2;
+  }
+  cp->argv = argv;
+  cp->fd = fd;
+  exit_code = call_with_context(cp, create_image_step);
+  bakefat_free_context(cp);
+  return exit_code;
+}
+#else
+
+#ifdef BAKEFAT_POSIX
+struct batch_job {
+  pid_t pid;  /* 0 if not running. */
+  ud line_number;
+  char *line;  /* Copy of the manifest line, split to arguments just before running the job. */
+  char *outfn;
+  int status;  /* Exit code, or -1 if killed by a signal. */
+};
+
+/* Splits line (modifying it) to whitespace-separated arguments, stopping at
+ * the first argument starting with #, appending them to argv, starting at
+ * argv[1]. Appends a NULL. Returns the number of items in argv (including
+ * argv[0], excluding the NULL), or (unsigned)-1 if there are more than
+ * argv_capacity - 2 arguments.
+ */
+static unsigned split_args(char *p, char **argv, unsigned argv_capacity) {
+  unsigned argc;
+  for (argc = 1; ; ) {
+    for (; *p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'; ++p) {}
+    if (*p == '\0' || *p == '#') break;
+    if (argc == argv_capacity - 1U) return (unsigned)-1;
+    argv[argc++] = p;
+    for (; *p != '\0' && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n'; ++p) {}
+    if (*p != '\0') *p++ = '\0';
+  }
+  argv[argc] = NULL;
+  return argc;
+}
+
+/* Waits for a running job to finish, and records its status. */
+static void wait_batch_job(struct batch_job *jobs, ud job_count) {
+  struct batch_job *jp;
+  int wstatus;
+  pid_t pid;
+  for (;;) {
+    if ((pid = waitpid(-1, &wstatus, 0)) < 0) {
+      if (errno == EINTR) continue;
+      fatal0("waitpid failed");
+    }
+    for (jp = jobs; jp != jobs + job_count && jp->pid != pid; ++jp) {}
+    if (jp != jobs + job_count) break;
+  }
+  jp->pid = 0;
+  jp->status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : -1;
+}
+
+/* Runs bakefat for each nonempty, non-comment (#) line of the manifest
+ * file, each line containing the command-line flags and the output
+ * filename, separated by whitespace. The entire manifest file is read (and
+ * closed) first. Each job runs in a child process forked from this one (so
+ * a failing job doesn't affect the others), at most max_running_count at a
+ * time. Reports the status of each job at the end.
+ */
+static int run_batch(const char *argv0, const char *manifest_fn, ud max_running_count) {
+  FILE *f;
+  char line[0x1000], *line_copy, *job_argv[0x100];
+  struct batch_job *jobs = NULL, *jp;
+  ud job_count = 0, job_capacity = 0, running_count = 0, line_number = 0, failed_count = 0;
+  size_t size;
+  unsigned job_argc;
+  pid_t pid;
+  if ((f = fopen(manifest_fn, "r")) == NULL) {
+    msg_printf("fatal: error opening batch manifest file: %s\n", manifest_fn);
+    exit(2);
+  }
+  while (fgets(line, sizeof(line), f)) {
+    ++line_number;
+    if ((size = strlen(line)) == sizeof(line) - 1U && line[size - 1] != '\n') fatal0("batch manifest line too long");
+    if ((line_copy = (char*)malloc(size + 1U)) == NULL) fatal0("out of memory");
+    memcpy(line_copy, line, size + 1U);
+    job_argv[0] = (char*)argv0;
+    if ((job_argc = split_args(line, job_argv, ARRAY_SIZE(job_argv))) == (unsigned)-1) fatal0("too many flags in batch manifest line");
+    if (job_argc == 1) {  /* Empty or comment line. */
+      free(line_copy);
+      continue;
+    }
+    if (job_count == job_capacity) jobs = (struct batch_job*)grow_array(jobs, job_count, &job_capacity, sizeof(struct batch_job));
+    jp = jobs + job_count++;
+    jp->pid = 0;
+    jp->line_number = line_number;
+    jp->line = line_copy;
+  }
+  if (ferror(f)) {
+    msg_printf("fatal: error reading batch manifest file: %s\n", manifest_fn);
+    exit(2);
+  }
+  fclose(f);  /* Before fork(...), so that the children don't share its buffer and file offset. */
+  for (jp = jobs; jp != jobs + job_count; ++jp) {
+    job_argc = split_args(jp->line, job_argv, ARRAY_SIZE(job_argv));
+    jp->outfn = job_argv[job_argc - 1];
+    if (running_count == max_running_count) {
+      wait_batch_job(jobs, (ud)(jp - jobs));
+      --running_count;
+    }
+    fflush(stderr);
+    if ((pid = fork()) < 0) fatal0("fork failed");
+    if (pid == 0) _exit(create_image_main(job_argv, -1));
+    jp->pid = pid;
+    ++running_count;
+  }
+  for (; running_count; --running_count) {
+    wait_batch_job(jobs, job_count);
+  }
+  for (jp = jobs; jp != jobs + job_count; ++jp) {
+    if (jp->status != 0) ++failed_count;
+    if (jp->status == 0) {
+      msg_printf("batch: line %lu: ok: %s\n", (unsigned long)jp->line_number, jp->outfn);
+    } else {
+      msg_printf("batch: line %lu: failed (exit code %d): %s\n", (unsigned long)jp->line_number, jp->status, jp->outfn);
+    }
+  }
+  msg_printf("batch: %lu of %lu jobs failed\n", (unsigned long)failed_count, (unsigned long)job_count);
+  return failed_count ? 2 : 0;
+}
+
+/* Writes the NUL-terminated string str to fd, ignoring errors. */
+static void write_str(int fd, const char *str) {
+  (void)!write(fd, str, strlen(str));
+}
+
+/* Serves a single image creation request read from the connected socket
+ * fd: the request is a single line with the command-line flags and the
+ * output filename, separated by whitespace. Error messages are sent back to
+ * the client, followed by the status line: `ok <microseconds> <outfile>' or
+ * `failed <exit-code> <outfile>'. Runs in its own process.
+ */
+static noreturn void serve_request(int fd, const char *argv0) {
+  char line[0x1000], *req_argv[0x100], status[0x40];
+  struct timeval tv_start, tv_end;
+  unsigned req_argc;
+  size_t size = 0;
+  int got, wstatus;
+  pid_t pid;
+  signal(SIGCHLD, SIG_DFL);  /* For waitpid(...) below. */
+  while (size < sizeof(line) - 1U && (size == 0 || line[size - 1] != '\n') && (got = read(fd, line + size, sizeof(line) - 1U - size)) > 0) {
+    size += got;
+  }
+  line[size] = '\0';
+  req_argv[0] = (char*)argv0;
+  if ((req_argc = split_args(line, req_argv, ARRAY_SIZE(req_argv))) == (unsigned)-1 || req_argc < 3U) {
+    write_str(fd, "fatal: bad request\nfailed 1 -\n");
+    _exit(1);
+  }
+  gettimeofday(&tv_start, NULL);
+  if ((pid = fork()) < 0) fatal0("fork failed");
+  if (pid == 0) {
+    dup2(fd, STDERR_FILENO);  /* Send error messages to the client. */
+    exit(create_image_main(req_argv, -1));
+  }
+  while (waitpid(pid, &wstatus, 0) < 0) {
+    if (errno != EINTR) fatal0("waitpid failed");
+  }
+  gettimeofday(&tv_end, NULL);
+  if (WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0) {
+    sprintf(status, "ok %lu ", (unsigned long)(tv_end.tv_sec - tv_start.tv_sec) * 1000000UL + tv_end.tv_usec - tv_start.tv_usec);
+  } else {
+    sprintf(status, "failed %d ", WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : -1);
+  }
+  write_str(fd, status);
+  write_str(fd, req_argv[req_argc - 1]);
+  write_str(fd, "\n");
+  _exit(0);
+}
+
+/* Listens on the Unix domain socket socket_fn, and creates images as
+ * requested by the clients (see serve_request(...)), each request in a child
+ * process forked from this one. Never returns.
+ */
+static noreturn void run_server(const char *argv0, const char *socket_fn) {
+  struct sockaddr_un sa;
+  struct stat st;
+  int listen_fd, fd;
+  pid_t pid;
+  memset(&sa, '\0', sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  if (strlen(socket_fn) >= sizeof(sa.sun_path)) bad_usage1("socket filename too long", socket_fn);
+  strcpy(sa.sun_path, socket_fn);
+  if (lstat(socket_fn, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      msg_printf("fatal: not removing non-socket file: %s\n", socket_fn);
+      exit(2);
+    }
+    (void)unlink(socket_fn);  /* Remove stale socket. */
+  }
+  if ((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || bind(listen_fd, (struct sockaddr*)&sa, sizeof(sa)) != 0 || listen(listen_fd, 64) != 0) {
+    msg_printf("fatal: error listening on socket: %s\n", socket_fn);
+    exit(2);
+  }
+  signal(SIGCHLD, SIG_IGN);  /* Reap finished children automatically. */
+  signal(SIGPIPE, SIG_IGN);  /* Don't exit if a client disconnects early. */
+  for (;;) {
+    if ((fd = accept(listen_fd, NULL, NULL)) < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      fatal0("accept failed");
+    }
+    fflush(stderr);
+    if ((pid = fork()) == 0) {
+      close(listen_fd);
+      serve_request(fd, argv0);
+    }
+    if (pid < 0) write_str(fd, "fatal: fork failed\nfailed 2 -\n");
+    close(fd);
+  }
+}
+
+/* A delta file (--delta, --apply) starts with a 0x20-byte header, followed
+ * by records, little-endian:
+ *
+ * * header: "BFDELTA2", image size (8 bytes), clusters_sec_ofs (4 bytes),
+ *   cluster_count (4 bytes), fat_fstype (1 byte), log2_sectors_per_cluster
+ *   (1 byte), 2 NUL bytes, CRC32C of the bytes before the cluster area of
+ *   the old image file (4 bytes). --apply checks the latter, so that it
+ *   doesn't modify an image file other than the old one.
+ * * record: first block index (4 bytes), block count (4 bytes), ORed with
+ *   DELTA_ZERO if the blocks are all NUL bytes, followed by the data of the
+ *   blocks (unless DELTA_ZERO). The data of the last block of the image may
+ *   be shorter than DELTA_BLOCK_SIZE.
+ * * end record: 8 NUL bytes.
+ */
+#define DELTA_BLOCK_SIZE 0x1000U
+#define DELTA_ZERO 0x80000000U
+#define DELTA_MAX_RUN_BLOCK_COUNT 0x40U  /* The size of delta_buf. */
+static const char delta_magic[8] = "BFDELTA2";
+static ud delta_buf[DELTA_MAX_RUN_BLOCK_COUNT * DELTA_BLOCK_SIZE / sizeof(ud)];  /* Data of the pending run. Made of ud for the zero check. */
+
+/* The next region containing data in an input image file of --delta, as
+ * reported by SEEK_DATA and SEEK_HOLE (if available): [data_ofs, hole_ofs).
+ */
+struct delta_input {
+  int fd;
+  const char *filename;
+  uint64_t data_ofs, hole_ofs;
+};
+
+/* Returns the offset of the first byte at or after ofs which may contain
+ * data (i.e. which is not in a hole), or size if there is none.
+ */
+static uint64_t get_delta_data_ofs(struct delta_input *dip, uint64_t ofs, uint64_t size) {
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+  int64_t got;
+  if (ofs >= dip->hole_ofs) {
+    if ((got = bakefat_lseek64(dip->fd, ofs, SEEK_DATA)) < 0) {
+      dip->data_ofs = errno == ENXIO ? size : ofs;  /* ENXIO means no more data. Otherwise SEEK_DATA is not supported, assume data. */
+      dip->hole_ofs = size;
+    } else {
+      dip->data_ofs = got;
+      dip->hole_ofs = (got = bakefat_lseek64(dip->fd, got, SEEK_HOLE)) < 0 ? size : (uint64_t)got;
+    }
+  }
+  return ofs < dip->data_ofs ? dip->data_ofs : ofs;
+#else
+  (void)dip; (void)size;
+  return ofs;
+#endif
+}
+
+static void read_delta_input(const struct delta_input *dip, uint64_t ofs, void *buf, unsigned size) {
+  if ((uint64_t)bakefat_lseek64(dip->fd, ofs, SEEK_SET) != ofs || (size_t)read(dip->fd, buf, size) != size) {
+    msg_printf("fatal: error reading image file: %s\n", dip->filename);
+    exit(2);
+  }
+}
+
+static ud crc32c_table[0x100];
+
+#if defined(__GNUC__) && defined(__x86_64__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 8) || defined(__clang__))
+#  define BAKEFAT_CRC32C_SSE42 1  /* The CRC32 instruction of SSE4.2 is used if the CPU supports it. About 10 times faster. */
+static ub is_crc32c_sse42;
+
+__attribute__((__target__("sse4.2")))
+static ud update_crc32c_sse42(ud crc, const char *p, ud size) {
+  for (; size >= 8U; size -= 8U, p += 8) {
+    crc = (ud)__builtin_ia32_crc32di(crc, (uint64_t)gd(p) | (uint64_t)gd(p + 4) << 32);
+  }
+  for (; size; --size) {
+    crc = __builtin_ia32_crc32qi(crc, (ub)*p++);
+  }
+  return crc;
+}
+#endif
+
+static void init_crc32c(void) {
+  ud i, crc;
+  ub j;
+  for (i = 0; i < 0x100U; ++i) {
+    for (crc = i, j = 0; j < 8U; ++j) {
+      crc = (crc >> 1) ^ (crc & 1 ? 0x82f63b78U : 0U);  /* Castagnoli polynomial, reflected. */
+    }
+    crc32c_table[i] = crc;
+  }
+#ifdef BAKEFAT_CRC32C_SSE42
+  is_crc32c_sse42 = __builtin_cpu_supports("sse4.2") != 0;
+#endif
+}
+
+/* Updates crc (initially 0) with the CRC32C of size bytes at p. */
+static ud update_crc32c(ud crc, const char *p, ud size) {
+  crc = ~crc;
+#ifdef BAKEFAT_CRC32C_SSE42
+  if (is_crc32c_sse42) return ~update_crc32c_sse42(crc, p, size);
+#endif
+  for (; size; --size) {
+    crc = (crc >> 8) ^ crc32c_table[(crc ^ (ub)*p++) & 0xffU];
+  }
+  return ~crc;
+}
+
+/* Returns the CRC32C of bytes [ofs, end) of the image file *dip. */
+static ud get_region_crc32c(const struct delta_input *dip, uint64_t ofs, uint64_t end) {
+  ud crc = 0;
+  unsigned want;
+  for (; ofs < end; ofs += want) {
+    want = end - ofs > sizeof(delta_buf) ? (unsigned)sizeof(delta_buf) : (unsigned)(end - ofs);
+    read_delta_input(dip, ofs, delta_buf, want);
+    crc = update_crc32c(crc, (const char*)delta_buf, want);
+  }
+  return crc;
+}
+
+static void write_delta(int fd, const char *filename, const void *buf, unsigned size) {
+  if ((size_t)write(fd, buf, size) != size) {
+    msg_printf("fatal: error writing delta file: %s\n", filename);
+    exit(2);
+  }
+}
+
+/* Writes the record of the pending run of block_count blocks starting at block. */
+static void write_delta_run(int fd, const char *filename, ud block, ud block_count, ub is_zero, uint64_t image_size) {
+  char header[8];
+  uint64_t size = image_size - ((uint64_t)block * DELTA_BLOCK_SIZE);
+  if (block_count == 0) return;
+  ctx->s = header; dd(block); dd(block_count | (is_zero ? DELTA_ZERO : 0U));
+  write_delta(fd, filename, header, 8);
+  if (size > (uint64_t)block_count * DELTA_BLOCK_SIZE) size = (uint64_t)block_count * DELTA_BLOCK_SIZE;
+  if (!is_zero) write_delta(fd, filename, delta_buf, (unsigned)size);
+}
+
+/* Opens a FAT image file for --delta, --apply or --dedupe, and finds its filesystem. */
+static int64_t open_delta_image(struct fat_image *fip, const char *filename, int flags) {
+  int64_t size;
+  if ((ctx->sfd = open(ctx->sfn = filename, flags | O_BINARY)) < 0) {
+    msg_printf("fatal: error opening image file: %s\n", filename);
+    exit(2);
+  }
+  open_fat_image(fip);
+  if ((size = bakefat_lseek64(ctx->sfd, 0, SEEK_END)) < 0) {
+    msg_printf("fatal: error getting size of image file: %s\n", filename);
+    exit(2);
+  }
+  return size;
+}
+
+/* Compares the image files old_fn and new_fn (which must have the same
+ * size and FAT geometry), and writes the blocks of new_fn which differ to
+ * delta_fn. Only the metadata (everything before the cluster area, and
+ * anything after it, such as the VHD footer) and the clusters used in new_fn
+ * are compared; free clusters are skipped using the FAT, and holes in both
+ * files are skipped using SEEK_DATA (where available), so the running time
+ * is proportional to the used data, and the delta size is proportional to
+ * the changed data.
+ */
+static int run_delta(const char *old_fn, const char *new_fn, const char *delta_fn) {
+  struct fat_image old_fi, fi;
+  struct delta_input old_di, new_di;
+  const struct fat_extent *fep;
+  char header[0x20];
+  ud block, block_count, run_block = 0, run_block_count = 0, changed_block_count = 0, *p, *q;
+  uint64_t size, ofs, data_ofs, old_data_ofs, ext_ofs, ext_end;
+  unsigned want;
+  int delta_fd;
+  ub is_zero, run_is_zero = 0;
+  size = (uint64_t)open_delta_image(&old_fi, old_fn, O_RDONLY);
+  old_di.fd = ctx->sfd;
+  if ((uint64_t)open_delta_image(&fi, new_fn, O_RDONLY) != size || fi.clusters_sec_ofs != old_fi.clusters_sec_ofs || fi.cluster_count != old_fi.cluster_count || fi.log2_sectors_per_cluster != old_fi.log2_sectors_per_cluster || fi.fat_fstype != old_fi.fat_fstype) {
+    msg_printf("fatal: image files have different size or FAT geometry: %s and %s\n", old_fn, new_fn);
+    exit(2);
+  }
+  new_di.fd = ctx->sfd;
+  old_di.filename = old_fn;
+  new_di.filename = new_fn;
+  old_di.data_ofs = old_di.hole_ofs = new_di.data_ofs = new_di.hole_ofs = 0;
+  scan_fat_image(&fi);  /* The free clusters of new_fn. */
+  if ((size + DELTA_BLOCK_SIZE - 1U) / DELTA_BLOCK_SIZE > DELTA_ZERO) fatal0("image file too large for delta");
+  block_count = (ud)((size + DELTA_BLOCK_SIZE - 1U) / DELTA_BLOCK_SIZE);
+  if ((delta_fd = open(delta_fn, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666)) < 0) {
+    msg_printf("fatal: error opening delta file: %s\n", delta_fn);
+    exit(2);
+  }
+  init_crc32c();
+  memset(header, '\0', sizeof(header));
+  memcpy(header, delta_magic, 8);
+  ctx->s = header + 8; dd((ud)size); dd((ud)(size >> 16 >> 16)); dd(fi.clusters_sec_ofs); dd(fi.cluster_count); db(fi.fat_fstype); db(fi.log2_sectors_per_cluster); ctx->s += 2;
+  dd(get_region_crc32c(&old_di, 0, (uint64_t)fi.clusters_sec_ofs << 9));
+  write_delta(delta_fd, delta_fn, header, sizeof(header));
+  for (fep = fi.extents, block = 0; block < block_count; ) {
+    ofs = (uint64_t)block * DELTA_BLOCK_SIZE;
+    want = size - ofs > DELTA_BLOCK_SIZE ? DELTA_BLOCK_SIZE : (unsigned)(size - ofs);
+    for (; fep != fi.extents + fi.extent_count; ++fep) {  /* Skip the blocks entirely within a run of free clusters. */
+      ext_end = (uint64_t)(fi.clusters_sec_ofs + ((fep->start_cluster + fep->cluster_count - 2U) << fi.log2_sectors_per_cluster)) << 9;
+      if (ext_end > ofs) break;
+    }
+    if (fep != fi.extents + fi.extent_count) {
+      ext_ofs = (uint64_t)(fi.clusters_sec_ofs + ((fep->start_cluster - 2U) << fi.log2_sectors_per_cluster)) << 9;
+      if (ext_ofs <= ofs && ofs + want <= ext_end) {
+        data_ofs = ext_end;
+        goto skip_to_data_ofs;
+      }
+    }
+    data_ofs = get_delta_data_ofs(&new_di, ofs, size);  /* Skip the blocks which are holes in both files. */
+    if ((old_data_ofs = get_delta_data_ofs(&old_di, ofs, size)) < data_ofs) data_ofs = old_data_ofs;
+    if (data_ofs >= ofs + want) { skip_to_data_ofs:
+      block = (ud)(data_ofs / DELTA_BLOCK_SIZE) > block ? (ud)(data_ofs / DELTA_BLOCK_SIZE) : block + 1U;  /* The last block may be shorter. */
+      continue;
+    }
+    p = delta_buf + (run_block_count * (DELTA_BLOCK_SIZE / sizeof(ud)));
+    read_delta_input(&new_di, ofs, p, want);
+    read_delta_input(&old_di, ofs, ctx->copy_buf, want);
+    if (!is_same_bytes(p, ctx->copy_buf, want)) {
+      ++changed_block_count;
+      memset((char*)p + want, '\0', DELTA_BLOCK_SIZE - want);
+      for (q = p; q != p + DELTA_BLOCK_SIZE / sizeof(ud) && *q == 0; ++q) {}
+      is_zero = q == p + DELTA_BLOCK_SIZE / sizeof(ud);
+      if (run_block_count && (block != run_block + run_block_count || is_zero != run_is_zero)) {  /* Start a new run. */
+        write_delta_run(delta_fd, delta_fn, run_block, run_block_count, run_is_zero, size);
+        memcpy(delta_buf, p, DELTA_BLOCK_SIZE);
+        run_block_count = 0;
+      }
+      if (run_block_count++ == 0) {
+        run_block = block;
+        run_is_zero = is_zero;
+      }
+      if (run_block_count == DELTA_MAX_RUN_BLOCK_COUNT) {  /* delta_buf is full. */
+        write_delta_run(delta_fd, delta_fn, run_block, run_block_count, run_is_zero, size);
+        run_block_count = 0;
+      }
+    }
+    ++block;
+  }
+  write_delta_run(delta_fd, delta_fn, run_block, run_block_count, run_is_zero, size);
+  memset(header, '\0', 8);
+  write_delta(delta_fd, delta_fn, header, 8);  /* End record. */
+#  ifdef DEBUG
+    msg_printf("info: delta: block_count=0x%lx changed_block_count=0x%lx\n", (unsigned long)block_count, (unsigned long)changed_block_count);
+#  else
+    (void)changed_block_count;
+#  endif
+  if (close(delta_fd) != 0) {
+    msg_printf("fatal: error writing delta file: %s\n", delta_fn);
+    exit(2);
+  }
+  close(old_di.fd);
+  close(new_di.fd);
+  return 0;
+}
+
+/* Applies the delta file delta_fn (written by run_delta(...)) to the image
+ * file target_fn in place, which must have the same size and FAT geometry as
+ * the old image file of the delta. Runs of NUL blocks are punched as holes
+ * (see zero_sectors(...)).
+ */
+static int run_apply_delta(const char *delta_fn, const char *target_fn) {
+  struct fat_image fi;
+  struct delta_input di;
+  char header[0x20];
+  ud block, block_count, applied_block_count = 0;
+  uint64_t size, ofs, remaining;
+  unsigned want;
+  int delta_fd;
+  if ((delta_fd = open(delta_fn, O_RDONLY | O_BINARY)) < 0) {
+    msg_printf("fatal: error opening delta file: %s\n", delta_fn);
+    exit(2);
+  }
+  if (read(delta_fd, header, sizeof(header)) != (int)sizeof(header) || !is_same_bytes(header, delta_magic, 8)) {
+    msg_printf("fatal: not a bakefat delta file: %s\n", delta_fn);
+    exit(2);
+  }
+  size = (uint64_t)open_delta_image(&fi, target_fn, O_RDWR);
+  if (size != (gd(header + 8) | (uint64_t)gd(header + 0xc) << 16 << 16) || fi.clusters_sec_ofs != gd(header + 0x10) || fi.cluster_count != gd(header + 0x14) || fi.fat_fstype != (ub)header[0x18] || fi.log2_sectors_per_cluster != (ub)header[0x19]) {
+    msg_printf("fatal: image file has different size or FAT geometry than the delta: %s\n", target_fn);
+    exit(2);
+  }
+  init_crc32c();
+  di.fd = ctx->sfd;
+  di.filename = target_fn;
+  di.data_ofs = di.hole_ofs = 0;
+  if (get_region_crc32c(&di, 0, (uint64_t)fi.clusters_sec_ofs << 9) != gd(header + 0x1c)) {
+    msg_printf("fatal: image file is not the old image file of the delta: %s\n", target_fn);
+    exit(2);
+  }
+  for (;;) {
+    if (read(delta_fd, header, 8) != 8) goto error_reading;
+    if ((block_count = gd(header + 4) & ~DELTA_ZERO) == 0) break;
+    block = gd(header);
+    ofs = (uint64_t)block * DELTA_BLOCK_SIZE;
+    if (ofs >= size || (size - ofs + DELTA_BLOCK_SIZE - 1U) / DELTA_BLOCK_SIZE < block_count) goto error_reading;
+    remaining = size - ofs;
+    if (remaining > (uint64_t)block_count * DELTA_BLOCK_SIZE) remaining = (uint64_t)block_count * DELTA_BLOCK_SIZE;
+    if (gd(header + 4) & DELTA_ZERO) {
+      zero_sectors((ud)(ofs >> 9), (ud)(remaining >> 9));
+    } else {
+      for (; remaining; remaining -= want, ofs += want) {
+        want = remaining > sizeof(ctx->copy_buf) ? (unsigned)sizeof(ctx->copy_buf) : (unsigned)remaining;
+        if ((size_t)read(delta_fd, ctx->copy_buf, want) != want) { error_reading:
+          msg_printf("fatal: error reading delta file: %s\n", delta_fn);
+          exit(2);
+        }
+        write_output_raw(ofs, ctx->copy_buf, want);
+      }
+    }
+    applied_block_count += block_count;
+  }
+#  ifdef DEBUG
+    msg_printf("info: apply: applied_block_count=0x%lx\n", (unsigned long)applied_block_count);
+#  else
+    (void)applied_block_count;
+#  endif
+  flush_sectors();
+  close(delta_fd);
+  if (close(ctx->sfd) != 0) {
+    msg_printf("fatal: error writing image file: %s\n", target_fn);
+    exit(2);
+  }
+  return 0;
+}
+
+#ifdef BAKEFAT_DEDUPE
+/* A 4 KiB block of a --dedupe image file in the hash table. */
+struct dedupe_block {
+  uint64_t hash;
+  ud file_number;  /* 1-based index of the image file, 0 if the slot is empty. */
+  ud block;  /* Byte offset / DELTA_BLOCK_SIZE. */
+};
+
+static struct dedupe_block *ddp_table;  /* Open addressing, linear probing. */
+static ud ddp_table_capacity;  /* A power of 2. */
+static ud ddp_table_count;
+static char **ddp_fns;  /* The image filenames. */
+static int ddp_src_fd = -1;  /* Cached open image file for ddp_src_file_number. */
+static ud ddp_src_file_number;
+static uint64_t ddp_deduped_size, ddp_differs_size;
+
+static uint64_t hash_block(const ud *p) {  /* FNV-1a, 4 bytes at a time. */
+  uint64_t hash = 0xcbf29ce484222325U;
+  const ud *q = p + DELTA_BLOCK_SIZE / sizeof(ud);
+  for (; p != q; ++p) {
+    hash = (hash ^ *p) * 0x100000001b3U;
+  }
+  return hash;
+}
+
+/* Returns the slot of hash in ddp_table: either an existing block with the same hash, or an empty slot. */
+static struct dedupe_block *find_dedupe_block(uint64_t hash) {
+  struct dedupe_block *dbp = ddp_table + ((ud)hash & (ddp_table_capacity - 1U));
+  while (dbp->file_number && dbp->hash != hash) {
+    if (++dbp == ddp_table + ddp_table_capacity) dbp = ddp_table;
+  }
+  return dbp;
+}
+
+static void add_dedupe_block(struct dedupe_block *dbp, uint64_t hash, ud file_number, ud block) {
+  struct dedupe_block *old_table = ddp_table, *dbq;
+  dbp->hash = hash;
+  dbp->file_number = file_number;
+  dbp->block = block;
+  if (++ddp_table_count > ddp_table_capacity >> 1) {  /* Grow the table, keep it at most half full. */
+    if (ddp_table_capacity >= 0x80000000U) fatal0("out of memory");
+    ddp_table = (struct dedupe_block*)alloc_zero((size_t)(ddp_table_capacity << 1) * sizeof(*ddp_table));
+    ddp_table_capacity <<= 1;
+    for (dbq = old_table; dbq != old_table + (ddp_table_capacity >> 1); ++dbq) {
+      if (dbq->file_number) *find_dedupe_block(dbq->hash) = *dbq;
     }
-    for (csp = sectors_per_cluster_presets_b_9; csp != ARRAY_END(sectors_per_cluster_presets_b_9); ++csp) {
-      if (strcasecmp(flag, *csp) == 0) {
-        b = csp - sectors_per_cluster_presets_b_9 + 9 - 9;
-        if (fp.fcp.log2_sectors_per_cluster != (ub)-1 && fp.fcp.log2_sectors_per_cluster != b) { error_conflicting_spc:
-          bad_usage0("conflicting sectors-per-cluster specified");
-        }
-        fp.fcp.log2_sectors_per_cluster = b;
-        goto next_flag;
+    free_memory(old_table);
+  }
+}
+
+/* Makes block_count blocks of the current image file sfd starting at block
+ * share the extents of the same blocks of image file src_file_number
+ * starting at src_block. The kernel compares the data first.
+ */
+static void dedupe_run(ud src_file_number, ud src_block, ud file_number, ud block, ud block_count) {
+  uint64_t fdr_buf[(sizeof(struct file_dedupe_range) + sizeof(struct file_dedupe_range_info) + 7U) / 8U];  /* Aligned for struct file_dedupe_range. */
+  struct file_dedupe_range *fdrp = (struct file_dedupe_range*)fdr_buf;
+  const uint64_t size = (uint64_t)block_count * DELTA_BLOCK_SIZE;
+  int src_fd = ctx->sfd;
+  if (block_count == 0) return;
+  if (src_file_number != file_number) {
+    if (ddp_src_file_number != src_file_number) {
+      if (ddp_src_fd >= 0) close(ddp_src_fd);
+      if ((ddp_src_fd = open(ddp_fns[src_file_number - 1U], O_RDONLY | O_BINARY)) < 0) {
+        msg_printf("fatal: error opening image file: %s\n", ddp_fns[src_file_number - 1U]);
+        exit(2);
       }
+      ddp_src_file_number = src_file_number;
     }
-    for (csp = sectors_per_cluster_presets_s_9; csp != ARRAY_END(sectors_per_cluster_presets_s_9); ++csp) {
-      if (strcasecmp(flag, *csp) == 0) { if (fp.fcp.log2_sectors_per_cluster != (ub)-1) goto error_conflicting_spc; fp.fcp.log2_sectors_per_cluster = csp - sectors_per_cluster_presets_s_9 + 9 - 9; goto next_flag; }
+    src_fd = ddp_src_fd;
+  }
+  memset(fdr_buf, '\0', sizeof(fdr_buf));
+  fdrp->src_offset = (uint64_t)src_block * DELTA_BLOCK_SIZE;
+  fdrp->src_length = size;
+  fdrp->dest_count = 1;
+  fdrp->info[0].dest_fd = ctx->sfd;
+  fdrp->info[0].dest_offset = (uint64_t)block * DELTA_BLOCK_SIZE;
+  if (ioctl(src_fd, FIDEDUPERANGE, fdrp) != 0 || fdrp->info[0].status < 0) {
+    msg_printf("fatal: error deduplicating image file: %s: %s\n", strerror(fdrp->info[0].status < 0 ? -fdrp->info[0].status : errno), ctx->sfn);
+    exit(2);
+  }
+  if (fdrp->info[0].status == FILE_DEDUPE_RANGE_DIFFERS) {
+    ddp_differs_size += size;  /* Hash collision, or the file has been modified. */
+  } else {
+    ddp_deduped_size += fdrp->info[0].bytes_deduped;
+  }
+}
+
+/* Checks that the host filesystem supports FIDEDUPERANGE between the first
+ * image file and each of fns (NULL-terminated), using requests of 0 bytes,
+ * so that an unsupported filesystem (such as ext4) fails with a single
+ * error before any image file is modified.
+ */
+static void check_dedupe_support(char **fns) {
+  uint64_t fdr_buf[(sizeof(struct file_dedupe_range) + sizeof(struct file_dedupe_range_info) + 7U) / 8U];  /* Aligned for struct file_dedupe_range. */
+  struct file_dedupe_range *fdrp = (struct file_dedupe_range*)fdr_buf;
+  int src_fd, fd;
+  char **fnp;
+  if ((src_fd = open(fns[0], O_RDONLY | O_BINARY)) < 0) {
+    msg_printf("fatal: error opening image file: %s\n", fns[0]);
+    exit(2);
+  }
+  for (fnp = fns; *fnp; ++fnp) {
+    if ((fd = open(*fnp, O_RDWR | O_BINARY)) < 0) {  /* FIDEDUPERANGE needs the destination open for writing. */
+      msg_printf("fatal: error opening image file: %s\n", *fnp);
+      exit(2);
     }
-    for (csp = sectors_per_cluster_presets_k_10; csp != ARRAY_END(sectors_per_cluster_presets_k_10); ++csp) {
-      if (strcasecmp(flag, *csp) == 0) { if (fp.fcp.log2_sectors_per_cluster != (ub)-1) goto error_conflicting_spc; fp.fcp.log2_sectors_per_cluster = csp - sectors_per_cluster_presets_k_10 + 10 - 9; goto next_flag; }
+    memset(fdr_buf, '\0', sizeof(fdr_buf));
+    fdrp->dest_count = 1;
+    fdrp->info[0].dest_fd = fd;
+    if (ioctl(src_fd, FIDEDUPERANGE, fdrp) != 0 || fdrp->info[0].status < 0) {
+      msg_printf("fatal: host filesystem doesn't support deduplication (e.g. Btrfs and XFS do, ext4 doesn't): %s: %s\n", strerror(fdrp->info[0].status < 0 ? -fdrp->info[0].status : errno), *fnp);
+      exit(2);
     }
-    if (strcasecmp(flag, "FAT12") == 0) {
-      if (fp.fat_fstype && fp.fat_fstype != 12) { error_conflicting_fat_fstype:
-        bad_usage0("conflicting FAT type flags specified");
-      }
-      fp.fat_fstype = 12;
-    } else if (strcasecmp(flag, "FAT16") == 0) {
-      if (fp.fat_fstype && fp.fat_fstype != 16) goto error_conflicting_fat_fstype;
-      fp.fat_fstype = 16;
-    } else if (strcasecmp(flag, "FAT32") == 0) {
-      if (fp.fat_fstype && fp.fat_fstype != 32) goto error_conflicting_fat_fstype;
-      fp.fat_fstype = 32;
-    } else if (strncasecmp(flag, "RDEC=", 5) == 0) {
-      if (parse_ud(flag + 5, &u) != PARSEINT_OK) goto error_invalid_integer;
-      if (u - 1U > 0xfff0U - 1U) bad_usage0("root directory entry count must be between 1 and 65520");
-      if (fp.fcp.rootdir_entry_count && fp.fcp.rootdir_entry_count != u) {
-        bad_usage0("conflicting root directory entry counts specified");
+    close(fd);
+  }
+  close(src_fd);
+}
+
+#define DEDUPE_MAX_RUN_BLOCK_COUNT 0x1000U  /* 16 MiB, Btrfs doesn't dedupe more at once. */
+
+/* Deduplicates the used clusters of the image files fns (NULL-terminated)
+ * on the host filesystem (e.g. Btrfs or XFS), using FIDEDUPERANGE: each 4
+ * KiB block fully within used clusters is hashed, and if the same hash has
+ * been seen before (in any of the image files, at any offset), the block
+ * is deduplicated with the first one. Consecutive blocks matching
+ * consecutive blocks are deduplicated by a single ioctl(2) call. Blocks of
+ * NUL bytes and free clusters are skipped. Memory usage is proportional to
+ * the number of distinct blocks. The reported size is what the kernel
+ * reports as deduplicated, including blocks which were already shared, so
+ * it is an upper bound of the disk space reclaimed.
+ */
+static int run_dedupe(char **fns) {
+  struct fat_image fi;
+  struct delta_input di;
+  const struct fat_extent *fep;
+  struct dedupe_block *dbp;
+  uint64_t hash, ofs, data_ofs, cluster_end_ofs, total_deduped_size = 0;
+  ud file_number, block, block_end, run_src_file_number = 0, run_src_block = 0, run_block = 0, run_block_count = 0;
+  const ud *p;
+  check_dedupe_support(fns);
+  ddp_fns = fns;
+  ddp_table_capacity = 0x10000U;
+  ddp_table = (struct dedupe_block*)alloc_zero((size_t)ddp_table_capacity * sizeof(*ddp_table));
+  for (file_number = 1; fns[file_number - 1U]; ++file_number) {
+    open_delta_image(&fi, di.filename = fns[file_number - 1U], O_RDWR);  /* FIDEDUPERANGE needs the destination open for writing. */
+    di.fd = ctx->sfd;
+    di.data_ofs = di.hole_ofs = 0;
+    scan_fat_image(&fi);
+    cluster_end_ofs = (uint64_t)(fi.clusters_sec_ofs + (fi.cluster_count << fi.log2_sectors_per_cluster)) << 9;
+    block = (ud)((((uint64_t)fi.clusters_sec_ofs << 9) + DELTA_BLOCK_SIZE - 1U) / DELTA_BLOCK_SIZE);
+    block_end = (ud)(cluster_end_ofs / DELTA_BLOCK_SIZE);
+    ddp_deduped_size = ddp_differs_size = 0;
+    for (fep = fi.extents; block < block_end; ++block) {
+      ofs = (uint64_t)block * DELTA_BLOCK_SIZE;
+      for (; fep != fi.extents + fi.extent_count && ((uint64_t)(fi.clusters_sec_ofs + ((fep->start_cluster + fep->cluster_count - 2U) << fi.log2_sectors_per_cluster)) << 9) <= ofs; ++fep) {}
+      if (fep != fi.extents + fi.extent_count && ((uint64_t)(fi.clusters_sec_ofs + ((fep->start_cluster - 2U) << fi.log2_sectors_per_cluster)) << 9) < ofs + DELTA_BLOCK_SIZE) {
+        ofs = (uint64_t)(fi.clusters_sec_ofs + ((fep->start_cluster + fep->cluster_count - 2U) << fi.log2_sectors_per_cluster)) << 9;  /* Skip the free run. */
+        goto skip_to_ofs;
       }
-      fp.fcp.rootdir_entry_count = u;
-    } else if (strncasecmp(flag, "RSC=", 4) == 0) {
-      if (parse_ud(flag + 4, &u) != PARSEINT_OK) goto error_invalid_integer;
-      if (u - 1U > 0xffffU - 1U) bad_usage0("reserved sector count must be between 1 and 65535");
-      if (fp.reserved_sector_count && fp.reserved_sector_count != u) {
-        bad_usage0("conflicting reserved sector counts specified");
+      if ((data_ofs = get_delta_data_ofs(&di, ofs, cluster_end_ofs)) >= ofs + DELTA_BLOCK_SIZE) {  /* Skip the hole. */
+        ofs = data_ofs;
+       skip_to_ofs:
+        dedupe_run(run_src_file_number, run_src_block, file_number, run_block, run_block_count);
+        run_block_count = 0;
+        if (ofs > (uint64_t)(block + 1U) * DELTA_BLOCK_SIZE) block = (ud)((ofs + DELTA_BLOCK_SIZE - 1U) / DELTA_BLOCK_SIZE) - 1U;  /* ++block follows. */
+        continue;
       }
-      fp.reserved_sector_count = u;
-    } else if (strncasecmp(flag, "VID=", 4) == 0) {
-      if (parse_volume_id(flag + 4, &u) != PARSEINT_OK) bad_usage1("invalid FAT volume ID in flag", flag);
-      if (had_volume_id && fp.volume_id != u) bad_usage0("conflicting FAT volume IDs specified");
-      fp.volume_id = u;
-      had_volume_id = 1;
-    } else if (strncasecmp(flag, "FC=", 3) == 0) {
-      if (parse_ud(flag + 3, &u) != PARSEINT_OK) { error_invalid_integer:
-        bad_usage1("invalid integer in flag", flag);
+      read_delta_input(&di, ofs, ctx->copy_buf, DELTA_BLOCK_SIZE);
+      for (p = ctx->copy_buf; p != ctx->copy_buf + DELTA_BLOCK_SIZE / sizeof(ud) && *p == 0; ++p) {}
+      if (p == ctx->copy_buf + DELTA_BLOCK_SIZE / sizeof(ud)) {  /* Don't share blocks of NUL bytes. */
+        dbp = NULL;
+      } else if (!(dbp = find_dedupe_block(hash = hash_block(ctx->copy_buf)))->file_number) {
+        add_dedupe_block(dbp, hash, file_number, block);
+        dbp = NULL;
       }
-      if (u - 1U > 2U - 1U) bad_usage0("FAT FAT count must be 1 or 2");
-      if (fp.fat_count && fp.fat_count != u) { error_conflicting_fat_count:
-        bad_usage0("conflicting FAT FAT counts specified");
+      if (run_block_count && (!dbp || dbp->file_number != run_src_file_number || dbp->block != run_src_block + run_block_count || run_block_count == DEDUPE_MAX_RUN_BLOCK_COUNT)) {
+        dedupe_run(run_src_file_number, run_src_block, file_number, run_block, run_block_count);
+        run_block_count = 0;
       }
-      fp.fat_count = u;
-    } else if (strcasecmp(flag, "1FAT") == 0 || strcasecmp(flag, "1F") == 0) {
-      if (fp.fat_count && fp.fat_count != 1) goto error_conflicting_fat_count;
-      fp.fat_count = 1;
-    } else if (strcasecmp(flag, "2FATS") == 0 ||strcasecmp(flag, "2F") == 0) {
-      if (fp.fat_count && fp.fat_count != 2) goto error_conflicting_fat_count;
-      fp.fat_count = 2;
-    } else if (strcasecmp(flag, "NOVHD") == 0) {
-      if (fp.vhd_mode && fp.vhd_mode != VHD_NOVHD) { error_conflicting_vhd_mode:
-        bad_usage0("conflicting VHD values specified");
+      if (dbp && run_block_count++ == 0) {
+        run_src_file_number = dbp->file_number;
+        run_src_block = dbp->block;
+        run_block = block;
       }
-      fp.vhd_mode = VHD_NOVHD;
-    } else if (strcasecmp(flag, "VHD") == 0) {
-      if (fp.vhd_mode && fp.vhd_mode != VHD_FIXED) goto error_conflicting_vhd_mode;
-      fp.vhd_mode = VHD_FIXED;
-    } else if (strcasecmp(flag, "DOS3") == 0 || strcasecmp(flag, "DOS3.3") == 0) {
-      fp.os_compat |= OSC_DOS3;
-    } else if (strcasecmp(flag, "DOS4") == 0) {
-      fp.os_compat |= OSC_DOS4;
-    } else if (strcasecmp(flag, "DOS5") == 0 || strcasecmp(flag, "DOS6") == 0) {
-      fp.os_compat |= OSC_DOS5_6;
-    } else if (strcasecmp(flag, "DOS7") == 0) {
-      fp.os_compat |= OSC_MSDOS70 | OSC_MSDOS71_8 | OSC_PCDOS70 | OSC_PCDOS71;
-    } else if (strcasecmp(flag, "DOS7.0") == 0) {
-      fp.os_compat |= OSC_MSDOS70 | OSC_PCDOS70;
-    } else if (strcasecmp(flag, "DOS7.1") == 0) {
-      fp.os_compat |= OSC_MSDOS71_8 | OSC_PCDOS71;
-    } else if (strcasecmp(flag, "PCDOS7.0") == 0) {
-      fp.os_compat |= OSC_PCDOS70;
-    } else if (strcasecmp(flag, "PCDOS7.1") == 0) {
-      fp.os_compat |= OSC_PCDOS71;
-    } else if (strcasecmp(flag, "MSDOS7.0") == 0 || strcasecmp(flag, "WIN95A") == 0 || strcasecmp(flag, "WIN95RTM") == 0) {
-      fp.os_compat |= OSC_MSDOS70;
-    } else if (strcasecmp(flag, "MSDOS7.1") == 0 || strcasecmp(flag, "DOS8") == 0 || strcasecmp(flag, "WIN95OSR2") == 0 || strcasecmp(flag, "WIN98") == 0 || strcasecmp(flag, "WINME") == 0) {
-      fp.os_compat |= OSC_MSDOS71_8;
-    } else {
-      msg_printf("fatal: unknown command-line flag: %s\n", flag);
-      exit(1);
     }
-   next_flag: ;
+    dedupe_run(run_src_file_number, run_src_block, file_number, run_block, run_block_count);
+    run_block_count = 0;
+    msg_printf("dedupe: bytes deduplicated: %lu KiB (%lu KiB differed): %s\n", (unsigned long)(ddp_deduped_size >> 10), (unsigned long)(ddp_differs_size >> 10), ctx->sfn);
+    total_deduped_size += ddp_deduped_size;
+    free_memory(fi.extents);
+    close(ctx->sfd);
   }
-  if (!*argfn) bad_usage0("output filename not specified");
-  if (argfn[1]) bad_usage0("multiple output filenames specified");
-  sfn = *argfn;
+  if (ddp_src_fd >= 0) close(ddp_src_fd);
+  free_memory(ddp_table);
+  msg_printf("dedupe: bytes deduplicated in total (including already shared ones): %lu KiB, distinct blocks: %lu\n", (unsigned long)(total_deduped_size >> 10), (unsigned long)ddp_table_count);
+  return 0;
+}
+#endif
 
-  if (!had_volume_id) fp.volume_id = 0x1234abcd;
-  if (!fp.fat_fstype) {  /* Autodetect. */
-    fp.fat_fstype = log2_size < 0 ? 12 : log2_size <= 31 ? 16 : 32;  /* Use FAT16 for up to 2 GiB, use FAT32 for anything larger. FAT16 doesn't support more than 2 GiB. */
-  }
-  if (!fp.fat_count) {  /* Autodetect. */
-    if ((fp.fat_count = fp.default_fat_count) == 0) {
-      fp.fat_count = fp.fat_fstype == 32 ? 1 : 2;  /* 2 for compatibility with MS-DOS <=6.22. */
+/* A manifest file (--manifest, --verify) contains the CRC32C of each used
+ * cluster of an image file, little-endian:
+ *
+ * * header: "BFCRC32C", image size (8 bytes), clusters_sec_ofs (4 bytes),
+ *   cluster_count (4 bytes), fat_fstype (1 byte), log2_sectors_per_cluster
+ *   (1 byte), 2 NUL bytes, CRC32C of the bytes before the cluster area (4
+ *   bytes), CRC32C of the bytes after the cluster area (4 bytes), 8 NUL
+ *   bytes.
+ * * record: first cluster (4 bytes), cluster count (4 bytes, at most
+ *   MANIFEST_MAX_RUN_CLUSTER_COUNT), followed by the CRC32C of each cluster
+ *   (4 bytes each).
+ * * end record: 8 NUL bytes.
+ */
+#define MANIFEST_HEADER_SIZE 0x28U
+#define MANIFEST_MAX_RUN_CLUSTER_COUNT (sizeof(delta_buf) >> 9)
+static const char manifest_magic[8] = "BFCRC32C";
+static ud manifest_crcs[MANIFEST_MAX_RUN_CLUSTER_COUNT];
+
+/* Computes the CRC32C of cluster_count (at most
+ * MANIFEST_MAX_RUN_CLUSTER_COUNT) clusters starting at cluster to
+ * manifest_crcs. Clusters in holes are not read.
+ */
+static void compute_manifest_crcs(const struct fat_image *fip, struct delta_input *dip, uint64_t size, ud cluster, ud cluster_count, ud zero_cluster_crc) {
+  const unsigned cluster_size = 0x200U << fip->log2_sectors_per_cluster;
+  const uint64_t ofs = (uint64_t)(fip->clusters_sec_ofs + ((cluster - 2U) << fip->log2_sectors_per_cluster)) << 9;
+  const uint64_t end = ofs + (uint64_t)cluster_count * cluster_size;
+  ud i;
+  if (cluster_count > (sizeof(delta_buf) >> 9 >> fip->log2_sectors_per_cluster)) fatal0("ASSERT_MANIFEST_RUN_TOO_LONG");
+  if (get_delta_data_ofs(dip, ofs, size) >= end) {  /* All in a hole. */
+    for (i = 0; i < cluster_count; ++i) {
+      manifest_crcs[i] = zero_cluster_crc;
     }
-  }
-  if (!fp.vhd_mode) fp.vhd_mode = (log2_size < 0) ? VHD_NOVHD : VHD_FIXED;  /* Autodetect. */
-  if (!fp.reserved_sector_count) {  /* Autodetect. */
-    if ((fp.reserved_sector_count = fp.default_reserved_sector_count) == 0) {
-      fp.reserved_sector_count = fp.fat_fstype == 32 ? 17 : 1;  /* 17 for compatibility with the Windows XP FAT32 boot sector code (written during Windows XP installation), which loads additional boot code from sector 8. */
+  } else {
+    read_delta_input(dip, ofs, delta_buf, (unsigned)(end - ofs));
+    for (i = 0; i < cluster_count; ++i) {
+      manifest_crcs[i] = update_crc32c(0, (const char*)delta_buf + i * cluster_size, cluster_size);
     }
   }
-  if (!fp.fcp.rootdir_entry_count) {
-    if ((fp.fcp.rootdir_entry_count = fp.default_rootdir_entry_count) == 0) {  /* Autodetect. */
-      fp.fcp.rootdir_entry_count = 128;  /* !! Maybe 256? Look at alignment. */
-      if (fp.os_compat & OSC_DOS3) fp.fcp.rootdir_entry_count = 512;  /* For compatibility with DOS 3.30. It can read and write a filesystem with another value, but it can't boot from it. */
+}
+
+/* Opens the image file filename for --manifest or --verify, builds its
+ * free-cluster map, and fills the header of its manifest to header. Returns
+ * the CRC32C of a cluster of NUL bytes.
+ */
+static ud open_manifest_image(struct fat_image *fip, struct delta_input *dip, uint64_t *size_ptr, const char *filename, char *header) {
+  const uint64_t size = (uint64_t)open_delta_image(fip, filename, O_RDONLY);
+  const uint64_t cluster_area_end = (uint64_t)(fip->clusters_sec_ofs + (fip->cluster_count << fip->log2_sectors_per_cluster)) << 9;
+  if (cluster_area_end > size) {
+    msg_printf("fatal: image file too short for its filesystem: %s\n", filename);
+    exit(2);
+  }
+  init_crc32c();
+  dip->fd = ctx->sfd;
+  dip->filename = filename;
+  dip->data_ofs = dip->hole_ofs = 0;
+  scan_fat_image(fip);
+  memset(header, '\0', MANIFEST_HEADER_SIZE);
+  memcpy(header, manifest_magic, 8);
+  ctx->s = header + 8; dd((ud)size); dd((ud)(size >> 16 >> 16)); dd(fip->clusters_sec_ofs); dd(fip->cluster_count); db(fip->fat_fstype); db(fip->log2_sectors_per_cluster); ctx->s += 2;
+  dd(get_region_crc32c(dip, 0, (uint64_t)fip->clusters_sec_ofs << 9));
+  dd(get_region_crc32c(dip, cluster_area_end, size));
+  *size_ptr = size;
+  memset(delta_buf, '\0', 0x200U << fip->log2_sectors_per_cluster);
+  return update_crc32c(0, (const char*)delta_buf, 0x200U << fip->log2_sectors_per_cluster);
+}
+
+static void write_manifest(int fd, const char *filename, const void *buf, unsigned size) {
+  if ((size_t)write(fd, buf, size) != size) {
+    msg_printf("fatal: error writing manifest file: %s\n", filename);
+    exit(2);
+  }
+}
+
+/* Writes records [first_record, end_record) of the manifest of *fip to fd,
+ * at their offset in the manifest file. Returns the
+ * total number of records to *record_count_ptr, and the offset of the end
+ * record. With first_record == end_record, it only counts.
+ */
+static uint64_t write_manifest_records(const struct fat_image *fip, struct delta_input *dip, uint64_t size, ud zero_cluster_crc, int fd, const char *filename, ud first_record, ud end_record, ud *record_count_ptr) {
+  const struct fat_extent *fep, *fep_end = fip->extents + fip->extent_count;
+  const ud max_count = sizeof(delta_buf) >> 9 >> fip->log2_sectors_per_cluster;
+  char header[8];
+  uint64_t ofs = MANIFEST_HEADER_SIZE;
+  ud cluster, cluster_end, count, i, record = 0;
+  for (fep = fip->extents, cluster = 2; ; cluster = fep->start_cluster + fep->cluster_count, ++fep) {
+    cluster_end = fep != fep_end ? fep->start_cluster : fip->cluster_count + 2U;  /* The used run is [cluster, cluster_end). */
+    for (; cluster < cluster_end; cluster += count, ofs += 8U + (count << 2), ++record) {
+      count = cluster_end - cluster > max_count ? max_count : cluster_end - cluster;
+      if (record < first_record || record >= end_record) continue;
+      if (record == first_record && (uint64_t)bakefat_lseek64(fd, ofs, SEEK_SET) != ofs) fatal0("error seeking in manifest file");
+      compute_manifest_crcs(fip, dip, size, cluster, count, zero_cluster_crc);
+      ctx->s = header; dd(cluster); dd(count);
+      write_manifest(fd, filename, header, 8);
+      for (ctx->s = (char*)delta_buf, i = 0; i < count; ++i) {
+        dd(manifest_crcs[i]);
+      }
+      write_manifest(fd, filename, delta_buf, (unsigned)count << 2);
     }
+    if (fep == fep_end) break;
   }
-  fp.fcp.rootdir_entry_count = (fp.fcp.rootdir_entry_count + 0xf) & ~0xf;  /* Round up to a multiple of 16. */
-  if (fp.fat_fstype == 32) fp.fcp.rootdir_entry_count = 0;
-  if (fp.fcp.log2_sectors_per_cluster == (ub)-1) fp.fcp.log2_sectors_per_cluster = fp.default_log2_sectors_per_cluster;  /* Can still be (ub)-1 (unspecified) for non-floppy. */
-  if (fp.os_compat & (OSC_DOS3 | OSC_DOS4 | OSC_DOS5_6 | OSC_MSDOS70 | OSC_PCDOS70)) {
-    if (fp.fat_count != 2) bad_usage0("OS compatibility requires 2FATS");
+  *record_count_ptr = record;
+  return ofs;
+}
+
+/* Forks job_count child processes for --manifest or --verify. Each child
+ * reopens the image file (to dip->fd) and the manifest file (to
+ * *manifest_fd_ptr, with manifest_flags), so that it has its own file
+ * offsets. Returns the job index (0 ... job_count - 1) in the child, and
+ * job_count in the parent.
+ */
+static ud fork_manifest_jobs(struct delta_input *dip, const char *image_fn, int *manifest_fd_ptr, const char *manifest_fn, int manifest_flags, ud job_count) {
+  ud job;
+  pid_t pid;
+  fflush(stderr);
+  for (job = 0; job < job_count; ++job) {
+    if ((pid = fork()) < 0) fatal0("fork failed");
+    if (pid == 0) {
+      close(dip->fd);  /* The file offset is shared with the parent and the other children. */
+      close(*manifest_fd_ptr);
+      if ((dip->fd = ctx->sfd = open(image_fn, O_RDONLY | O_BINARY)) < 0) {
+        msg_printf("fatal: error opening image file: %s\n", image_fn);
+        _exit(2);
+      }
+      if ((*manifest_fd_ptr = open(manifest_fn, manifest_flags | O_BINARY)) < 0) {
+        msg_printf("fatal: error opening manifest file: %s\n", manifest_fn);
+        _exit(2);
+      }
+      dip->data_ofs = dip->hole_ofs = 0;
+      break;
+    }
   }
-  if (fp.os_compat & (OSC_DOS3 | OSC_DOS4)) {
-    if (fp.reserved_sector_count != 1) bad_usage0("OS compatibility requires RSC=1");
+  return job;
+}
+
+/* Waits for the job_count child processes forked by fork_manifest_jobs(...).
+ * Returns the number of failed ones.
+ */
+static ud wait_manifest_jobs(ud job_count) {
+  ud failed_count = 0;
+  int wstatus;
+  pid_t pid;
+  for (; job_count; --job_count) {
+    while ((pid = wait(&wstatus)) < 0 && errno == EINTR) {}
+    if (pid < 0) fatal0("wait failed");
+    if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) ++failed_count;
   }
-  if (fp.os_compat & (OSC_DOS3 | OSC_DOS4 | OSC_DOS5_6 | OSC_MSDOS70 | OSC_PCDOS70 | OSC_PCDOS71)) {
-    if (fp.fcp.log2_sectors_per_cluster > 0U && (fp.fcp.sector_count == (160U << 1) || fp.fcp.sector_count == (180U << 1) || (fp.fcp.sector_count == (1440U << 1) && (fp.os_compat & (OSC_DOS3 | OSC_DOS4))))) bad_usage0("OS compatibility requires cluster size 512B for this floppy size");
-    if (fp.fcp.log2_sectors_per_cluster > 1U && (fp.os_compat & OSC_DOS3)) bad_usage0("OS compatibility requires floppy cluster size 512B or 1K");
-    if (fp.fcp.log2_sectors_per_cluster > 5U && (fp.os_compat & (OSC_DOS4 | OSC_DOS5_6 | OSC_PCDOS70 | OSC_PCDOS71))) bad_usage0("OS compatibility requires floppy cluster size at most 16K");
+  return failed_count;
+}
+
+/* Writes the manifest of the image file image_fn to manifest_fn: the
+ * CRC32C of the metadata and of each used cluster (free clusters are
+ * skipped using the FAT, holes are not read), so that --verify can check a
+ * copy of the image in time proportional to the used data. The records are
+ * split to at most job_count contiguous parts, each computed in a child
+ * process, reading the image file with its own file descriptor and writing
+ * the manifest file at the precomputed offset.
+ */
+static int run_manifest(const char *image_fn, const char *manifest_fn, ud job_count) {
+  struct fat_image fi;
+  struct delta_input di;
+  char header[MANIFEST_HEADER_SIZE];
+  uint64_t size, end_ofs;
+  ud zero_cluster_crc, record_count, job;
+  int manifest_fd;
+  zero_cluster_crc = open_manifest_image(&fi, &di, &size, image_fn, header);
+  if ((manifest_fd = open(manifest_fn, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666)) < 0) {
+    msg_printf("fatal: error opening manifest file: %s\n", manifest_fn);
+    exit(2);
   }
-  if (log2_size < 0) {  /* Floppy FAT12. */
-    if (fp.fat_fstype != 12) bad_usage0("only FAT12 is supported for floppy");  /* Because boot code is not implemented. */
-    if (fp.os_compat & (OSC_DOS3 | OSC_DOS4)) {
-      if (fp.fcp.sector_count == (2880U << 1)) bad_usage0("OS compatibility conflicts with 2880K; use e.g. 1440K instead");
-    }
-    if (fp.fcp.rootdir_entry_count != fp.default_rootdir_entry_count ||
-        fp.fcp.log2_sectors_per_cluster != fp.default_log2_sectors_per_cluster ||
-        fp.reserved_sector_count != fp.default_reserved_sector_count ||
-        fp.fat_count != fp.default_fat_count ||
-        0) { /* Recalculate (fp.fcp.cluster_count, fp.fcp.sectors_per_fat). */
-#    if DEBUG
-      if (!fp.fcp.sector_count) fatal0("ASSERT_SECTORS");
-#    endif
-      fp.fcp.sectors_per_fat = 0;
-      do {
-        old_sectors_per_fat = fp.fcp.sectors_per_fat;
-        u = fp.hidden_sector_count + fp.reserved_sector_count + ((ud)fp.fcp.sectors_per_fat << (fp.fat_count - 1U)) + (fp.fcp.rootdir_entry_count >> 4);
-        if (fp.fcp.sector_count <= u) goto fatal_no_clusters;
-        fp.fcp.cluster_count = (fp.fcp.sector_count - u) >> fp.fcp.log2_sectors_per_cluster;
-        if (fp.fcp.cluster_count == 0) goto fatal_no_clusters;
-        if ((sd)fp.fcp.cluster_count <= 0) bad_usage0("FAT12 filesystem too small, no space for clusters");
-        fp.fcp.sectors_per_fat = ((((fp.fcp.cluster_count + 2) * 3 + 1) >> 1) + 0x1ff) >> 9;  /* FAT12. */
-      } while (fp.fcp.sectors_per_fat != old_sectors_per_fat);  /* Repeat until a fixed point is found for (fp.fcp.cluster_count, fp.fcp.sectors_per_fat). */
-      if (fp.fcp.cluster_count > 0xff4) bad_usage0("floppy FAT12 cluster size too small to this floppy size, specify at least 1K");  /* This happens with: 2880K 512B */
-    }
-    fp.geometry_sector_count = fp.fcp.sector_count;
-#    ifdef DEBUG
-      fp.cylinder_count = fp.geometry_sector_count / ((ud)fp.fcp.head_count * fp.fcp.sectors_per_track);
-#    endif
+  write_manifest(manifest_fd, manifest_fn, header, MANIFEST_HEADER_SIZE);
+  end_ofs = write_manifest_records(&fi, &di, size, zero_cluster_crc, manifest_fd, manifest_fn, 0, 0, &record_count);
+  if (job_count > record_count) job_count = record_count;
+  if (job_count > 1U) {
+    if ((job = fork_manifest_jobs(&di, image_fn, &manifest_fd, manifest_fn, O_WRONLY, job_count)) < job_count) {
+      write_manifest_records(&fi, &di, size, zero_cluster_crc, manifest_fd, manifest_fn, (ud)((uint64_t)record_count * job / job_count), (ud)((uint64_t)record_count * (job + 1U) / job_count), &record_count);
+      _exit(close(manifest_fd) != 0 ? 2 : 0);
+    }
+    if (wait_manifest_jobs(job_count) != 0) {
+      msg_printf("fatal: error computing manifest: %s\n", manifest_fn);
+      exit(2);
+    }
+    if ((uint64_t)bakefat_lseek64(manifest_fd, end_ofs, SEEK_SET) != end_ofs) fatal0("error seeking in manifest file");
   } else {
-    fp.hidden_sector_count = 63U;  /* Partition 1 starts here, after the MBR and the rest of cylinder 0, head 0. Must be a multiple of sectors_per_track for MS-DOS <=6.x */
-    fp.fcp.media_descriptor = 0xf8;  /* 0xf8 for HDD. 0xf8 is also used by some nonstandard floppy disk formats. */
-    if (!log2_size) bad_usage0("image size not specified");
-#    ifdef DEBUG
-      if (log2_size < 21) fatal0("ASSERT_IMAGE_TOO_SMALL");
-      if (log2_size > 43) fatal0("ASSERT_IMAGE_TOO_LARGE");
-#    endif
-    if (fp.fat_fstype == 12) {
-      bad_usage0("FAT12 is not supported for hard disk");  /* Because boot code is not implemented. */
-    } else if (fp.fat_fstype == 16) {
-      /* No need to check `if (log2_size < 12 + 9) bad_usage0("FAT16 too small");', because we we have log_size >= 21 (2M) here, we don't support smaller values. */
-      if (log2_size > 16 + 15) bad_usage0("FAT16 too large, maximum is FAT16 2G");
-    } else /* if (fp.fat_fstype == 32) */ {
-      if (log2_size < 16 + 9) bad_usage0("FAT32 too small, minimum is FAT32 32M");
-      /* No need to check `if (log2_size > 28 + 15) bad_usage0("FAT32 too large");', because we we have log_size <= 41 (2T) <= 43 here, we don't support larger values. */
+    write_manifest_records(&fi, &di, size, zero_cluster_crc, manifest_fd, manifest_fn, 0, record_count, &record_count);
+  }
+  memset(header, '\0', 8);
+  write_manifest(manifest_fd, manifest_fn, header, 8);  /* End record. */
+  if (close(manifest_fd) != 0) {
+    msg_printf("fatal: error writing manifest file: %s\n", manifest_fn);
+    exit(2);
+  }
+  close(ctx->sfd);
+  return 0;
+}
+
+/* Reads the header of the next record of the manifest file fd to header (8
+ * bytes), and checks it against *fip. Returns its cluster count, or 0 for
+ * the end record.
+ */
+static ud read_manifest_record_header(const struct fat_image *fip, int fd, const char *filename, char *header) {
+  ud cluster, count;
+  if (read(fd, header, 8) == 8) {
+    cluster = gd(header);
+    if ((count = gd(header + 4)) == 0 || (cluster - 2U < fip->cluster_count && count <= fip->cluster_count + 2U - cluster && count <= (sizeof(delta_buf) >> 9 >> fip->log2_sectors_per_cluster))) return count;
+  }
+  msg_printf("fatal: error reading manifest file: %s\n", filename);
+  exit(2);
+}
+
+/* Checks record_count records of the manifest file fd (starting at its file
+ * offset) against the image. Reports each mismatching cluster (up to a
+ * limit). Adds the number of mismatching and checked clusters to
+ * counts[0] and counts[1].
+ */
+static void verify_manifest_records(const struct fat_image *fip, struct delta_input *dip, uint64_t size, ud zero_cluster_crc, int fd, const char *manifest_fn, const char *image_fn, ud record_count, ud *counts) {
+  char header[8];
+  ud expected_crcs[MANIFEST_MAX_RUN_CLUSTER_COUNT];
+  ud cluster, count, i;
+  for (; record_count; --record_count) {
+    if ((count = read_manifest_record_header(fip, fd, manifest_fn, header)) == 0) break;  /* Can't happen, run_verify(...) has counted the records. */
+    cluster = gd(header);
+    if ((size_t)read(fd, expected_crcs, (unsigned)count << 2) != (size_t)count << 2) {
+      msg_printf("fatal: error reading manifest file: %s\n", manifest_fn);
+      exit(2);
     }
-    /* Cluster count limits:
-     * For FAT16: 12 <= log2_size - (log2_spc + 9) <= 16.  log2_size - 25 <= log2_spc <= log2_size - 21.
-     * For FAT32: 16 <= log2_size - (log2_spc + 9) <= 28.  log2_size - 37 <= log2_spc <= log2_size - 25.
-     */
-    if (fp.fcp.log2_sectors_per_cluster == (ub)-1) {
-      if (fp.fat_fstype == 16) {
-        min_log2_spc = ((fp.os_compat & OSC_DOS3) && log2_size >= 23) ? 2 : (int)log2_size - 25;  /* DOS 3.30 requires cluster size 2K on HDD. */
-        fp.fcp.log2_sectors_per_cluster = min_log2_spc >= 0 ? min_log2_spc : 0;
-      } else {
-        min_log2_spc = (int)log2_size - 37;
-        /* Use 4K clusters if possible. */
-        fp.fcp.log2_sectors_per_cluster = log2_size == 26 ? 1 : log2_size == 27 ? 2 : log2_size - 28U <= 40U - 28U ? 3 : min_log2_spc >= 0 ? min_log2_spc : 0;
+    compute_manifest_crcs(fip, dip, size, cluster, count, zero_cluster_crc);
+    for (i = 0; i < count; ++i) {
+      if (manifest_crcs[i] != gd((const char*)expected_crcs + (i << 2)) && ++counts[0] <= 0x10U) {
+        msg_printf("verify: cluster %lu differs: %s\n", (unsigned long)(cluster + i), image_fn);
       }
-    } else {
-      min_log2_spc = log2_size - (fp.fat_fstype == 16 ? 16U + 9U : 28U + 9U);
-      max_log2_spc = log2_size - (fp.fat_fstype == 16 ? 12U + 9U : 16U + 9U);
-      if (max_log2_spc < (int)fp.fcp.log2_sectors_per_cluster) bad_usage0("sectors-per-cluster too large for this image size");
-      if (min_log2_spc > (int)fp.fcp.log2_sectors_per_cluster) bad_usage0("sectors-per-cluster too small for this image size");
     }
-    if (fp.os_compat & (OSC_DOS3 | OSC_DOS4 | OSC_DOS5_6 | OSC_MSDOS70 | OSC_PCDOS70)) {
-      if (fp.fat_fstype != 16) bad_usage0("OS compatibility requires FAT16 on HDD");
-    }
-    if (fp.os_compat & OSC_DOS3) {
-      if (log2_size - 24U > 25U - 24U) bad_usage0("OS compatibility requires 16M or 32M");
-      if (fp.fcp.log2_sectors_per_cluster != 2) bad_usage0("OS compatibility requires cluster size 2K");
-      if (fp.fcp.rootdir_entry_count != 512) bad_usage0("OS compatiiblity requires RDEC=512 for booting");
+    counts[1] += count;
+  }
+}
+
+/* Checks the image file image_fn against the manifest file manifest_fn
+ * (written by run_manifest(...)). The offsets of the records are found by
+ * a pass over their headers, then the records are split to at most
+ * job_count contiguous parts (like in run_manifest(...)), each checked in
+ * a child process. Returns 0 if everything matches, 2 otherwise.
+ */
+static int run_verify(const char *manifest_fn, const char *image_fn, ud job_count) {
+  struct fat_image fi;
+  struct delta_input di;
+  char header[MANIFEST_HEADER_SIZE], expected_header[MANIFEST_HEADER_SIZE];
+  uint64_t size, ofs, *record_ofss = NULL;
+  ud zero_cluster_crc, count, record_count, record_capacity = 0, job, i;
+  ud counts[2] = { 0, 0 }, job_counts[2];  /* Number of mismatching and checked clusters. */
+  int manifest_fd, pipe_fds[2];
+  if ((manifest_fd = open(manifest_fn, O_RDONLY | O_BINARY)) < 0) {
+    msg_printf("fatal: error opening manifest file: %s\n", manifest_fn);
+    exit(2);
+  }
+  if (read(manifest_fd, expected_header, MANIFEST_HEADER_SIZE) != (int)MANIFEST_HEADER_SIZE || !is_same_bytes(expected_header, manifest_magic, 8)) {
+    msg_printf("fatal: not a bakefat manifest file: %s\n", manifest_fn);
+    exit(2);
+  }
+  zero_cluster_crc = open_manifest_image(&fi, &di, &size, image_fn, header);
+  if (!is_same_bytes(header, expected_header, 0x1c)) {
+    msg_printf("fatal: image file has different size or FAT geometry than the manifest: %s\n", image_fn);
+    exit(2);
+  }
+  if (gd(header + 0x1c) != gd(expected_header + 0x1c)) {
+    msg_printf("verify: metadata before the cluster area differs: %s\n", image_fn);
+    ++counts[0];
+  }
+  if (gd(header + 0x20) != gd(expected_header + 0x20)) {
+    msg_printf("verify: data after the cluster area differs: %s\n", image_fn);
+    ++counts[0];
+  }
+  for (record_count = 0, ofs = MANIFEST_HEADER_SIZE; ; ++record_count, ofs += 8U + (count << 2)) {
+    if (record_count == record_capacity) record_ofss = (uint64_t*)grow_array(record_ofss, record_count, &record_capacity, sizeof(uint64_t));
+    record_ofss[record_count] = ofs;
+    if ((count = read_manifest_record_header(&fi, manifest_fd, manifest_fn, header)) == 0) break;
+    if ((uint64_t)bakefat_lseek64(manifest_fd, ofs + 8U + (count << 2), SEEK_SET) != ofs + 8U + (count << 2)) fatal0("error seeking in manifest file");
+  }
+  if (job_count > record_count) job_count = record_count;
+  if (job_count > 1U) {
+    if (pipe(pipe_fds) != 0) fatal0("pipe failed");
+    if ((job = fork_manifest_jobs(&di, image_fn, &manifest_fd, manifest_fn, O_RDONLY, job_count)) < job_count) {
+      close(pipe_fds[0]);
+      counts[0] = counts[1] = 0;
+      i = (ud)((uint64_t)record_count * job / job_count);
+      if ((uint64_t)bakefat_lseek64(manifest_fd, record_ofss[i], SEEK_SET) != record_ofss[i]) fatal0("error seeking in manifest file");
+      verify_manifest_records(&fi, &di, size, zero_cluster_crc, manifest_fd, manifest_fn, image_fn, (ud)((uint64_t)record_count * (job + 1U) / job_count) - i, counts);
+      _exit(write(pipe_fds[1], counts, sizeof(counts)) == (int)sizeof(counts) ? 0 : 2);  /* Atomic, smaller than PIPE_BUF. */
     }
-    fp.fcp.cluster_count = ((ud)1 << (log2_size - (fp.fcp.log2_sectors_per_cluster + 9U))) - 2;  /* -2 is for the 2 special cluster entries at the beginning of the FAT table. */
-    /* fp.fcp.cluster_count = (fp.fat_fstype == 16 ? auto_fat16_cluster_counts_12 - 12 : auto_fat32_cluster_counts_16 - 16)[log2_size - (fp.fcp.log2_sectors_per_cluster + 9U)]; */
-    /* FAT filesystem cluster limits based on:
-     *
-     * [MS-EFI-FAT32]: https://github.com/LeeKyuHyuk/fat16/raw/refs/heads/master/documentation/fatgen103.pdf
-     * [FAT32-Win2000]: https://web.archive.org/web/20150511155943/https://support.microsoft.com/en-us/kb/184006/en-us
-     * [FAT32-WinXP]: https://web.archive.org/web/20150513003749/https://support.microsoft.com/en-us/kb/314463
-     * [MSDOS-Win95]: https://web.archive.org/web/20150612114245/https://support.microsoft.com/en-us/kb/67321
-     * [WinNT4]: experimentation by the Mtools team with Windows NT 4.0: https://github.com/Distrotech/mtools/blob/13058eb225d3e804c8c29a9930df0e414e75b18f/mformat.c#L222
-     * [Mtools]: https://github.com/Distrotech/mtools/blob/13058eb225d3e804c8c29a9930df0e414e75b18f/mformat.c#L222 and https://github.com/Distrotech/mtools/blob/13058eb225d3e804c8c29a9930df0e414e75b18f/msdos.h#L215-L225
-     * [Linux3.13]: https://github.com/torvalds/linux/blob/d8ec26d7f8287f5788a494f56e8814210f0e64be/include/uapi/linux/msdos_fs.h#L65-L67
-     * [Linux6.13]: https://github.com/torvalds/linux/blob/ffd294d346d185b70e28b1a28abe367bbfe53c04/include/uapi/linux/msdos_fs.h#L65-L67
-     *
-     * The documented cluster limits:
-     *
-     * * FAT12: at most 0xff4 clusters [MS-EFI-FAT32] [Linux3.13] [Linux6.13] [Mtools], at most 0xff6 clusters [MSDOS-Win95] [WinNT4]
-     * * FAT16: at least 0xff5 clusters [MS-EFI-FAT32] [Linux3.13] [Linux6.13] [Mtools], at least 0xff7 clusters [MSDOS-Win95] [WinNT4], at most 0xfff4 clusters [MS-EFI-FAT32] [Linux3.13] [Linux6.13] [Mtools]
-     * * FAT32: at least 0xfff5 clusters [MS-EFI-FAT32] [Linux3.13] [Linux6.13] [Mtools], at most 0xffffff5 clusters [FAT32-Win2000] [FAT32-WinXP], at most 0xffffff6 clusters [Linux3.13] [Linux6.13]
-     *
-     * So our conservative limits become:
-     *
-     * * FAT12: at least 1 cluster, at most 0xff4 clusters
-     * * FAT16: at least 0xff7 clusters, at most 0xfff4 clusters
-     * * FAT32: at least 0xfff5 clusters, at most 0xffffff5 clusters; but we want to fit the entire partition in <2TiB, so we will allow less
-     */
-    if (fp.fat_fstype == 16) {
-      if (fp.fcp.cluster_count == 0xfffeU) fp.fcp.cluster_count -= 10U;  /* Maximum 0xfff4 clusters on a FAT16 filesystem. */
-    } else if (fp.fat_fstype == 32) {
-      if (log2_size == 41) {  /* Avoid overflows below, make sure that fp.geometry_sector_count fits to ud (32-bit unsigned). */
-        fp.fcp.sector_count = (fp.vhd_mode >= VHD_FIXED ? VHD_MAX_SECTORS : (ud)0xffffffffU) / (255U * 63U) * (255U * 63U);  /* An upper limit. */
-       limit_fat32_by_sector_count:
-        if (fp.fcp.sector_count <= fp.hidden_sector_count + fp.reserved_sector_count) goto fatal_no_clusters;
-        /* !! TODO(pts): Make hi lower by doing this without ud overflow: (...) * 512U / ((1U << fp.fcp.log2_sectors_per_cluster) + (2U << fp.fat_count)). */
-        hi = (fp.fcp.sector_count - fp.hidden_sector_count - fp.reserved_sector_count) >> fp.fcp.log2_sectors_per_cluster;  /* An upper limit on fp.fcp.cluster_count. */
-        lo = hi - ((hi + (2U + 0x7fU)) >> 7U << (fp.fat_count - 1U));  /* A lower limit on fp.fcp.cluster_count. */
-        while (lo < hi) {  /* Binary search. About 21 iterations. */
-          mid = lo + ((hi - lo) >> 1U);
-          if (is_aligned_fat32_sector_count_at_most(&fp, mid + 1U)) {
-            lo = mid + 1U;
-          } else {
-            hi = mid;
-          }
-        }
-        if ((fp.fcp.cluster_count = lo) == 0) { fatal_no_clusters:
-          /* This can happen e.g. if a very large fp.fcp.rootdir_entry_count or fp.reserved_sector_count was specified, such as `160K RSC=314'. */
-          fatal0("FAT filesystem too small, no space for even a single cluster");
-        }
-      } else if (fp.fcp.cluster_count == (ud)0xffffffeU) {
-        fp.fcp.cluster_count -= 9U;  /* Maximum 0xffffff5 clusters on a FAT32 filesystem. */
-      } else if (log2_size == 37 && fp.vhd_mode >= VHD_FIXED) {
-        /* Limit to ~127.498 GiB instead of 128 GiB, for better VHD
-         * compatibility of the virtual IDE controller in Virtual PC.
-         *
-         * The ~127.498 GiB limit probably still applied to the virtual IDE
-         * controller in Virtual PC 2007 (no definitive evidence on the
-         * web). Hyper-V (introduced in 2008) has increased the limit to
-         * 2040 GiB.
-         */
-        fp.fcp.sector_count = (ud)65535U * 16U * 255U / (255U * 63U) * (255U * 63U);
-        goto limit_fat32_by_sector_count;
-      }
+    close(pipe_fds[1]);
+    for (i = 0; i < job_count && read(pipe_fds[0], job_counts, sizeof(job_counts)) == (int)sizeof(job_counts); ++i) {
+      counts[0] += job_counts[0];
+      counts[1] += job_counts[1];
     }
-    /*if (fp.fat_fstype == 32 && log2_size == 41) fp.fcp.cluster_count -= 0x1fff5 + (0x7ebbc5>>6) - 0x1f73e;*/
-    fp.fcp.sectors_per_fat = fp.fat_fstype == 32 ? (fp.fcp.cluster_count + (2U + 0x7fU)) >> 7U : /* fat16: */ (fp.fcp.cluster_count + (2U + 0xffU)) >> 8U;
-    fat_clusters_sec_ofs = fp.hidden_sector_count + fp.reserved_sector_count + ((ud)fp.fcp.sectors_per_fat << (fp.fat_count - 1U)) + (fp.fcp.rootdir_entry_count >> 4U);
-    fat_clusters_sec_ofs += align_fat(&fp, fat_clusters_sec_ofs);
-   recalc_sector_count:
-    fp.fcp.sector_count = fat_clusters_sec_ofs + (fp.fcp.cluster_count << fp.fcp.log2_sectors_per_cluster);
-    if (fp.fat_fstype == 16 && log2_size == 25 && fp.fcp.log2_sectors_per_cluster == 2 && fp.fcp.sector_count >> 16) {  /* Use at most 0xffff sectors, for compatibility with DOS 3.30. 4.01 supports much more, reaching 2 GiB FAT16. */
-      fp.fcp.cluster_count -= (fp.fcp.sector_count - 0xffffU - 1U + ((ud)1 << 2U)) >> 2U;
-      goto recalc_sector_count;
+    close(pipe_fds[0]);
+    if (wait_manifest_jobs(job_count) != 0 || i != job_count) {
+      msg_printf("fatal: error verifying image file: %s\n", image_fn);
+      exit(2);
     }
-#    if DEBUG
-      if (fp.fcp.cluster_count > ((ud)0xffffffffU >> fp.fcp.log2_sectors_per_cluster) ||
-          fp.fcp.sector_count <= fat_clusters_sec_ofs ||
-          (fp.fcp.cluster_count << fp.fcp.log2_sectors_per_cluster) > fp.fcp.sector_count - fat_clusters_sec_ofs
-         ) fatal0("ASSERT_SECTOR_COUNT_OVERFLOW");
-#    endif
-    adjust_hdd_geometry(&fp, fat_clusters_sec_ofs);
+  } else {
+    if ((uint64_t)bakefat_lseek64(manifest_fd, record_ofss[0], SEEK_SET) != record_ofss[0]) fatal0("error seeking in manifest file");
+    verify_manifest_records(&fi, &di, size, zero_cluster_crc, manifest_fd, manifest_fn, image_fn, record_count, counts);
   }
-#  if DEBUG
-    msg_printf("info: cluster_count=0x%lx sector_count=%lu=0x%lx geometry_sector_count=%lu=0x%lx CHS=%lu:%u:%u\n", (unsigned long)fp.fcp.cluster_count, (unsigned long)fp.fcp.sector_count, (unsigned long)fp.fcp.sector_count, (unsigned long)fp.geometry_sector_count, (unsigned long)fp.geometry_sector_count, (unsigned long)fp.cylinder_count, (unsigned)fp.fcp.head_count, (unsigned)fp.fcp.sectors_per_track);
-#  endif
-  if ((sfd = open(sfn, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666)) < 0) {
-    msg_printf("fatal: error opening output file: %s\n", sfn);
-    exit(2);
+  free_memory(record_ofss);
+  close(manifest_fd);
+  close(ctx->sfd);
+  if (counts[0]) {
+    msg_printf("fatal: image file does not match manifest in %lu cluster%s or region%s (%lu cluster%s checked): %s\n", (unsigned long)counts[0], "s" + (counts[0] == 1), "s" + (counts[0] == 1), (unsigned long)counts[1], "s" + (counts[1] == 1), image_fn);
+    return 2;
   }
-  bakefat_set_sparse(sfd);
-  create_fat(&fp);
-  close(sfd);
+#ifdef DEBUG
+  msg_printf("info: verified %lu cluster%s: %s\n", (unsigned long)counts[1], "s" + (counts[1] == 1), image_fn);
+#endif
   return 0;
 }
+
+/* Parses the optional -j<jobs> flag at *argv_ptr, skipping it. Returns the
+ * job count, by default the number of CPUs.
+ */
+static ud parse_jobs_flag(char ***argv_ptr) {
+  ud u = 0;
+#ifdef _SC_NPROCESSORS_ONLN
+  long l;
+#endif
+  if (**argv_ptr && (**argv_ptr)[0] == '-' && (**argv_ptr)[1] == 'j') {
+    if (parse_ud(**argv_ptr + 2, &u) != PARSEINT_OK || u == 0) bad_usage1("invalid job count in flag", **argv_ptr);
+    ++*argv_ptr;
+  }
+  if (u == 0) {
+    u = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+    if ((l = sysconf(_SC_NPROCESSORS_ONLN)) > 1) u = (ud)l;
+#endif
+  }
+  return u;
+}
+#endif  /* BAKEFAT_POSIX */
+
+int main(int argc, char **argv) {
+#ifdef BAKEFAT_POSIX
+  const char *argv0 = argv[0];
+  ud u;
+#endif
+  (void)argc;
+#  ifdef __MMLIBC386__
+  stdout_fd = STDERR_FILENO;  /* For msg_printf(...). */
+#  endif
+  init_state(ctx);
+#ifdef BAKEFAT_POSIX
+  if (argv[1] && strcmp(argv[1], "--batch") == 0) {
+    argv += 2;
+    u = parse_jobs_flag(&argv);
+    if (!*argv || argv[1]) bad_usage0("--batch needs a single manifest file");
+    return run_batch(argv0, *argv, u);
+  }
+  if (argv[1] && strcmp(argv[1], "--serve") == 0) {
+    if (!argv[2] || argv[3]) bad_usage0("--serve needs a single socket filename");
+    run_server(argv0, argv[2]);
+  }
+  if (argv[1] && strcmp(argv[1], "--delta") == 0) {
+    if (!argv[2] || !argv[3] || !argv[4] || argv[5]) bad_usage0("--delta needs an old image file, a new image file and a delta file");
+    return run_delta(argv[2], argv[3], argv[4]);
+  }
+#  ifdef BAKEFAT_DEDUPE
+  if (argv[1] && strcmp(argv[1], "--dedupe") == 0) {
+    if (!argv[2]) bad_usage0("--dedupe needs one or more image files");
+    return run_dedupe(argv + 2);
+  }
+#  endif
+  if (argv[1] && strcmp(argv[1], "--manifest") == 0) {
+    argv += 2;
+    u = parse_jobs_flag(&argv);
+    if (!argv[0] || !argv[1] || argv[2]) bad_usage0("--manifest needs an image file and a manifest file");
+    return run_manifest(argv[0], argv[1], u);
+  }
+  if (argv[1] && strcmp(argv[1], "--verify") == 0) {
+    argv += 2;
+    u = parse_jobs_flag(&argv);
+    if (!argv[0] || !argv[1] || argv[2]) bad_usage0("--verify needs a manifest file and an image file");
+    return run_verify(argv[0], argv[1], u);
+  }
+  if (argv[1] && strcmp(argv[1], "--apply") == 0) {
+    if (!argv[2] || !argv[3] || argv[4]) bad_usage0("--apply needs a delta file and an image file");
+    return run_apply_delta(argv[2], argv[3]);
+  }
+#endif
+  return create_image_main(argv, -1);
+}
+#endif  /* else BAKEFAT_LIBRARY */
@@ -0,0 +1,70 @@
+/*
+ * bakefat.h: library interface of bakefat (libbakefat.a)
+ *
+ * Build the library with `make libbakefat.a', which compiles bakefat.c with
+ * -DBAKEFAT_LIBRARY.
+ *
+ * The library is reentrant: all state is in a struct bakefat_context, so
+ * calls with different contexts may overlap (e.g. from multiple threads).
+ * Calls with the same context must not overlap. The library is thread-safe
+ * only if it was compiled with a thread-local storage class (automatic for
+ * GCC, Clang, MSVC and C11 compilers, the build fails with other
+ * compilers unless -DBAKEFAT_THREAD_LOCAL=... is specified). If it is
+ * compiled with -DBAKEFAT_THREAD_LOCAL= (empty), calls must not overlap
+ * even with different contexts. Error messages are printed
+ * to stderr. Each function returning int returns the exit code of the
+ * command-line tool: 0 on success, 1 on usage error, 2 on other errors.
+ * After a failed call, the files opened by the call are closed, and only
+ * bakefat_free_context(...) may be called on the context.
+ */
+
+#ifndef _BAKEFAT_H
+#define _BAKEFAT_H 1
+
+struct bakefat_context;  /* Opaque. */
+
+/* Returns a new context, or NULL on out of memory. */
+struct bakefat_context *bakefat_new_context(void);
+
+/* Frees ctx, including all memory allocated by the calls using it. Also
+ * closes the files left open by a failed call. ctx may be NULL.
+ */
+void bakefat_free_context(struct bakefat_context *ctx);
+
+/* Parses the image creation flags in argv (e.g. "256M", "FAT32",
+ * "SYS=io.sys", NULL-terminated, without the program name and the output
+ * filename) to ctx. The EDIT flag is not supported, use
+ * bakefat_create_image(...) for that. The strings in argv are copied, they
+ * are not modified, and they may be freed after the call.
+ */
+int bakefat_parse_flags(struct bakefat_context *ctx, char **argv);
+
+/* Computes the FAT geometry (cluster size, FAT size etc.) of the image from
+ * the flags parsed by bakefat_parse_flags(...), and plans the placement of
+ * the files (SYS=, TREE= and PREALLOC=) in the image.
+ */
+int bakefat_solve_fat_geometry(struct bakefat_context *ctx);
+
+/* Writes the image computed by bakefat_solve_fat_geometry(...) to fd, which
+ * must be open for reading and writing, and should be empty (unless REUSE
+ * is used). filename is used in error messages, and as the base of a
+ * relative PARENT= filename.
+ *
+ * There is no memory buffer output: the image is written with seeks (and
+ * holes), and PARENT= and REUSE also read from fd. To get the image in
+ * memory, pass an fd of a memory-backed file (e.g. from memfd_create(2) on
+ * Linux), and mmap(2) or read(2) it afterwards.
+ */
+int bakefat_write_fat_image(struct bakefat_context *ctx, int fd, const char *filename);
+
+/* Creates (or, with the EDIT flag, edits) an image file, as if the bakefat
+ * command-line tool was run with argv (argv[0] is the program name, the last
+ * element is the output filename, NULL-terminated). If fd is nonnegative,
+ * the image is written to fd (which must be open for reading and writing,
+ * and should be empty unless EDIT is used) instead of opening the output
+ * filename, which is then used only in error messages. The strings in argv
+ * may be modified. It uses a temporary context, which is always freed.
+ */
+int bakefat_create_image(char **argv, int fd);
+
+#endif  /* _BAKEFAT_H */